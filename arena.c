@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include "arena.h"
+
+// Every allocation is rounded up to this alignment
+#define ARENA_ALIGN alignof(max_align_t)
+
+/**
+ * Allocates a fresh chunk with at least min_size usable bytes
+ */
+static ArenaChunk *chunk_new(size_t min_size, size_t prev_size) {
+    size_t size = prev_size ? prev_size * 2 : ARENA_CHUNK_SIZE;
+    while (size < min_size) {
+        size *= 2;
+    }
+
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + size);
+    if (chunk == NULL) {
+        perror("arena malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+/**
+ * Allocates size bytes aligned for any type
+ * Note: Moves on to the next retained chunk (or appends a new one)
+ *       when the current chunk is full
+ */
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (arena->cur == NULL) {
+        arena->head = arena->cur = chunk_new(size, 0);
+    }
+
+    while (arena->cur->size - arena->cur->used < size) {
+        ArenaChunk *next = arena->cur->next;
+        if (next == NULL) {
+            next = chunk_new(size, arena->cur->size);
+            arena->cur->next = next;
+        }
+        next->used = 0;
+        arena->cur = next;
+    }
+
+    void *ptr = arena->cur->data + arena->cur->used;
+    arena->cur->used += size;
+    return ptr;
+}
+
+/**
+ * Copies len bytes of str into the arena and NULL terminates them
+ */
+char *arena_strndup(Arena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/**
+ * Releases every allocation in O(1)
+ * Note: Only the first chunk is rewound here; later chunks are rewound
+ *       lazily by arena_alloc() as it reaches them again
+ */
+void arena_reset(Arena *arena) {
+    if (arena->head == NULL) return;
+    arena->head->used = 0;
+    arena->cur = arena->head;
+}
+
+/**
+ * Records the current allocation point
+ */
+ArenaMark arena_mark(const Arena *arena) {
+    ArenaMark mark = {arena->cur, arena->cur ? arena->cur->used : 0};
+    return mark;
+}
+
+/**
+ * Releases everything allocated since mark was taken
+ * Note: Chunks after the marked one are rewound lazily, as in arena_reset()
+ */
+void arena_rewind(Arena *arena, ArenaMark mark) {
+    if (mark.chunk == NULL) {
+        arena_reset(arena);
+        return;
+    }
+    mark.chunk->used = mark.used;
+    arena->cur = mark.chunk;
+}
+
+/**
+ * Returns all chunks to the system
+ */
+void arena_free(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = arena->cur = NULL;
+}
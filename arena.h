@@ -0,0 +1,71 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>  // For size_t
+
+// Size of the first chunk; later chunks double up to fit large requests
+#define ARENA_CHUNK_SIZE 4096
+
+/**
+ * One block of arena memory; chunks form a singly linked list
+ */
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;  // Next chunk (kept across resets)
+    size_t size;              // Usable bytes in data
+    size_t used;              // Bytes handed out from data
+    char data[];              // Allocation space
+} ArenaChunk;
+
+/**
+ * Bump allocator owning everything built for one command line
+ * Memory is released all at once by arena_reset(); chunks are kept so
+ * the steady state performs no malloc/free calls.
+ */
+typedef struct Arena {
+    ArenaChunk *head;  // First chunk
+    ArenaChunk *cur;   // Chunk allocations are currently served from
+} Arena;
+
+#define ARENA_INIT {NULL, NULL}
+
+/**
+ * A point in an arena's allocation history, see arena_mark()
+ */
+typedef struct ArenaMark {
+    ArenaChunk *chunk;  // Chunk that was current (NULL if nothing was allocated)
+    size_t used;        // Its fill level at the time
+} ArenaMark;
+
+/**
+ * Allocates size bytes aligned for any type
+ * @return Pointer into the arena; exits the shell on allocation failure
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/**
+ * Copies len bytes of str into the arena and NULL terminates them
+ * @return Arena-owned string
+ */
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+
+/**
+ * Releases every allocation in O(1); chunks are kept for reuse
+ */
+void arena_reset(Arena *arena);
+
+/**
+ * Records the current allocation point
+ */
+ArenaMark arena_mark(const Arena *arena);
+
+/**
+ * Releases everything allocated since mark was taken
+ */
+void arena_rewind(Arena *arena, ArenaMark mark);
+
+/**
+ * Returns all chunks to the system
+ */
+void arena_free(Arena *arena);
+
+#endif
@@ -0,0 +1,472 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arith.h"
+#include "io_helpers.h"
+
+// Names this long or longer are copied to the heap before setVar
+#define ARITH_NAME_MAX 64
+
+// Binary operators, lowest precedence first
+typedef enum {
+    OP_NONE, OP_LOR, OP_LAND, OP_BOR, OP_BXOR, OP_BAND, OP_EQ, OP_NE,
+    OP_LT, OP_LE, OP_GT, OP_GE, OP_SHL, OP_SHR, OP_ADD, OP_SUB,
+    OP_MUL, OP_DIV, OP_MOD, OP_POW
+} ArithOp;
+
+// Precedence of each ArithOp (higher binds tighter)
+static const int OP_PREC[] = {
+    0, 1, 2, 3, 4, 5, 6, 6, 7, 7, 7, 7, 8, 8, 9, 9, 10, 10, 10, 11
+};
+
+// Parser state for one expression
+typedef struct Arith {
+    const char *pos;
+    const char *end;
+    Variable **vars;
+    int skip;             // Inside an unevaluated branch: no side effects or errors
+    const char *error;    // First error found, or NULL
+} Arith;
+
+static int64_t parse_comma(Arith *a);
+static int64_t parse_assign(Arith *a);
+static int64_t parse_unary(Arith *a);
+
+static void fail(Arith *a, const char *msg) {
+    if (a->error == NULL) a->error = msg;
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static void skip_space(Arith *a) {
+    while (a->pos < a->end && is_space(*a->pos)) a->pos++;
+}
+
+// Character i bytes past the current position, or '\0' past the end
+static char at(const Arith *a, size_t i) {
+    return (size_t)(a->end - a->pos) > i ? a->pos[i] : '\0';
+}
+
+static int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static int is_name_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static int is_name_char(char c) {
+    return is_name_start(c) || is_digit(c);
+}
+
+/* Parse an integer constant: decimal, 0x hex or 0 octal
+ * Return: number of bytes used, or 0 if s does not hold a valid constant
+ */
+static size_t parse_number(const char *s, const char *end, int64_t *value) {
+    const char *p = s;
+    unsigned base = 10;
+    if (end - p > 1 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        p += 2;
+    } else if (p < end && p[0] == '0') {
+        base = 8;
+    }
+
+    uint64_t n = 0;
+    const char *digits = p;
+    for (; p < end && is_name_char(*p); p++) {
+        unsigned d;
+        if (is_digit(*p)) d = *p - '0';
+        else if (*p != '_') d = (*p | 0x20) - 'a' + 10;
+        else return 0;
+        if (d >= base) return 0;
+        n = n * base + d;   // Wraps like the rest of the arithmetic
+    }
+    if (p == digits) return 0;
+    *value = (int64_t)n;
+    return p - s;
+}
+
+// Read a variable as an integer; unset and empty variables are 0
+static int64_t read_var(Arith *a, const char *name, size_t len) {
+    Variable *var = find_var(*a->vars, name, len);
+    if (var == NULL) return 0;
+
+    const char *s = var->val;
+    const char *end = s + strlen(s);
+    while (s < end && is_space(*s)) s++;
+    while (end > s && is_space(end[-1])) end--;
+    if (s == end) return 0;
+
+    int negative = 0;
+    if (*s == '-' || *s == '+') {
+        negative = *s == '-';
+        s++;
+    }
+    int64_t value;
+    if (parse_number(s, end, &value) != (size_t)(end - s)) {
+        if (!a->skip) fail(a, "variable is not an integer");
+        return 0;
+    }
+    return negative ? (int64_t)(0 - (uint64_t)value) : value;
+}
+
+// Store value in a variable, overwriting the old value in place when it fits
+static void write_var(Arith *a, const char *name, size_t len, int64_t value) {
+    if (a->skip) return;
+
+    char num[ARITH_NUM_MAX];
+    size_t n = arith_format(value, num);
+    Variable *var = find_var(*a->vars, name, len);
+    if (var != NULL && overwrite_var(var, num, n) == 0) return;
+
+    char short_name[ARITH_NAME_MAX];
+    char *title = len < sizeof(short_name) ? short_name : malloc(len + 1);
+    if (title == NULL) {
+        fail(a, "out of memory");
+        return;
+    }
+    memcpy(title, name, len);
+    title[len] = '\0';
+    setVar(a->vars, num, title);
+    if (title != short_name) free(title);
+}
+
+/* Parse a variable name, optionally written $name or ${name}, or a
+ * positional parameter written $1 or ${1}
+ * Return: length of the name (0 if there is none); *name is set to its start
+ */
+static size_t parse_name(Arith *a, const char **name) {
+    const char *start = a->pos;
+    int braced = 0;
+    if (at(a, 0) == '$' && at(a, 1) == '{') {
+        a->pos += 2;
+        braced = 1;
+    } else if (at(a, 0) == '$') {
+        a->pos++;
+    }
+    // Positional parameters ($1, ${10}) need the $ to tell them from numbers
+    int positional = a->pos > start && a->pos < a->end && is_digit(*a->pos);
+    if (a->pos >= a->end || (!positional && !is_name_start(*a->pos))) {
+        a->pos = start;
+        return 0;
+    }
+    *name = a->pos;
+    if (positional) {
+        while (a->pos < a->end && is_digit(*a->pos)) a->pos++;
+    } else {
+        while (a->pos < a->end && is_name_char(*a->pos)) a->pos++;
+    }
+    size_t len = a->pos - *name;
+    if (braced) {
+        if (at(a, 0) != '}') {
+            a->pos = start;
+            return 0;
+        }
+        a->pos++;
+    }
+    return len;
+}
+
+// Number, variable (with postfix ++/--) or parenthesized expression
+static int64_t parse_primary(Arith *a) {
+    skip_space(a);
+    if (a->pos >= a->end) {
+        fail(a, "operand expected");
+        return 0;
+    }
+
+    // $((...)) nested inside an expression is just a parenthesized group
+    if (at(a, 0) == '$' && at(a, 1) == '(') a->pos++;
+    if (*a->pos == '(') {
+        a->pos++;
+        int64_t value = parse_comma(a);
+        skip_space(a);
+        if (at(a, 0) != ')') {
+            fail(a, "missing )");
+            return 0;
+        }
+        a->pos++;
+        return value;
+    }
+
+    if (is_digit(*a->pos)) {
+        int64_t value = 0;
+        size_t used = parse_number(a->pos, a->end, &value);
+        if (used == 0) {
+            fail(a, "invalid number");
+            return 0;
+        }
+        a->pos += used;
+        return value;
+    }
+
+    const char *name;
+    size_t len = parse_name(a, &name);
+    if (len == 0) {
+        fail(a, "operand expected");
+        return 0;
+    }
+    int64_t value = read_var(a, name, len);
+    skip_space(a);
+    if ((at(a, 0) == '+' || at(a, 0) == '-') && at(a, 1) == at(a, 0)) {
+        int delta = *a->pos == '+' ? 1 : -1;
+        a->pos += 2;
+        write_var(a, name, len, (int64_t)((uint64_t)value + delta));
+    }
+    return value;
+}
+
+// Unary operators and prefix ++/--
+static int64_t parse_unary(Arith *a) {
+    skip_space(a);
+    if ((at(a, 0) == '+' || at(a, 0) == '-') && at(a, 1) == at(a, 0)) {
+        int delta = *a->pos == '+' ? 1 : -1;
+        a->pos += 2;
+        skip_space(a);
+        const char *name;
+        size_t len = parse_name(a, &name);
+        if (len == 0) {
+            fail(a, "++ or -- needs a variable");
+            return 0;
+        }
+        int64_t value = (int64_t)((uint64_t)read_var(a, name, len) + delta);
+        write_var(a, name, len, value);
+        return value;
+    }
+    if (a->pos < a->end) {
+        switch (*a->pos) {
+            case '-': a->pos++; return (int64_t)(0 - (uint64_t)parse_unary(a));
+            case '+': a->pos++; return parse_unary(a);
+            case '!': a->pos++; return !parse_unary(a);
+            case '~': a->pos++; return ~parse_unary(a);
+        }
+    }
+    return parse_primary(a);
+}
+
+/* Recognize the binary operator at the current position
+ * Return: the operator, or OP_NONE; *len is set to its length
+ * Note: Assignment operators such as <<= and &= are not binary operators
+ */
+static ArithOp peek_binop(Arith *a, size_t *len) {
+    skip_space(a);
+    if (a->pos >= a->end) return OP_NONE;
+    char c = a->pos[0];
+    char next = a->pos + 1 < a->end ? a->pos[1] : '\0';
+    char after = a->pos + 2 < a->end ? a->pos[2] : '\0';
+    ArithOp op = OP_NONE;
+    *len = 2;
+    switch (c) {
+        case '|': op = next == '|' ? OP_LOR : OP_BOR; break;
+        case '&': op = next == '&' ? OP_LAND : OP_BAND; break;
+        case '^': op = OP_BXOR; break;
+        case '=': return next == '=' ? OP_EQ : OP_NONE;
+        case '!': return next == '=' ? OP_NE : OP_NONE;
+        case '<':
+            if (next == '<') return after == '=' ? OP_NONE : OP_SHL;
+            if (next == '=') return OP_LE;
+            op = OP_LT;
+            break;
+        case '>':
+            if (next == '>') return after == '=' ? OP_NONE : OP_SHR;
+            if (next == '=') return OP_GE;
+            op = OP_GT;
+            break;
+        case '*': op = next == '*' ? OP_POW : OP_MUL; break;
+        case '+': op = OP_ADD; break;
+        case '-': op = OP_SUB; break;
+        case '/': op = OP_DIV; break;
+        case '%': op = OP_MOD; break;
+        default: return OP_NONE;
+    }
+    if (op == OP_LOR || op == OP_LAND || op == OP_POW) {
+        return after == '=' && op == OP_POW ? OP_NONE : op;
+    }
+    // A single character operator followed by = is an assignment ("a += b")
+    *len = 1;
+    return next == '=' ? OP_NONE : op;
+}
+
+// Apply a binary operator with wrapping 64-bit semantics
+static int64_t apply(Arith *a, ArithOp op, int64_t x, int64_t y) {
+    uint64_t ux = (uint64_t)x, uy = (uint64_t)y;
+    switch (op) {
+        case OP_BOR: return x | y;
+        case OP_BXOR: return x ^ y;
+        case OP_BAND: return x & y;
+        case OP_EQ: return x == y;
+        case OP_NE: return x != y;
+        case OP_LT: return x < y;
+        case OP_LE: return x <= y;
+        case OP_GT: return x > y;
+        case OP_GE: return x >= y;
+        case OP_SHL: return (int64_t)(ux << (y & 63));
+        case OP_SHR: return x >> (y & 63);
+        case OP_ADD: return (int64_t)(ux + uy);
+        case OP_SUB: return (int64_t)(ux - uy);
+        case OP_MUL: return (int64_t)(ux * uy);
+        case OP_DIV:
+        case OP_MOD:
+            if (y == 0) {
+                if (!a->skip) fail(a, "division by zero");
+                return 0;
+            }
+            if (y == -1) return op == OP_DIV ? (int64_t)(0 - ux) : 0;
+            return op == OP_DIV ? x / y : x % y;
+        case OP_POW: {
+            if (y < 0) {
+                if (!a->skip) fail(a, "exponent less than 0");
+                return 0;
+            }
+            uint64_t result = 1;
+            for (; y > 0; y >>= 1, ux *= ux) {
+                if (y & 1) result *= ux;
+            }
+            return (int64_t)result;
+        }
+        default: return 0;
+    }
+}
+
+/* Parse binary operators binding at least as tightly as min_prec
+ * && and || skip their right side when the left decides the result.
+ */
+static int64_t parse_binary(Arith *a, int min_prec) {
+    int64_t left = parse_unary(a);
+    while (a->error == NULL) {
+        size_t len;
+        ArithOp op = peek_binop(a, &len);
+        if (op == OP_NONE || OP_PREC[op] < min_prec) break;
+        a->pos += len;
+
+        if (op == OP_LOR || op == OP_LAND) {
+            int decided = op == OP_LOR ? left != 0 : left == 0;
+            a->skip += decided;
+            int64_t right = parse_binary(a, OP_PREC[op] + 1);
+            a->skip -= decided;
+            left = decided ? op == OP_LOR : right != 0;
+            continue;
+        }
+        // ** is right associative
+        int64_t right = parse_binary(a, op == OP_POW ? OP_PREC[op] : OP_PREC[op] + 1);
+        left = apply(a, op, left, right);
+    }
+    return left;
+}
+
+// cond ? x : y, evaluating only the chosen branch
+static int64_t parse_ternary(Arith *a) {
+    int64_t cond = parse_binary(a, 1);
+    skip_space(a);
+    if (a->error != NULL || at(a, 0) != '?') return cond;
+    a->pos++;
+
+    a->skip += !cond;
+    int64_t yes = parse_comma(a);
+    a->skip -= !cond;
+    skip_space(a);
+    if (at(a, 0) != ':') {
+        fail(a, "missing : in ?:");
+        return 0;
+    }
+    a->pos++;
+    a->skip += !!cond;
+    int64_t no = parse_ternary(a);
+    a->skip -= !!cond;
+    return cond ? yes : no;
+}
+
+// name = expr and the compound assignments; right associative
+static int64_t parse_assign(Arith *a) {
+    skip_space(a);
+    const char *start = a->pos;
+    const char *name;
+    size_t len = parse_name(a, &name);
+    if (len > 0) {
+        skip_space(a);
+        // Operator applied before storing, and the length of the assignment token
+        ArithOp op = OP_NONE;
+        size_t op_len = 0;
+        char c = at(a, 0), next = at(a, 1);
+        if (c == '=' && next != '=') {
+            op_len = 1;
+        } else if ((c == '<' || c == '>') && next == c && at(a, 2) == '=') {
+            op = c == '<' ? OP_SHL : OP_SHR;
+            op_len = 3;
+        } else if (next == '=') {
+            switch (c) {
+                case '+': op = OP_ADD; break;
+                case '-': op = OP_SUB; break;
+                case '*': op = OP_MUL; break;
+                case '/': op = OP_DIV; break;
+                case '%': op = OP_MOD; break;
+                case '&': op = OP_BAND; break;
+                case '^': op = OP_BXOR; break;
+                case '|': op = OP_BOR; break;
+            }
+            op_len = op != OP_NONE ? 2 : 0;
+        }
+        if (op_len > 0) {
+            a->pos += op_len;
+            int64_t value = parse_assign(a);
+            if (op != OP_NONE) {
+                value = apply(a, op, read_var(a, name, len), value);
+            }
+            if (a->error == NULL) write_var(a, name, len, value);
+            return value;
+        }
+    }
+    a->pos = start;
+    return parse_ternary(a);
+}
+
+// expr, expr: evaluates both and yields the last
+static int64_t parse_comma(Arith *a) {
+    int64_t value = parse_assign(a);
+    skip_space(a);
+    while (a->error == NULL && at(a, 0) == ',') {
+        a->pos++;
+        value = parse_assign(a);
+        skip_space(a);
+    }
+    return value;
+}
+
+/**
+ * Formats a value in decimal
+ */
+size_t arith_format(int64_t value, char *buf) {
+    char digits[ARITH_NUM_MAX];
+    char *p = digits + sizeof(digits);
+    uint64_t n = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    if (value < 0) *--p = '-';
+
+    size_t len = digits + sizeof(digits) - p;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    return len;
+}
+
+/**
+ * Evaluates the text of an arithmetic expansion
+ */
+int arith_eval(const char *expr, size_t len, Variable **vars, int64_t *result) {
+    Arith a = {expr, expr + len, vars, 0, NULL};
+    skip_space(&a);
+    // An empty expression is 0, as in other shells
+    *result = a.pos < a.end ? parse_comma(&a) : 0;
+    if (a.error == NULL && a.pos < a.end) {
+        fail(&a, "syntax error");
+    }
+    if (a.error != NULL) {
+        display_error("ERROR: Arithmetic expansion: ", a.error);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef ARITH_H
+#define ARITH_H
+
+#include <stddef.h>   // For size_t
+#include <stdint.h>   // For int64_t
+#include "variables.h"
+
+// Room for a formatted int64_t and its terminator
+#define ARITH_NUM_MAX 24
+
+/**
+ * Evaluates the text of an arithmetic expansion $((expr))
+ * @param expr Expression text (without the surrounding $(( and )))
+ * @param len Number of bytes of expr
+ * @param vars Pointer to the variable list head pointer
+ * @param result Set to the value of the expression
+ * @return 0 on success, -1 on a malformed expression or division by zero
+ * Note: Arithmetic is 64-bit two's complement with C precedence:
+ *         , = += -= *= /= %= <<= >>= &= ^= |= ?: || && | ^ &
+ *         == != < <= > >= << >> + - * / % ** ! ~ ++ -- ( )
+ *       Names (optionally written $name or ${name}) read variables as
+ *       integers, unset or empty ones as 0. Assignments and ++/-- update
+ *       the variable list. Errors are reported with display_error.
+ */
+int arith_eval(const char *expr, size_t len, Variable **vars, int64_t *result);
+
+/**
+ * Formats a value in decimal
+ * @param value Value to format
+ * @param buf Buffer of at least ARITH_NUM_MAX bytes
+ * @return Length of the NULL terminated text written to buf
+ */
+size_t arith_format(int64_t value, char *buf);
+
+#endif
@@ -0,0 +1,511 @@
+/* Micro-benchmarks for the shell's core paths
+ * Usage: mysh_bench [results.json]
+ * Each benchmark is calibrated so one repetition takes at least
+ * MIN_REP_NS, warmed up once, then repeated REPS times. Per-operation
+ * times are summarized (median, mean, stddev, 95% confidence interval)
+ * on stderr and written as JSON for regression tracking.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "arena.h"
+#include "builtins.h"
+#include "commands.h"
+#include "io_helpers.h"
+#include "script.h"
+#include "source_cache.h"
+#include "strbuf.h"
+#include "variables.h"
+
+#define REPS 15
+#define MIN_REP_NS 20000000ull
+#define MAX_RESULTS 64
+// Size of the file wc and cat are run over
+#define LARGE_FILE_SIZE ((size_t)64 << 20)
+
+// Summary of one benchmark
+typedef struct BenchResult {
+    char name[64];
+    size_t iterations;      // Operations per repetition
+    double median_ns;       // Per-operation times
+    double mean_ns;
+    double stddev_ns;
+    double min_ns;
+    double max_ns;
+    double ci95_ns;         // Half-width of the 95% confidence interval of the mean
+    double bytes_per_op;    // For throughput benchmarks, else 0
+} BenchResult;
+
+/* Type for benchmark bodies
+ * Input: benchmark context and the number of operations to run
+ */
+typedef void (*bench_fn)(void *ctx, size_t iters);
+
+static BenchResult results[MAX_RESULTS];
+static size_t result_count = 0;
+
+// Keeps results observable so the optimizer can't drop the work
+static volatile size_t sink;
+
+// Two-sided 95% Student t values for 1..30 degrees of freedom
+static const double T95[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned long long time_rep(bench_fn fn, void *ctx, size_t iters) {
+    unsigned long long start = now_ns();
+    fn(ctx, iters);
+    return now_ns() - start;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Run and record one benchmark
+ * fixed_iters of 0 calibrates the iteration count; otherwise every
+ * repetition runs exactly fixed_iters operations (for slow operations)
+ */
+static void run_bench(const char *name, bench_fn fn, void *ctx, size_t fixed_iters, double bytes_per_op) {
+    size_t iters = fixed_iters ? fixed_iters : 1;
+    while (!fixed_iters && time_rep(fn, ctx, iters) < MIN_REP_NS) {
+        iters *= 2;
+    }
+    time_rep(fn, ctx, iters);  // Warm up
+
+    double samples[REPS];
+    for (int r = 0; r < REPS; r++) {
+        samples[r] = (double)time_rep(fn, ctx, iters) / iters;
+    }
+
+    BenchResult *res = &results[result_count++];
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    res->iterations = iters;
+    res->bytes_per_op = bytes_per_op;
+
+    double sum = 0;
+    for (int r = 0; r < REPS; r++) sum += samples[r];
+    res->mean_ns = sum / REPS;
+    double var = 0;
+    for (int r = 0; r < REPS; r++) var += (samples[r] - res->mean_ns) * (samples[r] - res->mean_ns);
+    res->stddev_ns = sqrt(var / (REPS - 1));
+    res->ci95_ns = T95[REPS - 2] * res->stddev_ns / sqrt(REPS);
+
+    qsort(samples, REPS, sizeof(double), compare_double);
+    res->median_ns = samples[REPS / 2];
+    res->min_ns = samples[0];
+    res->max_ns = samples[REPS - 1];
+
+    fprintf(stderr, "%-32s %12.1f ns/op  +/- %8.1f  (%zu ops x %d)", name,
+            res->median_ns, res->ci95_ns, iters, REPS);
+    if (bytes_per_op > 0) {
+        fprintf(stderr, "  %.0f MB/s", bytes_per_op / res->median_ns * 1e9 / (1 << 20));
+    }
+    fputc('\n', stderr);
+}
+
+// ===== Tokenizing and expansion =====
+
+typedef struct TokenizeCtx {
+    const char *line;
+    Variable *vars;
+    Arena arena;
+} TokenizeCtx;
+
+static void bench_tokenize(void *arg, size_t iters) {
+    TokenizeCtx *ctx = arg;
+    size_t len = strlen(ctx->line);
+    char buf[256];
+    for (size_t i = 0; i < iters; i++) {
+        memcpy(buf, ctx->line, len + 1);  // tokenize_input splits in place
+        arena_reset(&ctx->arena);
+        size_t count = 0;
+        tokenize_input(buf, &count, &ctx->vars, &ctx->arena);
+        sink += count;
+    }
+}
+
+typedef struct ExpandCtx {
+    const char *input;
+    Variable *vars;
+    StrBuf out;
+} ExpandCtx;
+
+static void bench_expand_variables(void *arg, size_t iters) {
+    ExpandCtx *ctx = arg;
+    size_t len = strlen(ctx->input);
+    for (size_t i = 0; i < iters; i++) {
+        strbuf_reset(&ctx->out);
+        expand_variables(ctx->input, len, &ctx->out, &ctx->vars);
+        sink += ctx->out.len;
+    }
+}
+
+static void bench_expandVars(void *arg, size_t iters) {
+    ExpandCtx *ctx = arg;
+    for (size_t i = 0; i < iters; i++) {
+        char *s = expandVars(&ctx->vars, ctx->input);
+        sink += s != NULL;
+        free(s);
+    }
+}
+
+// ===== Variables =====
+
+typedef struct VarCtx {
+    Variable *vars;
+    char (*names)[24];
+    size_t count;
+} VarCtx;
+
+static void var_ctx_init(VarCtx *ctx, size_t count) {
+    ctx->vars = NULL;
+    ctx->count = count;
+    ctx->names = malloc(count * sizeof(*ctx->names));
+    for (size_t i = 0; i < count; i++) {
+        snprintf(ctx->names[i], sizeof(ctx->names[i]), "var%zu", i);
+        setVar(&ctx->vars, "value", ctx->names[i]);
+    }
+}
+
+static void var_ctx_free(VarCtx *ctx) {
+    freeVars(ctx->vars);
+    free(ctx->names);
+}
+
+// Look up every variable in turn, so the average position is measured
+static void bench_getVar(void *arg, size_t iters) {
+    VarCtx *ctx = arg;
+    for (size_t i = 0; i < iters; i++) {
+        char *val = getVar(ctx->vars, ctx->names[i % ctx->count]);
+        sink += val != NULL;
+    }
+}
+
+// Overwrite existing variables in turn
+static void bench_setVar(void *arg, size_t iters) {
+    VarCtx *ctx = arg;
+    for (size_t i = 0; i < iters; i++) {
+        setVar(&ctx->vars, "other", ctx->names[i % ctx->count]);
+    }
+}
+
+// Copy the whole list (and free the copy)
+static void bench_copy_vars(void *arg, size_t iters) {
+    VarCtx *ctx = arg;
+    for (size_t i = 0; i < iters; i++) {
+        Variable *copy = copy_vars(ctx->vars);
+        sink += copy != NULL;
+        freeVars(copy);
+    }
+}
+
+// ===== Builtin dispatch and job table =====
+
+static const char *const LOOKUPS[] = {"echo", "ls", "cd", "cat", "wc", "grep", "sort", "kill", "notabuiltin"};
+
+static void bench_check_builtin(void *arg, size_t iters) {
+    (void)arg;
+    size_t n = sizeof(LOOKUPS) / sizeof(LOOKUPS[0]);
+    for (size_t i = 0; i < iters; i++) {
+        sink += check_builtin(LOOKUPS[i % n]) != NULL;
+    }
+}
+
+static void bench_backproc(void *arg, size_t iters) {
+    (void)arg;
+    for (size_t i = 0; i < iters; i++) {
+        backproc();
+    }
+    sink += bg_count;
+}
+
+// Fill the job table with children that wait to be killed
+static void fill_job_table(void) {
+    for (size_t i = 0; i < MAX_STR_LEN; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            pause();
+            _exit(0);
+        }
+        bg[i].pid = pid;
+        bg[i].command = strdup("pause");
+        bg[i].job = NULL;
+    }
+    bg_count = MAX_STR_LEN;
+}
+
+static void empty_job_table(void) {
+    for (size_t i = 0; i < bg_count; i++) {
+        kill(bg[i].pid, SIGKILL);
+        waitpid(bg[i].pid, NULL, 0);
+        free(bg[i].command);
+    }
+    bg_count = 0;
+}
+
+// ===== Sourcing a script =====
+
+// Helper functions of the kind a startup file sources
+#define HELPER_FUNCTIONS 100
+
+typedef struct SourceCtx {
+    char *path;
+    char *text;             // Contents of path
+    size_t len;
+    StrBuf encoded;         // script_encode output of text
+} SourceCtx;
+
+static void source_ctx_init(SourceCtx *ctx) {
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    ctx->path = malloc(strlen(dir) + 32);
+    sprintf(ctx->path, "%s/mysh-sourceXXXXXX", dir);
+    int fd = mkstemp(ctx->path);
+    if (fd == -1) {
+        perror("mkstemp");
+        exit(1);
+    }
+
+    StrBuf text = STRBUF_INIT;
+    char line[256];
+    for (int i = 0; i < HELPER_FUNCTIONS; i++) {
+        int n = snprintf(line, sizeof(line),
+                         "helper_%d() {\n  if [ $1 -gt %d ]; then\n    echo big $1 | wc\n"
+                         "  else\n    for x in a b c; do echo $x$1; done\n  fi\n}\n", i, i);
+        strbuf_append(&text, line, n);
+    }
+    if (write(fd, text.data, text.len) != (ssize_t)text.len) {
+        perror("write");
+        exit(1);
+    }
+    close(fd);
+    ctx->len = text.len;
+    ctx->text = strbuf_detach(&text);
+
+    int incomplete;
+    Script *script = script_parse(ctx->text, ctx->len, &incomplete);
+    ctx->encoded = (StrBuf)STRBUF_INIT;
+    script_encode(script, &ctx->encoded);
+    script_release(script);
+}
+
+static void source_ctx_free(SourceCtx *ctx) {
+    source_cache_clear();
+    unlink(ctx->path);
+    free(ctx->path);
+    free(ctx->text);
+    strbuf_free(&ctx->encoded);
+}
+
+static void bench_script_parse(void *arg, size_t iters) {
+    SourceCtx *ctx = arg;
+    for (size_t i = 0; i < iters; i++) {
+        int incomplete;
+        Script *script = script_parse(ctx->text, ctx->len, &incomplete);
+        sink += script != NULL;
+        script_release(script);
+    }
+}
+
+static void bench_script_decode(void *arg, size_t iters) {
+    SourceCtx *ctx = arg;
+    for (size_t i = 0; i < iters; i++) {
+        Script *script = script_decode(ctx->encoded.data, ctx->encoded.len);
+        sink += script != NULL;
+        script_release(script);
+    }
+}
+
+static void bench_source_cache_hit(void *arg, size_t iters) {
+    SourceCtx *ctx = arg;
+    for (size_t i = 0; i < iters; i++) {
+        sink += source_cache_get(ctx->path, NULL) != NULL;
+    }
+}
+
+// ===== wc and cat =====
+
+typedef struct FileCtx {
+    bn_ptr fn;
+    char *argv[6];
+    int rewind_stdout;      // Truncate stdout (a regular file) before each run
+} FileCtx;
+
+static void bench_file_builtin(void *arg, size_t iters) {
+    FileCtx *ctx = arg;
+    for (size_t i = 0; i < iters; i++) {
+        if (ctx->rewind_stdout) {
+            ftruncate(STDOUT_FILENO, 0);
+            lseek(STDOUT_FILENO, 0, SEEK_SET);
+        }
+        sink += ctx->fn(ctx->argv);
+    }
+    flush_output();
+}
+
+// Write a text file of LARGE_FILE_SIZE bytes; returns its path
+static char *make_large_file(void) {
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char *path = malloc(strlen(dir) + 32);
+    sprintf(path, "%s/mysh-benchXXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        exit(1);
+    }
+
+    char *chunk = malloc(1 << 20);
+    unsigned seed = 1;
+    for (size_t i = 0; i < (1 << 20); i++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned r = (seed >> 16) % 64;
+        chunk[i] = r < 8 ? ' ' : r < 10 ? '\n' : 'a' + r % 26;
+    }
+    for (size_t written = 0; written < LARGE_FILE_SIZE; written += 1 << 20) {
+        if (write(fd, chunk, 1 << 20) != 1 << 20) {
+            perror("write");
+            exit(1);
+        }
+    }
+    free(chunk);
+    close(fd);
+    return path;
+}
+
+// ===== Output =====
+
+static int write_json(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) return -1;
+    fprintf(out, "{\n  \"compiler\": \"%s\",\n  \"cpus\": %ld,\n  \"repetitions\": %d,\n  \"benchmarks\": [\n",
+            __VERSION__, sysconf(_SC_NPROCESSORS_ONLN), REPS);
+    for (size_t i = 0; i < result_count; i++) {
+        BenchResult *r = &results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"unit\": \"ns/op\", \"iterations\": %zu, "
+                "\"median\": %.3f, \"mean\": %.3f, \"stddev\": %.3f, \"min\": %.3f, "
+                "\"max\": %.3f, \"ci95\": %.3f",
+                r->name, r->iterations, r->median_ns, r->mean_ns, r->stddev_ns,
+                r->min_ns, r->max_ns, r->ci95_ns);
+        if (r->bytes_per_op > 0) {
+            fprintf(out, ", \"mb_per_s\": %.1f", r->bytes_per_op / r->median_ns * 1e9 / (1 << 20));
+        }
+        fprintf(out, "}%s\n", i + 1 < result_count ? "," : "");
+    }
+    fputs("  ]\n}\n", out);
+    return fclose(out);
+}
+
+int main(int argc, char *argv[]) {
+    const char *json_path = argc > 1 ? argv[1] : "bench/results.json";
+
+    // Tokenizing, with and without variable references
+    Variable *vars = NULL;
+    setVar(&vars, "/usr/local/src", "DIR");
+    setVar(&vars, "needle", "PAT");
+    TokenizeCtx tok = {"ls --rec /tmp --f *.c | grep -n foo | wc", vars, ARENA_INIT};
+    run_bench("tokenize_input/plain", bench_tokenize, &tok, 0, 0);
+    tok.line = "ls --rec $DIR --f *.c | grep -n ${PAT}s | wc";
+    run_bench("tokenize_input/vars", bench_tokenize, &tok, 0, 0);
+    arena_free(&tok.arena);
+
+    ExpandCtx exp = {"prefix-$DIR/${PAT}/$MISSING-suffix", vars, STRBUF_INIT};
+    run_bench("expand_variables", bench_expand_variables, &exp, 0, 0);
+    run_bench("expandVars", bench_expandVars, &exp, 0, 0);
+    strbuf_free(&exp.out);
+
+    // A loop counter step: read, compute and assign in place
+    ExpandCtx arith = {"$((i = (i * 3 + 1) % 1000))", vars, STRBUF_INIT};
+    run_bench("expand_variables/arith", bench_expand_variables, &arith, 0, 0);
+    strbuf_free(&arith.out);
+    freeVars(arith.vars);
+
+    // A sourced helper file: parsing it, loading its on-disk cache form,
+    // and a memory cache hit (one stat)
+    SourceCtx src;
+    source_ctx_init(&src);
+    run_bench("source/parse", bench_script_parse, &src, 0, src.len);
+    run_bench("source/decode", bench_script_decode, &src, 0, src.len);
+    run_bench("source/memory_hit", bench_source_cache_hit, &src, 0, 0);
+    source_ctx_free(&src);
+
+    // Variable table operations at several sizes
+    static const size_t SIZES[] = {10, 100, 1000, 10000};
+    for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); s++) {
+        VarCtx vc;
+        var_ctx_init(&vc, SIZES[s]);
+        char name[64];
+        snprintf(name, sizeof(name), "getVar/%zu", SIZES[s]);
+        run_bench(name, bench_getVar, &vc, 0, 0);
+        snprintf(name, sizeof(name), "setVar/%zu", SIZES[s]);
+        run_bench(name, bench_setVar, &vc, 0, 0);
+        snprintf(name, sizeof(name), "copy_vars/%zu", SIZES[s]);
+        run_bench(name, bench_copy_vars, &vc, 0, 0);
+        var_ctx_free(&vc);
+    }
+
+    run_bench("check_builtin", bench_check_builtin, NULL, 0, 0);
+
+    fill_job_table();
+    run_bench("backproc/full_table", bench_backproc, NULL, 0, 0);
+    empty_job_table();
+
+    // wc over a large file with its report discarded, and cat copying it
+    // into a second file (cat to /dev/null would measure nothing)
+    char *path = make_large_file();
+    char *copy_path = malloc(strlen(path) + 6);
+    sprintf(copy_path, "%s.copy", path);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    reset_output();
+
+    FileCtx wc = {bn_wc, {"wc", path, NULL}, 0};
+    run_bench("wc/64MB", bench_file_builtin, &wc, 1, LARGE_FILE_SIZE);
+
+    // Regex grep over the same file; each regexec must only see a window
+    // near the current line, or this becomes quadratic in the file size
+    FileCtx grep_ere = {bn_grep, {"grep", "-c", "-E", "q[a-d]+z", path, NULL}, 0};
+    run_bench("grep/64MB_regex", bench_file_builtin, &grep_ere, 1, LARGE_FILE_SIZE);
+    FileCtx grep_icase = {bn_grep, {"grep", "-c", "-i", "QAZ", path, NULL}, 0};
+    run_bench("grep/64MB_icase", bench_file_builtin, &grep_icase, 1, LARGE_FILE_SIZE);
+
+    int copy_fd = open(copy_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    dup2(copy_fd, STDOUT_FILENO);
+    close(copy_fd);
+    reset_output();
+    FileCtx cat = {bn_cat, {"cat", path, NULL}, 1};
+    run_bench("cat/64MB", bench_file_builtin, &cat, 1, LARGE_FILE_SIZE);
+
+    flush_output();
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    reset_output();
+    unlink(copy_path);
+    unlink(path);
+    free(copy_path);
+    free(path);
+
+    if (write_json(json_path) != 0) {
+        perror(json_path);
+        return 1;
+    }
+    fprintf(stderr, "Results written to %s\n", json_path);
+    return 0;
+}
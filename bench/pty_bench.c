@@ -0,0 +1,272 @@
+/* End-to-end latency and throughput harness
+ * Usage: pty_bench [shell] [results.json]
+ * Drives the shell through a pseudo-terminal, timing each command from
+ * the write of its line to the next prompt, then pipes scripts into it to
+ * measure commands per second. Percentiles go to stderr and JSON.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define PROMPT "mysh$ "
+#define PROMPT_LEN 6
+// Commands timed per latency scenario (after WARMUP untimed ones)
+#define SAMPLES 300
+#define WARMUP 20
+// Give up on a command after this long
+#define TIMEOUT_MS 10000
+#define MAX_RESULTS 32
+
+// A shell running on a pty
+typedef struct PtyShell {
+    pid_t pid;
+    int master;
+} PtyShell;
+
+// Percentile summary of one scenario
+typedef struct LatencyResult {
+    const char *name;
+    double p50_us, p90_us, p99_us, max_us, mean_us;
+} LatencyResult;
+
+typedef struct ThroughputResult {
+    const char *name;
+    size_t commands;
+    double seconds;
+} ThroughputResult;
+
+static LatencyResult latencies[MAX_RESULTS];
+static size_t latency_count = 0;
+static ThroughputResult throughputs[MAX_RESULTS];
+static size_t throughput_count = 0;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Start the shell on a new pty with echo off (input is not part of the output)
+static int pty_spawn(PtyShell *sh, const char *shell) {
+    sh->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (sh->master == -1 || grantpt(sh->master) == -1 || unlockpt(sh->master) == -1) {
+        perror("posix_openpt");
+        return -1;
+    }
+    const char *slave_name = ptsname(sh->master);
+
+    sh->pid = fork();
+    if (sh->pid == 0) {
+        setsid();
+        int slave = open(slave_name, O_RDWR);
+        if (slave == -1) _exit(127);
+        struct termios tio;
+        tcgetattr(slave, &tio);
+        tio.c_lflag &= ~(ECHO | ECHONL);
+        tcsetattr(slave, TCSANOW, &tio);
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        if (slave > STDERR_FILENO) close(slave);
+        execl(shell, shell, (char *)NULL);
+        _exit(127);
+    }
+    return sh->pid == -1 ? -1 : 0;
+}
+
+/* Read until the next prompt
+ * Return: 0 once the prompt arrived, -1 on timeout or EOF
+ * Note: Anything after the prompt (a background job's output) is left to
+ *       be read with the next command's output.
+ */
+static int wait_prompt(PtyShell *sh) {
+    char buf[PROMPT_LEN - 1 + 4096];
+    size_t keep = 0;   // Bytes carried from the previous read
+    while (1) {
+        struct pollfd pfd = {sh->master, POLLIN, 0};
+        int ready = poll(&pfd, 1, TIMEOUT_MS);
+        if (ready == -1 && errno == EINTR) continue;
+        if (ready <= 0) return -1;
+        ssize_t n = read(sh->master, buf + keep, sizeof(buf) - keep);
+        if (n <= 0) return -1;
+
+        size_t len = keep + n;
+        if (memmem(buf, len, PROMPT, PROMPT_LEN) != NULL) return 0;
+        // A prompt may straddle reads
+        keep = len < PROMPT_LEN - 1 ? len : PROMPT_LEN - 1;
+        memmove(buf, buf + len - keep, keep);
+    }
+}
+
+static void pty_close(PtyShell *sh) {
+    if (write(sh->master, "exit\n", 5) != 5) kill(sh->pid, SIGKILL);
+    waitpid(sh->pid, NULL, 0);
+    close(sh->master);
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, size_t n, double p) {
+    size_t i = (size_t)(p * (n - 1) + 0.5);
+    return sorted[i < n ? i : n - 1];
+}
+
+/* Time prompt-to-prompt latency of one command line
+ * Return: 0 on success, -1 if the shell stopped responding
+ */
+static int measure_latency(PtyShell *sh, const char *name, const char *line) {
+    size_t len = strlen(line);
+    double samples[SAMPLES];
+    for (int i = -WARMUP; i < SAMPLES; i++) {
+        double start = now_us();
+        if (write(sh->master, line, len) != (ssize_t)len || wait_prompt(sh) == -1) {
+            fprintf(stderr, "%s: shell stopped responding\n", name);
+            return -1;
+        }
+        if (i >= 0) samples[i] = now_us() - start;
+    }
+
+    qsort(samples, SAMPLES, sizeof(double), compare_double);
+    LatencyResult *res = &latencies[latency_count++];
+    res->name = name;
+    res->p50_us = percentile(samples, SAMPLES, 0.50);
+    res->p90_us = percentile(samples, SAMPLES, 0.90);
+    res->p99_us = percentile(samples, SAMPLES, 0.99);
+    res->max_us = samples[SAMPLES - 1];
+    double sum = 0;
+    for (int i = 0; i < SAMPLES; i++) sum += samples[i];
+    res->mean_us = sum / SAMPLES;
+    fprintf(stderr, "%-24s p50 %9.1f us  p90 %9.1f  p99 %9.1f  max %9.1f\n",
+            name, res->p50_us, res->p90_us, res->p99_us, res->max_us);
+    return 0;
+}
+
+/* Pipe count copies of line into a fresh shell and time until it exits
+ * Return: 0 on success, -1 on error
+ */
+static int measure_throughput(const char *shell, const char *name, const char *line, size_t count) {
+    size_t len = strlen(line);
+    char *script = malloc(len * count);
+    if (script == NULL) return -1;
+    for (size_t i = 0; i < count; i++) {
+        memcpy(script + i * len, line, len);
+    }
+
+    int in[2];
+    if (pipe(in) == -1) {
+        free(script);
+        return -1;
+    }
+    double start = now_us();
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        close(in[0]);
+        close(in[1]);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        execl(shell, shell, (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    for (size_t off = 0; off < len * count; ) {
+        ssize_t n = write(in[1], script + off, len * count - off);
+        if (n <= 0) break;
+        off += n;
+    }
+    close(in[1]);
+    int status;
+    waitpid(pid, &status, 0);
+    double seconds = (now_us() - start) / 1e6;
+    free(script);
+
+    ThroughputResult *res = &throughputs[throughput_count++];
+    res->name = name;
+    res->commands = count;
+    res->seconds = seconds;
+    fprintf(stderr, "%-24s %8zu commands in %7.3f s  %10.0f commands/s\n",
+            name, count, seconds, count / seconds);
+    return 0;
+}
+
+static int write_json(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) return -1;
+    fprintf(out, "{\n  \"samples\": %d,\n  \"latency_us\": [\n", SAMPLES);
+    for (size_t i = 0; i < latency_count; i++) {
+        LatencyResult *r = &latencies[i];
+        fprintf(out, "    {\"name\": \"%s\", \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+                "\"max\": %.1f, \"mean\": %.1f}%s\n", r->name, r->p50_us, r->p90_us,
+                r->p99_us, r->max_us, r->mean_us, i + 1 < latency_count ? "," : "");
+    }
+    fputs("  ],\n  \"throughput\": [\n", out);
+    for (size_t i = 0; i < throughput_count; i++) {
+        ThroughputResult *r = &throughputs[i];
+        fprintf(out, "    {\"name\": \"%s\", \"commands\": %zu, \"seconds\": %.4f, "
+                "\"commands_per_s\": %.1f}%s\n", r->name, r->commands, r->seconds,
+                r->commands / r->seconds, i + 1 < throughput_count ? "," : "");
+    }
+    fputs("  ]\n}\n", out);
+    return fclose(out);
+}
+
+int main(int argc, char *argv[]) {
+    const char *shell = argc > 1 ? argv[1] : "./bench/mysh";
+    const char *json_path = argc > 2 ? argv[2] : "bench/pty_results.json";
+
+    // Prompt-to-prompt latency over a pty
+    static const struct { const char *name, *line; } SCENARIOS[] = {
+        {"builtin", "cd .\n"},
+        {"builtin_output", "echo hello\n"},
+        {"assignment", "X=1\n"},
+        {"external", "/bin/true\n"},
+        {"pipeline_builtin", "echo a b c | wc\n"},
+        {"pipeline_external", "/bin/echo x | /bin/cat\n"},
+        {"background_external", "/bin/true &\n"},
+        {"background_builtin", "echo x &\n"},
+        {"substitution_builtin", "X=$(echo a b | wc)\n"},
+        {"substitution_external", "X=$(/bin/echo x)\n"},
+    };
+
+    PtyShell sh;
+    if (pty_spawn(&sh, shell) == -1 || wait_prompt(&sh) == -1) {
+        fprintf(stderr, "Cannot start %s on a pty\n", shell);
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(SCENARIOS) / sizeof(SCENARIOS[0]); i++) {
+        if (measure_latency(&sh, SCENARIOS[i].name, SCENARIOS[i].line) == -1) {
+            kill(sh.pid, SIGKILL);
+            return 1;
+        }
+    }
+    pty_close(&sh);
+
+    // Commands per second with a script piped in (no prompts)
+    if (measure_throughput(shell, "piped_builtin", "cd .\n", 100000) == -1 ||
+        measure_throughput(shell, "piped_assignment", "X=1\n", 100000) == -1 ||
+        measure_throughput(shell, "piped_expansion", "echo $X $X $X\n", 100000) == -1 ||
+        measure_throughput(shell, "piped_external", "/bin/true\n", 1000) == -1) {
+        fprintf(stderr, "Throughput run failed\n");
+        return 1;
+    }
+
+    if (write_json(json_path) != 0) {
+        perror(json_path);
+        return 1;
+    }
+    fprintf(stderr, "Results written to %s\n", json_path);
+    return 0;
+}
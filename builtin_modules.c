@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include "builtin_modules.h"
+#include "builtins.h"
+#include "commands.h"
+#include "io_helpers.h"
+
+// A loaded shared object and the builtins registered from it
+typedef struct Module {
+    char *path;           // Path given to load-builtin
+    void *handle;         // dlopen handle
+    Builtin *builtins;    // Registered entries (names owned when from argv)
+    size_t count;
+    int owns_names;       // Names were copied from the command line
+    struct Module *next;
+} Module;
+
+static Module *modules = NULL;
+
+// Release a module's bookkeeping (not the dlopen handle)
+static void module_free(Module *mod) {
+    if (mod->owns_names) {
+        for (size_t i = 0; i < mod->count; i++) {
+            free((char *)mod->builtins[i].name);
+        }
+    }
+    free(mod->builtins);
+    free(mod->path);
+    free(mod);
+}
+
+// Fill mod->builtins from the module's exported table
+static int collect_table(Module *mod) {
+    const Builtin *table = dlsym(mod->handle, MODULE_TABLE_SYMBOL);
+    if (table == NULL) {
+        display_error("ERROR: Module has no " MODULE_TABLE_SYMBOL " table: ", mod->path);
+        return -1;
+    }
+    while (table[mod->count].name != NULL) mod->count++;
+    mod->builtins = malloc((mod->count ? mod->count : 1) * sizeof(Builtin));
+    if (mod->builtins == NULL) return -1;
+    memcpy(mod->builtins, table, mod->count * sizeof(Builtin));
+    return 0;
+}
+
+// Fill mod->builtins by looking up each name as a bn_ptr function
+static int collect_names(Module *mod, char **names) {
+    while (names[mod->count] != NULL) mod->count++;
+    mod->builtins = calloc(mod->count, sizeof(Builtin));
+    if (mod->builtins == NULL) return -1;
+    mod->owns_names = 1;
+
+    for (size_t i = 0; i < mod->count; i++) {
+        bn_ptr fn;
+        // POSIX guarantees function pointers survive this conversion
+        *(void **)&fn = dlsym(mod->handle, names[i]);
+        mod->builtins[i].name = strdup(names[i]);
+        if (mod->builtins[i].name == NULL) return -1;
+        if (fn == NULL) {
+            display_error("ERROR: Symbol not found in module: ", names[i]);
+            return -1;
+        }
+        mod->builtins[i].fn = fn;
+        mod->builtins[i].flags = BN_PIPELINE | BN_BACKGROUND;
+        mod->builtins[i].usage = mod->builtins[i].name;
+    }
+    return 0;
+}
+
+/**
+ * Loads a shared object and registers its builtins
+ */
+int module_load(const char *path, char **names) {
+    for (Module *mod = modules; mod != NULL; mod = mod->next) {
+        if (strcmp(mod->path, path) == 0) {
+            display_error("ERROR: Module already loaded: ", path);
+            return -1;
+        }
+    }
+
+    Module *mod = calloc(1, sizeof(Module));
+    if (mod == NULL) return -1;
+    mod->path = strdup(path);
+    mod->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (mod->handle == NULL) {
+        display_error("ERROR: Cannot load module: ", dlerror());
+        module_free(mod);
+        return -1;
+    }
+
+    int err = mod->path == NULL ||
+        (names != NULL ? collect_names(mod, names) : collect_table(mod)) == -1;
+
+    // Register all or nothing
+    size_t registered = 0;
+    for (; !err && registered < mod->count; registered++) {
+        if (register_builtin(&mod->builtins[registered]) == -1) {
+            display_error("ERROR: Builtin already exists: ", mod->builtins[registered].name);
+            err = 1;
+            break;
+        }
+    }
+    if (err) {
+        while (registered-- > 0) {
+            unregister_builtin(mod->builtins[registered].name);
+        }
+        dlclose(mod->handle);
+        module_free(mod);
+        return -1;
+    }
+
+    mod->next = modules;
+    modules = mod;
+    return 0;
+}
+
+/**
+ * Unregisters a module's builtins and unloads it
+ */
+int module_unload(const char *path) {
+    Module **link = &modules;
+    while (*link != NULL && strcmp((*link)->path, path) != 0) {
+        link = &(*link)->next;
+    }
+    if (*link == NULL) {
+        display_error("ERROR: Module not loaded: ", path);
+        return -1;
+    }
+
+    // A background thread may be running code from the module
+    for (size_t i = 0; i < bg_count; i++) {
+        if (bg[i].job != NULL) {
+            display_error("ERROR: Cannot unload while a builtin runs in the background: ", bg[i].command);
+            return -1;
+        }
+    }
+
+    Module *mod = *link;
+    for (size_t i = 0; i < mod->count; i++) {
+        unregister_builtin(mod->builtins[i].name);
+    }
+    *link = mod->next;
+    dlclose(mod->handle);
+    module_free(mod);
+    return 0;
+}
+
+/**
+ * Displays each loaded module followed by the builtins it provides
+ */
+void module_list(void) {
+    for (Module *mod = modules; mod != NULL; mod = mod->next) {
+        display_message(mod->path);
+        display_message(":");
+        for (size_t i = 0; i < mod->count; i++) {
+            display_message(" ");
+            display_message((char *)mod->builtins[i].name);
+        }
+        display_message("\n");
+    }
+}
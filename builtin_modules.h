@@ -0,0 +1,31 @@
+#ifndef BUILTIN_MODULES_H
+#define BUILTIN_MODULES_H
+
+/* Symbol a module may export to describe its builtins: an array of
+ * Builtin (see builtins.h) ending with an entry whose name is NULL
+ */
+#define MODULE_TABLE_SYMBOL "mysh_builtins"
+
+/**
+ * Loads a shared object and registers its builtins
+ * @param path Shared object to dlopen
+ * @param names Exported bn_ptr functions to register under their own
+ *              names, or NULL to register the module's mysh_builtins table
+ * @return 0 on success, -1 on error (already reported)
+ * Note: Nothing is registered if any name is missing or already taken.
+ */
+int module_load(const char *path, char **names);
+
+/**
+ * Unregisters a module's builtins and unloads it
+ * @param path Path the module was loaded with
+ * @return 0 on success, -1 on error (already reported)
+ */
+int module_unload(const char *path);
+
+/**
+ * Displays each loaded module followed by the builtins it provides
+ */
+void module_list(void);
+
+#endif
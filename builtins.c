@@ -1,5 +1,9 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <dirent.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -14,32 +18,175 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "helper.h"
+#include "wc_count.h"
+#include "ls_walk.h"
+#include "grep_search.h"
+#include "sort_lines.h"
+#include "builtin_modules.h"
+#include "trace.h"
+#include "script.h"
+#include "source_cache.h"
+#include "workpool.h"
+#include <inttypes.h>
 
 // Server structure to manage connections and clients
 static Server server = {0};
 
-// Background processes storage
-Backgr bg[MAX_STR_LEN]; // Array to store background processes
-size_t bg_count = 0;    // Count of active background processes
-
 // External variable list from variables.h
 extern Variable *var_list;
 
 // ====== Command execution =====
 
+// Builtins compiled into the shell
+static const Builtin BUILTINS[] = {
+#define BUILTIN_ENTRY(name, fn, flags, usage) {name, fn, flags, usage},
+    BUILTIN_LIST(BUILTIN_ENTRY)
+#undef BUILTIN_ENTRY
+};
+#define BUILTINS_COUNT (sizeof(BUILTINS) / sizeof(BUILTINS[0]))
+
+/* Open-addressing hash table of every registered builtin
+ * Kept at most half full, so a lookup is usually one probe.
+ */
+static const Builtin **builtin_table = NULL;
+static size_t builtin_table_cap = 0;    // Slots (power of two)
+static size_t builtin_table_count = 0;  // Occupied slots
+
+// FNV-1a hash of a command name
+static size_t hash_name(const char *name) {
+    size_t h = (size_t)14695981039346656037ULL;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * (size_t)1099511628211ULL;
+    }
+    return h;
+}
+
+// Slot holding name, or the empty slot where it would go
+static size_t table_slot(const Builtin **table, size_t cap, const char *name) {
+    size_t i = hash_name(name) & (cap - 1);
+    while (table[i] != NULL && strcmp(table[i]->name, name) != 0) {
+        i = (i + 1) & (cap - 1);
+    }
+    return i;
+}
+
+// Resize the table to cap slots and reinsert everything
+static int table_resize(size_t cap) {
+    const Builtin **table = calloc(cap, sizeof(Builtin *));
+    if (table == NULL) return -1;
+    for (size_t i = 0; i < builtin_table_cap; i++) {
+        if (builtin_table[i] != NULL) {
+            table[table_slot(table, cap, builtin_table[i]->name)] = builtin_table[i];
+        }
+    }
+    free(builtin_table);
+    builtin_table = table;
+    builtin_table_cap = cap;
+    return 0;
+}
+
+// Insert bn unless its name is taken
+static int table_insert(const Builtin *bn) {
+    if ((builtin_table_count + 1) * 2 > builtin_table_cap &&
+        table_resize(builtin_table_cap ? builtin_table_cap * 2 : 32) == -1) {
+        return -1;
+    }
+    size_t i = table_slot(builtin_table, builtin_table_cap, bn->name);
+    if (builtin_table[i] != NULL) return -1;
+    builtin_table[i] = bn;
+    builtin_table_count++;
+    return 0;
+}
+
+// Fill the table with the compiled-in builtins on first use
+static int table_init(void) {
+    if (builtin_table != NULL) return 0;
+    for (size_t i = 0; i < BUILTINS_COUNT; i++) {
+        if (table_insert(&BUILTINS[i]) == -1) return -1;
+    }
+    return 0;
+}
+
+/* Find a builtin by name
+ * Return: the builtin, or NULL if cmd doesn't match a builtin
+ */
+const Builtin *find_builtin(const char *cmd) {
+    if (!cmd || table_init() == -1) return NULL;
+    return builtin_table[table_slot(builtin_table, builtin_table_cap, cmd)];
+}
+
 /* Check if a command matches a builtin
- * Return: index of builtin or -1 if cmd doesn't match a builtin
+ * Return: handler of the builtin, or NULL if cmd doesn't match a builtin
  */
 bn_ptr check_builtin(const char *cmd) {
-    if (!cmd) return NULL;
-    ssize_t cmd_num = 0;
-    // Iterate through builtin commands to find a match
-    while (cmd_num < BUILTINS_COUNT &&
-           strncmp(BUILTINS[cmd_num], cmd, MAX_STR_LEN) != 0) {
-        cmd_num += 1;
+    const Builtin *bn = find_builtin(cmd);
+    return bn ? bn->fn : NULL;
+}
+
+/* Add a builtin at runtime
+ * Return: 0 on success, -1 if the name is taken or memory ran out
+ */
+int register_builtin(const Builtin *bn) {
+    if (table_init() == -1) return -1;
+    return table_insert(bn);
+}
+
+/* Remove a builtin added with register_builtin
+ * Return: 0 on success, -1 if no such builtin was registered at runtime
+ */
+int unregister_builtin(const char *name) {
+    if (table_init() == -1) return -1;
+    size_t i = table_slot(builtin_table, builtin_table_cap, name);
+    const Builtin *bn = builtin_table[i];
+    if (bn == NULL || (bn >= BUILTINS && bn < BUILTINS + BUILTINS_COUNT)) return -1;
+
+    builtin_table[i] = NULL;
+    builtin_table_count--;
+    // Reinsert the rest of the probe run so lookups don't stop at the hole
+    for (size_t j = (i + 1) & (builtin_table_cap - 1); builtin_table[j] != NULL;
+         j = (j + 1) & (builtin_table_cap - 1)) {
+        const Builtin *moved = builtin_table[j];
+        builtin_table[j] = NULL;
+        builtin_table[table_slot(builtin_table, builtin_table_cap, moved->name)] = moved;
+    }
+    return 0;
+}
+
+// Display one builtin's usage line
+static void show_usage(const Builtin *bn) {
+    display_message((char *)bn->usage);
+    display_message("\n");
+}
+
+/* Show how builtins are used
+ * Usage: help [name...]; with no name, lists every builtin
+ * Return: 0 on success, -1 if a name is not a builtin
+ */
+ssize_t bn_help(char **tokens) {
+    if (tokens[1] != NULL) {
+        ssize_t ret = 0;
+        for (size_t i = 1; tokens[i] != NULL; i++) {
+            const Builtin *bn = find_builtin(tokens[i]);
+            if (bn == NULL) {
+                display_error("ERROR: Not a builtin: ", tokens[i]);
+                ret = -1;
+                continue;
+            }
+            show_usage(bn);
+        }
+        return ret;
+    }
+
+    for (size_t i = 0; i < BUILTINS_COUNT; i++) {
+        show_usage(&BUILTINS[i]);
     }
-    // Return corresponding builtin function pointer
-    return BUILTINS_FN[cmd_num];
+    // Then anything load-builtin registered
+    if (table_init() == -1) return -1;
+    for (size_t i = 0; i < builtin_table_cap; i++) {
+        const Builtin *bn = builtin_table[i];
+        if (bn != NULL && !(bn >= BUILTINS && bn < BUILTINS + BUILTINS_COUNT)) show_usage(bn);
+    }
+    return 0;
 }
 
 // Thread function to accept incoming client connections
@@ -51,6 +198,7 @@ void* accept_clients(void* arg) {
     while (srv->running) {
         // Accept new client connection
         int client_fd = accept(srv->sockfd, (struct sockaddr*)&client_addr, &addr_len);
+        trace_instant("server accept", NULL);
         if (client_fd < 0) {
             if (srv->running) perror("accept");
             continue;
@@ -86,6 +234,7 @@ void *handle(void* arg) {
     // Read messages from client
     while ((bytes_read = read(client->sockfd, buffer, sizeof(buffer)-1)) > 0) {
         buffer[bytes_read] = '\0';
+        trace_instant("server read", client->id);
 
         // Handle special "connected" command
         if (strcmp(buffer, "\\connected") == 0) {
@@ -106,6 +255,7 @@ void *handle(void* arg) {
         write(client->sockfd, buffer, bytes_read);
 
         // Broadcast message to all other clients
+        uint64_t trace_start_ns = trace_now();
         pthread_mutex_lock(&server.lock);
         for (int i = 0; i < server.client_count; i++) {
             if (server.clients[i].sockfd != client->sockfd) {
@@ -116,6 +266,7 @@ void *handle(void* arg) {
             }
         }
         pthread_mutex_unlock(&server.lock);
+        trace_event("server broadcast", trace_start_ns, client->id);
     }
 
     // Cleanup disconnected client
@@ -134,69 +285,6 @@ void *handle(void* arg) {
     return NULL;
 }
 
-// Check if path is a directory
-int is_dir(const char *path){
-    struct stat statbuf;
-    if (stat(path, &statbuf)) return 0;
-    return S_ISDIR(statbuf.st_mode);
-}
-
-// Check if substring exists in string
-int sub(const char *str, const char *substr) {
-    return strstr(str, substr) != NULL;
-}
-
-// Recursive directory listing with optional filtering and depth control
-void ls_recursive(const char *path, const char *substr, int depth, int max_depth) {
-    // Base case: Stop if max_depth is set and depth exceeds it
-    if (max_depth >= 0 && depth >= max_depth) {
-        return;
-    }
-
-    DIR *dir = opendir(path);
-    if (!dir) {
-        display_error("ERROR: Invalid path: ", path);
-        return;
-    }
-
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip "." and ".." only if they are not explicitly requested
-        if (substr == NULL && (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)) {
-            display_message(entry->d_name);
-            display_message("\n");
-            continue;
-        }
-
-        // Build full path for recursive calls
-        size_t path_len = strlen(path);
-        size_t name_len = strlen(entry->d_name);
-        if (path_len + name_len + 1 >= MAX_STR_LEN) {
-            display_error("ERROR: Path too long: ", path);
-            continue;
-        }
-
-        char full_path[MAX_STR_LEN];
-        strncpy(full_path, path, MAX_STR_LEN - 1);
-        full_path[MAX_STR_LEN - 1] = '\0';
-        strncat(full_path, "/", MAX_STR_LEN - strlen(full_path) - 1);
-        strncat(full_path, entry->d_name, MAX_STR_LEN - strlen(full_path) - 1);
-
-        // Display entry if it matches filter (or no filter)
-        if (substr == NULL || sub(entry->d_name, substr)) {
-            display_message(entry->d_name);
-            display_message("\n");
-        }
-
-        // Recurse into subdirectories if allowed by depth
-        if (is_dir(full_path) && (max_depth < 0 || depth < max_depth)) {
-            ls_recursive(full_path, substr, depth + 1, max_depth);
-        }
-    }
-
-    closedir(dir);
-}
-
 // ===== Builtins =====
 
 /* Echo command implementation
@@ -209,28 +297,13 @@ ssize_t bn_echo(char **tokens) {
         return 0;
     }
 
-    // Build output string from tokens
-    char output[MAX_STR_LEN] = {0};
-    size_t output_len = 0;
+    // Write tokens separated by spaces; display_message buffers them
     for (size_t index = 1; tokens[index] != NULL; index++) {
-         size_t rem = MAX_STR_LEN - output_len - 1;
-         if (rem > 0) {
-             strncat(output, tokens[index], rem);
-             output_len = strlen(output);
-                    }
-        // Add space between tokens if there's room
-        if (tokens[index + 1] != NULL && output_len < MAX_STR_LEN - 1) {
-            output[output_len++] = ' ';
-            output[output_len] = '\0';
-        }
-        if (output_len >= MAX_STR_LEN - 1) {
-            break;
+        display_message(tokens[index]);
+        if (tokens[index + 1] != NULL) {
+            display_message(" ");
         }
     }
-    // Truncate very long output
-    if (output_len > 128) {
-        output[128] = '\0';}
-    display_message(output);
     display_message("\n");
     return 0;
 }
@@ -240,12 +313,13 @@ ssize_t bn_ls(char **tokens) {
     char *path = ".";    // Default path
     int max_depth = -1;  // Unlimited depth by default
     int recursive = 0;   // Non-recursive by default
-    char *substr = NULL; // No substring filter by default
+    int ordered = 1;     // Depth-first output order by default
+    char *substr = NULL; // No name filter by default
 
     // Parse command options
     for (int i = 1; tokens[i] != NULL; i++) {
         if (strcmp(tokens[i], "--f") == 0) {
-            // Substring filter option
+            // Name filter option: substring, glob or path pattern
             if (tokens[i + 1] != NULL) {
                 substr = tokens[i + 1];
                 i++;
@@ -256,6 +330,9 @@ ssize_t bn_ls(char **tokens) {
         } else if (strcmp(tokens[i], "--rec") == 0) {
             // Recursive option
             recursive = 1;
+        } else if (strcmp(tokens[i], "--unordered") == 0) {
+            // Print each directory as soon as it is read
+            ordered = 0;
         } else if (strcmp(tokens[i], "--d") == 0) {
             // Depth limit option
             if (tokens[i + 1] != NULL) {
@@ -277,21 +354,33 @@ ssize_t bn_ls(char **tokens) {
         return -1;
     }
 
+    // Compile the filter once for the whole listing
+    Pattern *filter = NULL;
+    if (substr != NULL) {
+        filter = pattern_compile(substr);
+        if (filter == NULL) {
+            display_error("ERROR: Invalid pattern: ", substr);
+            return -1;
+        }
+    }
+
     // Execute listing
+    ssize_t ret = 0;
     if (recursive) {
-        ls_recursive(path, substr, 0, max_depth);
+        ret = ls_walk(path, filter, max_depth, ordered);
     } else {
         // Non-recursive listing
         DIR *dir = opendir(path);
         if (!dir) {
             display_error("ERROR: Invalid path: ", path);
+            pattern_free(filter);
             return -1;
         }
 
         struct dirent *entry;
         while ((entry = readdir(dir)) != NULL) {
             // Display entry if it matches filter (or no filter)
-            if (substr == NULL || sub(entry->d_name, substr)) {
+            if (filter == NULL || pattern_match(filter, entry->d_name, strlen(entry->d_name))) {
                 display_message(entry->d_name);
                 display_message("\n");
             }
@@ -300,7 +389,8 @@ ssize_t bn_ls(char **tokens) {
         closedir(dir);
     }
 
-    return 0;
+    pattern_free(filter);
+    return ret;
 }
 
 // Change directory command
@@ -355,82 +445,703 @@ ssize_t bn_cd(char **tokens) {
     return 0;
 }
 
-// Concatenate and display file contents
+// Largest chunk requested from the kernel per splice/sendfile call
+#define COPY_CHUNK (1 << 20)
+// Size and alignment of the userspace fallback buffer
+#define COPY_BUF_SIZE (128 * 1024)
+#define COPY_BUF_ALIGN 4096
+
+// Copy in_fd to out_fd with read/write through a large aligned buffer
+static int copy_fd_buffered(int in_fd, int out_fd) {
+    char *buf = NULL;
+    if (posix_memalign((void **)&buf, COPY_BUF_ALIGN, COPY_BUF_SIZE) != 0) {
+        return -1;
+    }
+
+    int ret = 0;
+    ssize_t n;
+    while (ret == 0 && (n = read(in_fd, buf, COPY_BUF_SIZE)) != 0) {
+        if (n == -1) {
+            if (errno != EINTR) ret = -1;
+            continue;
+        }
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(out_fd, buf + off, n - off);
+            if (w == -1) {
+                if (errno == EINTR) continue;
+                ret = -1;
+                break;
+            }
+            off += w;
+        }
+    }
+    free(buf);
+    return ret;
+}
+
+/* Copy all of in_fd to out_fd, keeping the data in the kernel if possible
+ * Tries splice when either end is a pipe, then copy_file_range and
+ * sendfile when the input is a regular file (and the output is not in
+ * append mode), then a buffered copy.
+ * Return: 0 on success, -1 on error
+ */
+static int copy_fd(int in_fd, int out_fd) {
+    struct stat in_st, out_st;
+    if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1) {
+        return -1;
+    }
+
+    ssize_t n = -1;
+    int started = 0;  // Set once a zero-copy call has moved data
+
+    if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+        while ((n = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK,
+                           SPLICE_F_MOVE | SPLICE_F_MORE)) > 0) {
+            started = 1;
+        }
+        if (n == 0) return 0;
+        if (started || (errno != EINVAL && errno != ENOSYS)) return -1;
+    }
+
+    // copy_file_range (EBADF) and sendfile (EINVAL) refuse O_APPEND output,
+    // as in "mysh -c 'cat f' >> log"
+    int flags = fcntl(out_fd, F_GETFL);
+    int appending = flags != -1 && (flags & O_APPEND);
+
+    if (S_ISREG(in_st.st_mode) && !appending) {
+        if (S_ISREG(out_st.st_mode)) {
+            while ((n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0)) > 0) {
+                started = 1;
+            }
+            if (n == 0) return 0;
+            if (started || (errno != EINVAL && errno != ENOSYS &&
+                            errno != EXDEV && errno != EOPNOTSUPP)) return -1;
+        }
+
+        while ((n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK)) > 0) {
+            started = 1;
+        }
+        if (n == 0) return 0;
+        if (started || (errno != EINVAL && errno != ENOSYS)) return -1;
+    }
+
+    return copy_fd_buffered(in_fd, out_fd);
+}
+
+/* Concatenate and display file contents
+ * Usage: cat [file...]  (no file or "-" reads standard input)
+ */
 ssize_t bn_cat(char **tokens) {
-    // Default to stdin if no file specified
-    FILE *file = stdin;
-    if (tokens[1] != NULL) {
-        file = fopen(tokens[1], "r");
-        // Error checking
-        if (file == NULL) {
-            display_error("ERROR: Cannot open file: ", tokens[1]);
+    // Anything already buffered must reach stdout before the file data.
+    // Data goes to this thread's output, which $(cat ...) redirects.
+    flush_output();
+    int out_fd = get_thread_output()->fd;
+    int in_fd = get_thread_input();
+
+    if (tokens[1] == NULL) {
+        if (copy_fd(in_fd, out_fd) == -1) {
+            display_error("ERROR: Cannot read file: ", "stdin");
             return -1;
         }
-    }
-    
-    // Read and display file contents line by line
-    char buffer[MAX_STR_LEN];
-    while (fgets(buffer, MAX_STR_LEN, file) != NULL) {
-        display_message(buffer);
+        return 0;
     }
 
-    // Cleanup
-    if (file != stdin) {
-        fclose(file);
+    ssize_t ret = 0;
+    for (int i = 1; tokens[i] != NULL; i++) {
+        int fd = in_fd;
+        if (strcmp(tokens[i], "-") != 0) {
+            fd = open(tokens[i], O_RDONLY | O_CLOEXEC);
+            // Error checking
+            if (fd == -1) {
+                display_error("ERROR: Cannot open file: ", tokens[i]);
+                ret = -1;
+                continue;
+            }
+        }
+
+        if (copy_fd(fd, out_fd) == -1) {
+            display_error("ERROR: Cannot read file: ", tokens[i]);
+            ret = -1;
+        }
+
+        // Cleanup
+        if (fd != in_fd) {
+            close(fd);
+        }
     }
-    return 0;
+    return ret;
+}
+
+// Print one wc result block
+static void wc_report(const WcCounts *counts) {
+    char output[MAX_STR_LEN];
+    snprintf(output, MAX_STR_LEN, "word count %" PRIu64 "\ncharacter count %" PRIu64
+             "\nnewline count %" PRIu64 "\n", counts->words, counts->bytes, counts->lines);
+    display_message(output);
 }
 
-// Word count command
+/* Word count command
+ * Usage: wc [file...]  (no file or "-" reads standard input)
+ * With several files each result is preceded by its name and followed
+ * by a total.
+ */
 ssize_t bn_wc(char **tokens) {
+    int in_fd = get_thread_input();
     // Default to stdin if no file specified
-    FILE *file = stdin;
-    if (tokens[1] != NULL) {
-        file = fopen(tokens[1], "r");
-        // Error checking
-        if (file == NULL) {
-            display_error("ERROR: Cannot open file: ", tokens[1]);
+    if (tokens[1] == NULL) {
+        WcCounts counts;
+        if (wc_count_fd(in_fd, &counts) == -1) {
+            display_error("ERROR: Cannot read file: ", "stdin");
             return -1;
         }
+        wc_report(&counts);
+        return 0;
     }
 
-    // Initialize counters
-    int line_count = 0;
-    int word_count = 0;
-    int char_count = 0;
-    int in_word = 0;
-    char ch;
+    int multiple = tokens[2] != NULL;
+    WcCounts total = {0, 0, 0};
+    ssize_t ret = 0;
+    for (int i = 1; tokens[i] != NULL; i++) {
+        int fd = in_fd;
+        if (strcmp(tokens[i], "-") != 0) {
+            fd = open(tokens[i], O_RDONLY | O_CLOEXEC);
+            // Error checking
+            if (fd == -1) {
+                display_error("ERROR: Cannot open file: ", tokens[i]);
+                ret = -1;
+                continue;
+            }
+        }
+
+        WcCounts counts;
+        int err = wc_count_fd(fd, &counts);
+        if (fd != in_fd) {
+            close(fd);
+        }
+        if (err == -1) {
+            display_error("ERROR: Cannot read file: ", tokens[i]);
+            ret = -1;
+            continue;
+        }
+
+        if (multiple) {
+            display_message(tokens[i]);
+            display_message("\n");
+        }
+        wc_report(&counts);
+        total.words += counts.words;
+        total.bytes += counts.bytes;
+        total.lines += counts.lines;
+    }
+
+    if (multiple) {
+        display_message("total\n");
+        wc_report(&total);
+    }
+    return ret;
+}
 
-    // Count characters, words, and lines
-    while ((ch = fgetc(file)) != EOF) {
-        char_count++;
-        if (ch == '\n') line_count++;
-        if (isspace(ch)) {
-            if (in_word) word_count++;
-            in_word = 0;
+// One file searched by bn_grep, possibly on a pool worker
+typedef struct GrepJob {
+    const Grep *grep;
+    const char *path;     // File name, or "-" for stdin
+    int in_fd;            // Descriptor read for "-"
+    char *prefix;         // "path:" when several files are searched
+    StrBuf out;           // Selected lines for this file
+    uint64_t matches;     // Number of selected lines
+    int open_failed;      // File could not be opened
+    int read_failed;      // File could not be read
+} GrepJob;
+
+// Search one file into its own output buffer
+static void grep_job(void *arg) {
+    GrepJob *job = arg;
+    int fd = job->in_fd;
+    if (strcmp(job->path, "-") != 0) {
+        fd = open(job->path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            job->open_failed = 1;
+            return;
+        }
+    }
+    if (grep_fd(job->grep, fd, job->prefix, &job->out, 0, &job->matches) == -1) {
+        job->read_failed = 1;
+    }
+    if (fd != job->in_fd) {
+        close(fd);
+    }
+}
+
+/* Search files for lines matching a pattern
+ * Usage: grep [-n] [-c] [-v] [-i] [-F] [-E] pattern [file...]
+ * Several files are searched in parallel; output stays in file order.
+ * Return: 0 if any line was selected, 1 if none, -1 on error
+ */
+ssize_t bn_grep(char **tokens) {
+    GrepOpts opts = {0};
+    int i = 1;
+    for (; tokens[i] != NULL && tokens[i][0] == '-' && tokens[i][1] != '\0'; i++) {
+        if (strcmp(tokens[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *flag = tokens[i] + 1; *flag; flag++) {
+            switch (*flag) {
+            case 'n': opts.line_numbers = 1; break;
+            case 'c': opts.count_only = 1; break;
+            case 'v': opts.invert = 1; break;
+            case 'i': opts.ignore_case = 1; break;
+            case 'F': opts.fixed = 1; break;
+            case 'E': opts.extended = 1; break;
+            default:
+                display_error("ERROR: Usage: grep [-ncviFE] pattern [file...]", "");
+                return -1;
+            }
+        }
+    }
+    if (tokens[i] == NULL) {
+        display_error("ERROR: Usage: grep [-ncviFE] pattern [file...]", "");
+        return -1;
+    }
+
+    Grep grep;
+    if (grep_compile(&grep, tokens[i], opts) == -1) {
+        display_error("ERROR: Invalid pattern: ", tokens[i]);
+        return -1;
+    }
+    i++;
+
+    // No files: search stdin, writing results as they are found
+    int in_fd = get_thread_input();
+    if (tokens[i] == NULL) {
+        StrBuf out = STRBUF_INIT;
+        uint64_t matches = 0;
+        int err = grep_fd(&grep, in_fd, NULL, &out, 1, &matches);
+        strbuf_free(&out);
+        grep_free(&grep);
+        if (err == -1) {
+            display_error("ERROR: Cannot read file: ", "stdin");
+            return -1;
+        }
+        return matches > 0 ? 0 : 1;
+    }
+
+    size_t nfiles = 0;
+    while (tokens[i + nfiles] != NULL) nfiles++;
+    GrepJob *jobs = calloc(nfiles, sizeof(GrepJob));
+    if (jobs == NULL) {
+        grep_free(&grep);
+        return -1;
+    }
+    for (size_t f = 0; f < nfiles; f++) {
+        jobs[f].grep = &grep;
+        jobs[f].path = tokens[i + f];
+        jobs[f].in_fd = in_fd;
+        if (nfiles > 1) {
+            size_t len = strlen(jobs[f].path);
+            jobs[f].prefix = malloc(len + 2);
+            if (jobs[f].prefix != NULL) {
+                memcpy(jobs[f].prefix, jobs[f].path, len);
+                memcpy(jobs[f].prefix + len, ":", 2);
+            }
+        }
+    }
+
+    if (nfiles == 1) {
+        grep_job(&jobs[0]);
+    } else {
+        WorkPool *pool = workpool_create(0);
+        for (size_t f = 0; f < nfiles; f++) {
+            if (pool != NULL) {
+                workpool_submit(pool, grep_job, &jobs[f]);
+            } else {
+                grep_job(&jobs[f]);
+            }
+        }
+        if (pool != NULL) {
+            workpool_wait(pool);
+            workpool_destroy(pool);
+        }
+    }
+
+    // Print results in the order the files were given
+    ssize_t ret = 1;
+    for (size_t f = 0; f < nfiles; f++) {
+        if (jobs[f].open_failed) {
+            display_error("ERROR: Cannot open file: ", jobs[f].path);
+        } else if (jobs[f].read_failed) {
+            display_error("ERROR: Cannot read file: ", jobs[f].path);
+        }
+        if (jobs[f].out.len > 0) {
+            display_bytes(jobs[f].out.data, jobs[f].out.len);
+        }
+        if (jobs[f].matches > 0 && ret == 1) ret = 0;
+        if (jobs[f].open_failed || jobs[f].read_failed) ret = -1;
+        strbuf_free(&jobs[f].out);
+        free(jobs[f].prefix);
+    }
+    free(jobs);
+    grep_free(&grep);
+    return ret;
+}
+
+/* Sort the lines of files (or stdin) together
+ * Usage: sort [-n] [-r] [-u] [-k field] [-S size] [file...]
+ * Input beyond the -S budget is sorted in runs spilled to temp files.
+ * Return: 0 on success, -1 on error
+ */
+ssize_t bn_sort(char **tokens) {
+    SortOpts opts = {0, 0, 0, 0, SORT_DEFAULT_BUDGET};
+    int i = 1;
+    for (; tokens[i] != NULL && tokens[i][0] == '-' && tokens[i][1] != '\0'; i++) {
+        if (strcmp(tokens[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *flag = tokens[i] + 1; *flag; flag++) {
+            if (*flag == 'k' || *flag == 'S') {
+                // Value is the rest of this token or the next token
+                const char *value = flag[1] ? flag + 1 : tokens[++i];
+                if (value == NULL) {
+                    display_error("ERROR: Usage: sort [-nru] [-k field] [-S size] [file...]", "");
+                    return -1;
+                }
+                if (*flag == 'k') {
+                    opts.key_field = atoi(value);
+                    if (opts.key_field <= 0) {
+                        display_error("ERROR: Invalid key field: ", value);
+                        return -1;
+                    }
+                } else if ((opts.mem_budget = parse_size(value)) == 0) {
+                    display_error("ERROR: Invalid buffer size: ", value);
+                    return -1;
+                }
+                break;
+            }
+            switch (*flag) {
+            case 'n': opts.numeric = 1; break;
+            case 'r': opts.reverse = 1; break;
+            case 'u': opts.unique = 1; break;
+            default:
+                display_error("ERROR: Usage: sort [-nru] [-k field] [-S size] [file...]", "");
+                return -1;
+            }
+        }
+    }
+
+    size_t nfiles = 0;
+    while (tokens[i + nfiles] != NULL) nfiles++;
+    int *fds = malloc((nfiles ? nfiles : 1) * sizeof(int));
+    if (fds == NULL) return -1;
+
+    int in_fd = get_thread_input();
+    ssize_t ret = 0;
+    size_t nfds = 0;
+    if (nfiles == 0) {
+        fds[nfds++] = in_fd;
+    }
+    for (size_t f = 0; f < nfiles && ret == 0; f++) {
+        const char *path = tokens[i + f];
+        if (strcmp(path, "-") == 0) {
+            fds[nfds++] = in_fd;
+            continue;
+        }
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            display_error("ERROR: Cannot open file: ", path);
+            ret = -1;
         } else {
-            in_word = 1;
+            fds[nfds++] = fd;
         }
     }
 
-    // Count final word if file doesn't end with whitespace
-    if (in_word) word_count++;
+    if (ret == 0 && sort_fds(fds, nfds, &opts) == -1) {
+        display_error("ERROR: Cannot sort input", "");
+        ret = -1;
+    }
+    for (size_t f = 0; f < nfds; f++) {
+        if (fds[f] != in_fd) close(fds[f]);
+    }
+    free(fds);
+    return ret;
+}
 
-    // Format and display results
-    char output[MAX_STR_LEN];
-    snprintf(output, MAX_STR_LEN, "word count %d\ncharacter count %d\nnewline count %d\n",
-             word_count, char_count, line_count);
-    display_message(output);
+/* Load builtins from a shared object
+ * Usage: load-builtin [path.so [function...]]
+ * With functions named, each exported bn_ptr function is registered under
+ * its own name; otherwise the module's mysh_builtins table is used.
+ * Without arguments, loaded modules are listed.
+ * Return: 0 on success, -1 on error
+ */
+ssize_t bn_load_builtin(char **tokens) {
+    if (tokens[1] == NULL) {
+        module_list();
+        return 0;
+    }
+    return module_load(tokens[1], tokens[2] != NULL ? &tokens[2] : NULL);
+}
 
-    // Cleanup
-    if (file != stdin) {
-        fclose(file);
+/* Unload a module loaded with load-builtin
+ * Usage: unload-builtin path.so
+ * Return: 0 on success, -1 on error
+ */
+ssize_t bn_unload_builtin(char **tokens) {
+    if (tokens[1] == NULL) {
+        display_error("ERROR: Usage: unload-builtin path.so", "");
+        return -1;
+    }
+    return module_unload(tokens[1]);
+}
+
+/* Record shell internals as a Chrome trace
+ * Usage: trace on <file> | trace off
+ * Events are written to file (viewable in Perfetto or chrome://tracing)
+ * when tracing is turned off or the shell exits.
+ * Return: 0 on success, -1 on error
+ */
+ssize_t bn_trace(char **tokens) {
+    if (tokens[1] != NULL && strcmp(tokens[1], "on") == 0 && tokens[2] != NULL) {
+        if (trace_start(tokens[2]) == -1) {
+            display_error("ERROR: Cannot start trace: ", tokens[2]);
+            return -1;
+        }
+        return 0;
+    }
+    if (tokens[1] != NULL && strcmp(tokens[1], "off") == 0) {
+        if (trace_stop() == -1) {
+            display_error("ERROR: Cannot write trace", "");
+            return -1;
+        }
+        return 0;
+    }
+    display_error("ERROR: Usage: trace on <file> | trace off", "");
+    return -1;
+}
+
+/* Export variables to programs the shell runs
+ * Usage: export [name[=value]...]; with no names, shows the environment
+ * Return: 0 on success, -1 on error
+ */
+ssize_t bn_export(char **tokens) {
+    if (tokens[1] == NULL) {
+        for (char **entry = var_environ(); *entry != NULL; entry++) {
+            display_message(*entry);
+            display_message("\n");
+        }
+        return 0;
+    }
+
+    for (size_t i = 1; tokens[i] != NULL; i++) {
+        char *name = tokens[i];
+        char *eq = strchr(name, '=');
+        size_t name_len = eq != NULL ? (size_t)(eq - name) : strlen(name);
+        int valid = name_len > 0 && !isdigit((unsigned char)name[0]);
+        for (size_t j = 0; valid && j < name_len; j++) {
+            valid = isalnum((unsigned char)name[j]) || name[j] == '_';
+        }
+        if (!valid) {
+            display_error("ERROR: Invalid variable name: ", name);
+            return -1;
+        }
+
+        if (eq != NULL) {
+            *eq = '\0';
+            set_var_verbatim(&var_list, eq + 1, name);
+        }
+        int err = export_var(&var_list, name);
+        if (eq != NULL) *eq = '=';
+        if (err == -1) {
+            display_error("ERROR: Cannot export: ", name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Run the commands of a file in this shell
+ * Usage: source [file] (or . file); with no file, shows cache counters
+ * The parsed file is cached, so sourcing it again while unchanged skips
+ * reading and parsing. SOURCE_CACHE_DIR names a directory where parsed
+ * files are also kept for other shells.
+ * Return: exit status of the last command run, -1 on error
+ */
+ssize_t bn_source(char **tokens) {
+    if (tokens[1] == NULL) {
+        source_cache_report();
+        return 0;
+    }
+    Script *script = source_cache_get(tokens[1], getVar(var_list, SOURCE_CACHE_DIR_VAR));
+    if (script == NULL) return -1;
+    return script_run(script);
+}
+
+// Tokens of a test expression and the position being evaluated
+typedef struct TestExpr {
+    char **args;
+    size_t count;
+    size_t pos;
+    int error;   // Set on a malformed expression
+} TestExpr;
+
+static int test_or(TestExpr *t);
+
+// Parse an integer operand of -eq and friends
+static long long test_integer(TestExpr *t, const char *arg) {
+    char *end;
+    errno = 0;
+    long long n = strtoll(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0') {
+        display_error("ERROR: Integer expected: ", arg);
+        t->error = 1;
+    }
+    return n;
+}
+
+// -z/-n string tests and the file tests
+static int test_unary(const char *op, const char *arg) {
+    struct stat st;
+    switch (op[1]) {
+        case 'z': return arg[0] == '\0';
+        case 'n': return arg[0] != '\0';
+        case 'e': return stat(arg, &st) == 0;
+        case 'f': return stat(arg, &st) == 0 && S_ISREG(st.st_mode);
+        case 'd': return stat(arg, &st) == 0 && S_ISDIR(st.st_mode);
+        case 's': return stat(arg, &st) == 0 && st.st_size > 0;
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
     }
     return 0;
 }
 
+static int is_test_unary(const char *op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("znefdsrwx", op[1]);
+}
+
+static int is_test_binary(const char *op) {
+    static const char *const OPS[] = {
+        "=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL
+    };
+    for (size_t i = 0; OPS[i] != NULL; i++) {
+        if (strcmp(op, OPS[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+// A comparison, a unary test, ( expr ) or a lone string
+static int test_primary(TestExpr *t) {
+    if (t->pos >= t->count) {
+        t->error = 1;
+        return 0;
+    }
+    char **a = t->args + t->pos;
+    size_t left = t->count - t->pos;
+
+    if (left >= 3 && is_test_binary(a[1])) {
+        t->pos += 3;
+        const char *op = a[1];
+        if (op[0] != '-') {
+            int equal = strcmp(a[0], a[2]) == 0;
+            return op[0] == '!' ? !equal : equal;
+        }
+        long long x = test_integer(t, a[0]), y = test_integer(t, a[2]);
+        if (strcmp(op, "-eq") == 0) return x == y;
+        if (strcmp(op, "-ne") == 0) return x != y;
+        if (strcmp(op, "-lt") == 0) return x < y;
+        if (strcmp(op, "-le") == 0) return x <= y;
+        if (strcmp(op, "-gt") == 0) return x > y;
+        return x >= y;
+    }
+    if (left >= 2 && is_test_unary(a[0])) {
+        t->pos += 2;
+        return test_unary(a[0], a[1]);
+    }
+    if (strcmp(a[0], "(") == 0 && left >= 2) {
+        t->pos++;
+        int result = test_or(t);
+        if (t->pos >= t->count || strcmp(t->args[t->pos], ")") != 0) {
+            t->error = 1;
+            return 0;
+        }
+        t->pos++;
+        return result;
+    }
+    t->pos++;
+    return a[0][0] != '\0';
+}
+
+static int test_not(TestExpr *t) {
+    if (t->pos < t->count && strcmp(t->args[t->pos], "!") == 0 && t->pos + 1 < t->count) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+static int test_and(TestExpr *t) {
+    int result = test_not(t);
+    while (t->pos < t->count && strcmp(t->args[t->pos], "-a") == 0) {
+        t->pos++;
+        result = test_not(t) && result;
+    }
+    return result;
+}
+
+static int test_or(TestExpr *t) {
+    int result = test_and(t);
+    while (t->pos < t->count && strcmp(t->args[t->pos], "-o") == 0) {
+        t->pos++;
+        result = test_and(t) || result;
+    }
+    return result;
+}
+
+/* Evaluate a conditional expression
+ * Usage: test expr  or  [ expr ]
+ * Supports = != -eq -ne -lt -le -gt -ge, -z -n -e -f -d -s -r -w -x,
+ * ! -a -o and parentheses. Running in the shell keeps loop conditions
+ * from forking.
+ * Return: 0 if expr is true, 1 if it is false, 2 if it is malformed
+ */
+ssize_t bn_test(char **tokens) {
+    size_t count = 0;
+    while (tokens[count + 1] != NULL) count++;
+    if (strcmp(tokens[0], "[") == 0) {
+        if (count == 0 || strcmp(tokens[count], "]") != 0) {
+            display_error("ERROR: Missing ]", "");
+            return 2;
+        }
+        count--;
+    }
+    if (count == 0) return 1;
+
+    TestExpr t = {tokens + 1, count, 0, 0};
+    int result = test_or(&t);
+    if (!t.error && t.pos != t.count) {
+        display_error("ERROR: Unexpected argument to test: ", t.args[t.pos]);
+        return 2;
+    }
+    if (t.error) return 2;
+    return result ? 0 : 1;
+}
+
+/* Do nothing, successfully
+ * Return: 0
+ */
+ssize_t bn_true(char **tokens) {
+    (void)tokens;
+    return 0;
+}
+
+/* Do nothing, unsuccessfully
+ * Return: 1
+ */
+ssize_t bn_false(char **tokens) {
+    (void)tokens;
+    return 1;
+}
+
 #include <signal.h>
-#include <errno.h>
 
 // Kill process command
 ssize_t bn_kill(char **tokens) {
@@ -457,6 +1168,14 @@ ssize_t bn_kill(char **tokens) {
         }
     }
 
+    // Builtin jobs are threads of the shell; signalling one hits the shell
+    for (size_t i = 0; i < bg_count; i++) {
+        if (bg[i].pid == pid && bg[i].job != NULL) {
+            display_error("ERROR: Cannot signal a background builtin: ", bg[i].command);
+            return -1;
+        }
+    }
+
     // Send signal to process
     if (kill(pid, signum) == -1) {
         // Handle specific errors
@@ -14,6 +14,17 @@ ssize_t bn_ls(char **tokens);
 ssize_t bn_cd(char **tokens);
 ssize_t bn_cat(char **tokens);
 ssize_t bn_wc(char **tokens);
+ssize_t bn_grep(char **tokens);
+ssize_t bn_sort(char **tokens);
+ssize_t bn_load_builtin(char **tokens);
+ssize_t bn_unload_builtin(char **tokens);
+ssize_t bn_trace(char **tokens);
+ssize_t bn_source(char **tokens);
+ssize_t bn_export(char **tokens);
+ssize_t bn_help(char **tokens);
+ssize_t bn_test(char **tokens);
+ssize_t bn_true(char **tokens);
+ssize_t bn_false(char **tokens);
 ssize_t bn_ps(char **tokens);
 ssize_t bn_kill(char **tokens);
 ssize_t bn_start_server(char **tokens);
@@ -21,15 +32,70 @@ ssize_t bn_close_server(char **tokens);
 ssize_t bn_send(char **tokens);
 ssize_t bn_start_client(char **tokens);
 
-/* Return: index of builtin or -1 if cmd doesn't match a builtin
+/* Builtin flags
+ * BN_PIPELINE: can run as a stage of a pipeline (in a forked child)
+ * BN_BACKGROUND: can run with & on a background thread (so must not touch
+ *                the job table, which the main thread changes unlocked)
+ */
+#define BN_PIPELINE   0x1
+#define BN_BACKGROUND 0x2
+
+/* Every builtin, declared once as X(name, function, flags, usage)
+ * To add a builtin, declare its function above and add one line here.
+ */
+#define BUILTIN_LIST(X) \
+    X("start-server", bn_start_server, 0, "start-server <port>") \
+    X("close-server", bn_close_server, 0, "close-server") \
+    X("send", bn_send, BN_PIPELINE | BN_BACKGROUND, "send <port> <host> <message>") \
+    X("start-client", bn_start_client, BN_PIPELINE, "start-client <port> <host>") \
+    X("ps", bn_ps, BN_PIPELINE, "ps") \
+    X("kill", bn_kill, BN_PIPELINE, "kill <pid> [signum]") \
+    X("echo", bn_echo, BN_PIPELINE | BN_BACKGROUND, "echo [text...]") \
+    X("ls", bn_ls, BN_PIPELINE | BN_BACKGROUND, "ls [path] [--f pattern] [--rec] [--d depth] [--unordered]") \
+    X("cd", bn_cd, 0, "cd [path]") \
+    X("cat", bn_cat, BN_PIPELINE | BN_BACKGROUND, "cat [file...]") \
+    X("wc", bn_wc, BN_PIPELINE | BN_BACKGROUND, "wc [file...]") \
+    X("grep", bn_grep, BN_PIPELINE | BN_BACKGROUND, "grep [-ncviFE] pattern [file...]") \
+    X("sort", bn_sort, BN_PIPELINE | BN_BACKGROUND, "sort [-nru] [-k field] [-S size] [file...]") \
+    X("load-builtin", bn_load_builtin, 0, "load-builtin [path.so [function...]]") \
+    X("unload-builtin", bn_unload_builtin, 0, "unload-builtin path.so") \
+    X("trace", bn_trace, 0, "trace on <file> | trace off") \
+    X("source", bn_source, 0, "source [file]") \
+    X("export", bn_export, 0, "export [name[=value]...]") \
+    X(".", bn_source, 0, ". file") \
+    X("test", bn_test, BN_PIPELINE | BN_BACKGROUND, "test expr") \
+    X("[", bn_test, BN_PIPELINE | BN_BACKGROUND, "[ expr ]") \
+    X("true", bn_true, BN_PIPELINE | BN_BACKGROUND, "true") \
+    X("false", bn_false, BN_PIPELINE | BN_BACKGROUND, "false") \
+    X("help", bn_help, BN_PIPELINE, "help [name...]")
+
+/* A builtin and its metadata
+ */
+typedef struct Builtin {
+    const char *name;     // Command name
+    bn_ptr fn;            // Handler
+    int flags;            // BN_* flags
+    const char *usage;    // One-line usage string, shown by help
+} Builtin;
+
+/* Return: the builtin named cmd, or NULL if cmd isn't a builtin
+ * Lookup is a single hash probe sequence, not a scan of every builtin.
+ */
+const Builtin *find_builtin(const char *cmd);
+
+/* Return: handler of the builtin named cmd, or NULL if there is none
  */
 bn_ptr check_builtin(const char *cmd);
 
+/* Add a builtin at runtime
+ * bn must stay valid while registered.
+ * Return: 0 on success, -1 if the name is taken or memory ran out
+ */
+int register_builtin(const Builtin *bn);
 
-/* BUILTINS and BUILTINS_FN are parallel arrays of length BUILTINS_COUNT
+/* Remove a builtin added with register_builtin
+ * Return: 0 on success, -1 if name was not registered at runtime
  */
-static const char * const BUILTINS[] = {"start-server","close-server","send","start-client","ps", "kill","echo","ls","cd","cat","wc"};
-static const bn_ptr BUILTINS_FN[] = {bn_start_server, bn_close_server,bn_send, bn_start_client, bn_ps,bn_kill, bn_echo,bn_ls,bn_cd,bn_cat,bn_wc, NULL};    // Extra null element for 'non-builtin'
-static const ssize_t BUILTINS_COUNT = sizeof(BUILTINS) / sizeof(char *);
+int unregister_builtin(const char *name);
 
 #endif
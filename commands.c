@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/pidfd.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include "strbuf.h"
+#include "commands.h"
+#include "io_helpers.h"
+
+// Background processes storage
+Backgr bg[MAX_STR_LEN]; // Array to store background processes
+size_t bg_count = 0;    // Count of active background processes
+
+// Stages of the last foreground command
+StageStats *last_stages = NULL;
+size_t last_stage_count = 0;
+static size_t last_stage_cap = 0;
+
+/**
+ * Makes room for the stages of a new foreground command
+ */
+StageStats *begin_stages(size_t n) {
+    if (n > last_stage_cap) {
+        StageStats *grown = realloc(last_stages, n * sizeof(StageStats));
+        if (grown == NULL) {
+            last_stage_count = 0;
+            return NULL;
+        }
+        last_stages = grown;
+        last_stage_cap = n;
+    }
+    memset(last_stages, 0, n * sizeof(StageStats));
+    last_stage_count = n;
+    return last_stages;
+}
+
+// Collect one exited stage
+static void reap_stage(StageStats *stage) {
+    int status = 0;
+    while (wait4(stage->pid, &status, 0, &stage->usage) == -1) {
+        if (errno != EINTR) {
+            stage->status = 1;
+            return;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stage->end);
+    if (WIFEXITED(status)) {
+        stage->status = WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        stage->status = 128 + WTERMSIG(status);
+    } else {
+        stage->status = status;
+    }
+}
+
+/**
+ * Waits for exactly the given stages
+ * Note: Each stage gets a pidfd and all of them are polled together;
+ *       any stage whose pidfd can't be opened is waited for in order
+ *       afterwards.
+ */
+void wait_stages(StageStats *stages, size_t n) {
+    struct pollfd *fds = malloc((n ? n : 1) * sizeof(struct pollfd));
+    size_t remaining = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (fds != NULL) {
+            fds[i].fd = -1;   // poll skips negative descriptors
+            fds[i].events = POLLIN;
+        }
+        if (stages[i].pid <= 0) continue;
+        stages[i].status = -1;
+        if (fds == NULL) continue;
+        fds[i].fd = pidfd_open(stages[i].pid, 0);
+        if (fds[i].fd != -1) remaining++;
+    }
+
+    while (remaining > 0) {
+        if (poll(fds, n, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (fds[i].fd >= 0 && fds[i].revents != 0) {
+                reap_stage(&stages[i]);
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                remaining--;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (stages[i].pid <= 0) continue;
+        if (fds != NULL && fds[i].fd >= 0) close(fds[i].fd);
+        if (stages[i].status == -1) reap_stage(&stages[i]);
+    }
+    free(fds);
+}
+
+/**
+ * Reports and removes finished background jobs
+ * Note: Processes are polled with waitpid(WNOHANG); builtin threads are
+ *       joined once they have returned. The table is compacted afterwards.
+ */
+void backproc(void) {
+    for (size_t i = 0; i < bg_count; i++) {
+        if (bg[i].pid != -1) {
+            int status;
+            pid_t result;
+            if (bg[i].job != NULL) {
+                // Builtin on a thread: join it once it has returned
+                result = builtin_job_finished(bg[i].job) ? bg[i].pid : 0;
+                if (result > 0) {
+                    builtin_job_join(bg[i].job);
+                    bg[i].job = NULL;
+                }
+            } else {
+                result = waitpid(bg[i].pid, &status, WNOHANG);
+            }
+            if (result > 0) {
+                // Process has completed
+                char done_msg[MAX_STR_LEN];
+                snprintf(done_msg, MAX_STR_LEN, "[%zu]+  Done %s", i + 1, bg[i].command);
+                
+                // Use display_message instead of direct write
+                display_message(done_msg);
+                display_message("\n");
+                // Free the command string
+                free(bg[i].command);
+                bg[i].pid = -1; 
+            }
+            else if (result == -1) {
+                // Error case - still use display_message for consistency
+                display_message("ERROR: Failed to check background process status\n");
+                free(bg[i].command);
+                bg[i].pid = -1;
+            }
+        }
+    }
+
+    // Compact the background process array
+    size_t new_count = 0;
+    for (size_t i = 0; i < bg_count; i++) {
+        if (bg[i].pid != -1) {
+            if (i != new_count) {
+                bg[new_count] = bg[i];
+            }
+            new_count++;
+        }
+    }
+    bg_count = new_count;
+}
+
+// Difference between two timestamps in milliseconds
+static double elapsed_ms(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static double timeval_ms(const struct timeval *tv) {
+    return tv->tv_sec * 1e3 + tv->tv_usec / 1e3;
+}
+
+/**
+ * Snapshots the clock and the shell's own resource usage
+ */
+void command_timer_start(CommandTimer *timer) {
+    getrusage(RUSAGE_SELF, &timer->self);
+    clock_gettime(CLOCK_MONOTONIC, &timer->start);
+}
+
+/**
+ * Returns milliseconds since command_timer_start
+ */
+double command_timer_elapsed(const CommandTimer *timer) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return elapsed_ms(&timer->start, &now);
+}
+
+// Append one report line
+static void append_stats(StrBuf *out, const char *label, double real_ms, double user_ms,
+                         double sys_ms, long maxrss_kb, long vol_cs, long invol_cs) {
+    char line[256];
+    int len = snprintf(line, sizeof(line),
+                       "%sreal %.3fs user %.3fs sys %.3fs maxrss %ldKB ctxsw %ld/%ld\n",
+                       label, real_ms / 1e3, user_ms / 1e3, sys_ms / 1e3,
+                       maxrss_kb, vol_cs, invol_cs);
+    strbuf_append(out, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+}
+
+/**
+ * Displays the timing report of the command timed by timer
+ * Note: ctxsw is voluntary/involuntary context switches. The shell's own
+ *       usage covers builtins; max RSS is the largest of any one process.
+ */
+void command_timer_report(const CommandTimer *timer) {
+    double real_ms = command_timer_elapsed(timer);
+    struct rusage self;
+    getrusage(RUSAGE_SELF, &self);
+
+    double user_ms = timeval_ms(&self.ru_utime) - timeval_ms(&timer->self.ru_utime);
+    double sys_ms = timeval_ms(&self.ru_stime) - timeval_ms(&timer->self.ru_stime);
+    long vol_cs = self.ru_nvcsw - timer->self.ru_nvcsw;
+    long invol_cs = self.ru_nivcsw - timer->self.ru_nivcsw;
+    long maxrss = last_stage_count == 0 ? self.ru_maxrss : 0;
+
+    StrBuf out = STRBUF_INIT;
+    for (size_t i = 0; i < last_stage_count; i++) {
+        const StageStats *st = &last_stages[i];
+        const struct rusage *ru = &st->usage;
+        user_ms += timeval_ms(&ru->ru_utime);
+        sys_ms += timeval_ms(&ru->ru_stime);
+        vol_cs += ru->ru_nvcsw;
+        invol_cs += ru->ru_nivcsw;
+        if (ru->ru_maxrss > maxrss) maxrss = ru->ru_maxrss;
+
+        if (last_stage_count > 1 && st->pid > 0) {
+            char label[64];
+            snprintf(label, sizeof(label), "  stage %zu pid %d status %d: ", i + 1, st->pid, st->status);
+            append_stats(&out, label, elapsed_ms(&st->start, &st->end),
+                         timeval_ms(&ru->ru_utime), timeval_ms(&ru->ru_stime),
+                         ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw);
+        }
+    }
+
+    StrBuf report = STRBUF_INIT;
+    append_stats(&report, "", real_ms, user_ms, sys_ms, maxrss, vol_cs, invol_cs);
+    if (out.len > 0) strbuf_append(&report, out.data, out.len);
+
+    // Stats go to stderr after any pending output, like error messages
+    flush_output();
+    if (report.data != NULL) {
+        for (size_t off = 0; off < report.len; ) {
+            ssize_t n = write(STDERR_FILENO, report.data + off, report.len - off);
+            if (n == -1 && errno != EINTR) break;
+            if (n > 0) off += n;
+        }
+    }
+    strbuf_free(&out);
+    strbuf_free(&report);
+}
+
+struct BuiltinJob {
+    pthread_t thread;
+    bn_ptr fn;
+    char **argv;            // Private copy of the tokens (one allocation)
+    pid_t tid;              // Thread ID, published before started is posted
+    sem_t started;
+    atomic_int finished;
+    ssize_t result;         // Builtin's return value once finished
+    OutBuf out;             // Output buffer private to this job
+    int in;                 // /dev/null, read in place of the terminal
+};
+
+// Thread body: run the builtin with its own output buffer
+static void *builtin_job_main(void *arg) {
+    BuiltinJob *job = arg;
+    job->tid = gettid();
+    sem_post(&job->started);
+
+    set_thread_output(&job->out);
+    set_thread_input(job->in);
+    job->result = job->fn(job->argv);
+    if (job->result == -1) {
+        display_error("ERROR: Builtin failed: ", job->argv[0]);
+    }
+    set_thread_input(STDIN_FILENO);
+    set_thread_output(NULL);
+    outbuf_release(&job->out);
+
+    atomic_store(&job->finished, 1);
+    return NULL;
+}
+
+/**
+ * Copies a token array into one allocation
+ * @return NULL terminated copy, or NULL on allocation failure
+ * Note: The command arena is reset after every line, so a job cannot keep
+ *       pointing at the original tokens.
+ */
+static char **copy_tokens(char **tokens) {
+    size_t count = 0, bytes = 0;
+    for (; tokens[count] != NULL; count++) {
+        bytes += strlen(tokens[count]) + 1;
+    }
+
+    char **argv = malloc((count + 1) * sizeof(char *) + bytes);
+    if (argv == NULL) return NULL;
+    char *strings = (char *)(argv + count + 1);
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(tokens[i]) + 1;
+        memcpy(strings, tokens[i], len);
+        argv[i] = strings;
+        strings += len;
+    }
+    argv[count] = NULL;
+    return argv;
+}
+
+/**
+ * Starts a builtin on a background thread
+ */
+BuiltinJob *builtin_job_start(bn_ptr fn, char **tokens, pid_t *tid) {
+    BuiltinJob *job = malloc(sizeof(BuiltinJob));
+    if (job == NULL) return NULL;
+    job->fn = fn;
+    job->argv = copy_tokens(tokens);
+    job->result = 0;
+    job->out = (OutBuf)OUTBUF_INIT(STDOUT_FILENO);
+    atomic_init(&job->finished, 0);
+    // Like a background process, the job must not take input from the terminal
+    job->in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (job->argv == NULL || job->in == -1 || sem_init(&job->started, 0, 0) == -1) {
+        if (job->in != -1) close(job->in);
+        free(job->argv);
+        free(job);
+        return NULL;
+    }
+
+    if (pthread_create(&job->thread, NULL, builtin_job_main, job) != 0) {
+        sem_destroy(&job->started);
+        close(job->in);
+        free(job->argv);
+        free(job);
+        return NULL;
+    }
+    while (sem_wait(&job->started) == -1) {
+        // Retry if interrupted by SIGINT
+    }
+    *tid = job->tid;
+    return job;
+}
+
+/**
+ * Checks whether a background builtin has returned
+ */
+int builtin_job_finished(BuiltinJob *job) {
+    return atomic_load(&job->finished);
+}
+
+/**
+ * Waits for a background builtin and releases it
+ */
+ssize_t builtin_job_join(BuiltinJob *job) {
+    pthread_join(job->thread, NULL);
+    ssize_t result = job->result;
+    sem_destroy(&job->started);
+    close(job->in);
+    free(job->argv);
+    free(job);
+    return result;
+}
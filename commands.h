@@ -2,15 +2,89 @@
 #define COMMANDS_H
 
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "builtins.h"
 
 #define MAX_STR_LEN 128
+
+// A builtin running in the background on its own thread
+typedef struct BuiltinJob BuiltinJob;
+
 // Creating a struct called Backgr
 typedef struct {
     char *command;
-    pid_t pid;
+    pid_t pid;          // Process ID, or thread ID for a builtin job
+    BuiltinJob *job;    // Set when the job is a builtin running on a thread
 } Backgr;
 
 extern Backgr bg[MAX_STR_LEN]; // Declare bg as extern
 extern size_t bg_count;        // Declare bg_count as extern
 
+/* Report background jobs that have finished and drop them from bg
+ */
+void backproc(void);
+
+/* Exit status and resource use of one foreground pipeline stage
+ */
+typedef struct StageStats {
+    pid_t pid;              // Child running the stage (-1 if fork failed)
+    int status;             // Exit status, 128 + signal if killed, -1 until reaped
+    struct timespec start;  // CLOCK_MONOTONIC time the stage was forked
+    struct timespec end;    // CLOCK_MONOTONIC time the stage was reaped
+    struct rusage usage;    // Resources used by the stage
+} StageStats;
+
+// Stages of the last foreground command that forked (builtins run in the
+// shell itself and leave this empty)
+extern StageStats *last_stages;
+extern size_t last_stage_count;
+
+/* Make room for the stages of a new foreground command
+ * Return: last_stages with last_stage_count set to n, or NULL on error
+ */
+StageStats *begin_stages(size_t n);
+
+/* Wait for exactly the given stages, filling in status, end and usage
+ * Stages are reaped in the order they exit, so unrelated children such as
+ * background jobs are never collected here.
+ */
+void wait_stages(StageStats *stages, size_t n);
+
+/* Resource snapshot taken when a timed command starts
+ */
+typedef struct CommandTimer {
+    struct timespec start;  // CLOCK_MONOTONIC start time
+    struct rusage self;     // Shell's own usage, for builtins run in-process
+} CommandTimer;
+
+void command_timer_start(CommandTimer *timer);
+
+/* Return: milliseconds since command_timer_start
+ */
+double command_timer_elapsed(const CommandTimer *timer);
+
+/* Display wall, user and sys time, max RSS and context switches for the
+ * command timed by timer on standard error, with a line per stage when
+ * the command was a pipeline
+ * Children are measured from last_stages; builtins from the shell itself.
+ */
+void command_timer_report(const CommandTimer *timer);
+
+/* Start a builtin on a background thread
+ * The tokens are copied, and output goes through a buffer private to the
+ * thread so it never interleaves mid-line with foreground output.
+ * Return: the job (with *tid set to its thread ID) or NULL on error
+ */
+BuiltinJob *builtin_job_start(bn_ptr fn, char **tokens, pid_t *tid);
+
+/* Return: 1 once the builtin has returned, 0 while it is running
+ */
+int builtin_job_finished(BuiltinJob *job);
+
+/* Wait for the builtin to return and release the job
+ * Return: the builtin's return value
+ */
+ssize_t builtin_job_join(BuiltinJob *job);
+
 #endif // COMMANDS_H
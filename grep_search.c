@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "grep_search.h"
+#include "pattern.h"
+#include "io_helpers.h"
+
+// Mapped files are searched in line-aligned slices of about this size
+#define GREP_SLICE (4 << 20)
+// Regex searches run over NULL terminated copies of line-aligned windows
+// of about this size (see search_lines)
+#define GREP_REGEX_WINDOW 4096
+// Read size when streaming a pipe or terminal
+#define GREP_READ_SIZE (1 << 20)
+// Direct output is handed to display_bytes once this much is pending
+#define GREP_FLUSH_SIZE 65536
+
+// Regex metacharacters; a pattern without them is searched literally
+#define BRE_META ".[]*^$\\"
+#define ERE_META ".[]*^$\\+?{}|()"
+
+// Search progress carried across slices of one input
+typedef struct GrepState {
+    const Grep *grep;
+    const char *prefix;     // Printed before each selected line
+    size_t prefix_len;
+    StrBuf *out;            // Where selected lines go
+    int direct;             // Flush out to stdout as it grows
+    uint64_t line_no;       // Number of the first line not yet counted
+    uint64_t matches;       // Lines selected so far
+    StrBuf window;          // Copy of the lines a regex is run over
+} GrepState;
+
+/**
+ * Compiles a pattern
+ */
+int grep_compile(Grep *grep, const char *pattern, GrepOpts opts) {
+    grep->opts = opts;
+    grep->pattern = pattern;
+    grep->pattern_len = strlen(pattern);
+    grep->literal = !opts.ignore_case &&
+        (opts.fixed || strpbrk(pattern, opts.extended ? ERE_META : BRE_META) == NULL);
+    if (grep->literal) return 0;
+
+    int flags = REG_NEWLINE;
+    if (opts.extended) flags |= REG_EXTENDED;
+    if (opts.ignore_case) flags |= REG_ICASE;
+    if (opts.fixed) {
+        // -F -i: escape the literal so the regex engine matches it as-is
+        char *escaped = malloc(grep->pattern_len * 2 + 1);
+        if (escaped == NULL) return -1;
+        size_t n = 0;
+        for (const char *p = pattern; *p; p++) {
+            if (strchr(BRE_META, *p)) escaped[n++] = '\\';
+            escaped[n++] = *p;
+        }
+        escaped[n] = '\0';
+        int err = regcomp(&grep->re, escaped, flags & ~REG_EXTENDED);
+        free(escaped);
+        return err == 0 ? 0 : -1;
+    }
+    return regcomp(&grep->re, pattern, flags) == 0 ? 0 : -1;
+}
+
+/**
+ * Releases a compiled pattern
+ */
+void grep_free(Grep *grep) {
+    if (!grep->literal) {
+        regfree(&grep->re);
+    }
+}
+
+// Count newlines in buf
+static uint64_t count_newlines(const char *buf, size_t len) {
+    uint64_t n = 0;
+    const char *end = buf + len;
+    while ((buf = memchr(buf, '\n', end - buf)) != NULL) {
+        n++;
+        buf++;
+    }
+    return n;
+}
+
+/* Find the first match in buf[start, end)
+ * Return: offset of a byte inside the matching line, or -1 if none
+ */
+static ssize_t find_match(const Grep *grep, const char *buf, size_t start, size_t end) {
+    if (grep->literal) {
+        const char *hit = simd_memmem(buf + start, end - start, grep->pattern, grep->pattern_len);
+        return hit ? hit - buf : -1;
+    }
+    regmatch_t m = {(regoff_t)start, (regoff_t)end};
+    if (regexec(&grep->re, buf, 1, &m, REG_STARTEND) != 0) return -1;
+    return m.rm_so;
+}
+
+// Append one selected line; line_no is its 1-based number
+static void emit_line(GrepState *st, const char *line, size_t len, uint64_t line_no) {
+    st->matches++;
+    if (st->grep->opts.count_only) return;
+
+    if (st->prefix_len) strbuf_append(st->out, st->prefix, st->prefix_len);
+    if (st->grep->opts.line_numbers) {
+        char num[32];
+        int n = snprintf(num, sizeof(num), "%" PRIu64 ":", line_no);
+        strbuf_append(st->out, num, n);
+    }
+    strbuf_append(st->out, line, len);
+    strbuf_appendc(st->out, '\n');
+
+    if (st->direct && st->out->len >= GREP_FLUSH_SIZE) {
+        display_bytes(st->out->data, st->out->len);
+        strbuf_reset(st->out);
+    }
+}
+
+/* Search a run of complete lines
+ * The matcher runs over the whole run and only the lines it stops in are
+ * isolated; -v has to look at every line instead.
+ */
+static void search_run(GrepState *st, const char *buf, size_t len) {
+    if (st->grep->opts.invert) {
+        for (size_t pos = 0; pos < len; ) {
+            const char *nl = memchr(buf + pos, '\n', len - pos);
+            size_t line_end = nl ? (size_t)(nl - buf) : len;
+            if (find_match(st->grep, buf, pos, line_end) == -1) {
+                emit_line(st, buf + pos, line_end - pos, st->line_no);
+            }
+            st->line_no++;
+            pos = line_end + 1;
+        }
+        return;
+    }
+
+    size_t pos = 0;       // Always at the start of a line
+    size_t counted = 0;   // Newlines before this offset are in line_no
+    while (pos < len) {
+        ssize_t hit = find_match(st->grep, buf, pos, len);
+        if (hit == -1) break;
+
+        const char *nl = memrchr(buf + pos, '\n', hit - pos);
+        size_t line_start = nl ? (size_t)(nl - buf) + 1 : pos;
+        nl = memchr(buf + hit, '\n', len - hit);
+        size_t line_end = nl ? (size_t)(nl - buf) : len;
+
+        if (st->grep->opts.line_numbers) {
+            st->line_no += count_newlines(buf + counted, line_start - counted);
+            counted = line_start;
+        }
+        emit_line(st, buf + line_start, line_end - line_start, st->line_no);
+        pos = line_end + 1;
+    }
+
+    // Keep line_no in step for the next slice
+    if (st->grep->opts.line_numbers && counted < len) {
+        st->line_no += count_newlines(buf + counted, len - counted);
+        if (buf[len - 1] != '\n') st->line_no++;
+    }
+}
+
+/* Search a run of complete lines
+ * A literal is searched in place. regexec is given NULL terminated copies
+ * of small line-aligned windows instead: it can do work proportional to
+ * everything after the start offset (and sanitizers measure the subject
+ * with strlen), which made each hit rescan the rest of the slice.
+ */
+static void search_lines(GrepState *st, const char *buf, size_t len) {
+    if (st->grep->literal) {
+        search_run(st, buf, len);
+        return;
+    }
+    for (size_t pos = 0; pos < len; ) {
+        size_t end = pos + GREP_REGEX_WINDOW;
+        if (end >= len) {
+            end = len;
+        } else {
+            const char *nl = memchr(buf + end, '\n', len - end);
+            end = nl ? (size_t)(nl - buf) + 1 : len;
+        }
+        strbuf_reset(&st->window);
+        if (strbuf_append(&st->window, buf + pos, end - pos) == -1) return;
+        search_run(st, st->window.data, end - pos);
+        pos = end;
+    }
+}
+
+// Search a mapped file slice by slice
+static void search_mapped(GrepState *st, const char *buf, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        size_t end = pos + GREP_SLICE;
+        if (end >= len) {
+            end = len;
+        } else {
+            const char *nl = memchr(buf + end, '\n', len - end);
+            end = nl ? (size_t)(nl - buf) + 1 : len;
+        }
+        search_lines(st, buf + pos, end - pos);
+        pos = end;
+    }
+}
+
+// Search a stream, carrying any partial last line into the next read
+static int search_stream(GrepState *st, int fd) {
+    size_t cap = GREP_READ_SIZE;
+    char *buf = malloc(cap);
+    if (buf == NULL) return -1;
+
+    size_t used = 0;
+    int ret = 0;
+    while (1) {
+        if (used == cap) {
+            char *grown = realloc(buf, cap * 2);
+            if (grown == NULL) {
+                ret = -1;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + used, cap - used);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            ret = -1;
+            break;
+        }
+        if (n == 0) {
+            if (used > 0) search_lines(st, buf, used);
+            break;
+        }
+
+        const char *last_nl = memrchr(buf + used, '\n', n);
+        used += n;
+        if (last_nl != NULL) {
+            size_t complete = last_nl - buf + 1;
+            search_lines(st, buf, complete);
+            memmove(buf, buf + complete, used - complete);
+            used -= complete;
+        }
+    }
+    free(buf);
+    return ret;
+}
+
+/**
+ * Searches everything readable from fd
+ */
+int grep_fd(const Grep *grep, int fd, const char *prefix, StrBuf *out, int direct, uint64_t *matches) {
+    GrepState st = {grep, prefix, prefix ? strlen(prefix) : 0, out, direct, 1, 0, STRBUF_INIT};
+    int ret = 0;
+
+    struct stat sb;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+        map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (map != MAP_FAILED) {
+        madvise(map, sb.st_size, MADV_SEQUENTIAL);
+        search_mapped(&st, map, sb.st_size);
+        munmap(map, sb.st_size);
+    } else {
+        ret = search_stream(&st, fd);
+    }
+
+    if (grep->opts.count_only) {
+        char num[32];
+        int n = snprintf(num, sizeof(num), "%" PRIu64 "\n", st.matches);
+        if (st.prefix_len) strbuf_append(out, prefix, st.prefix_len);
+        strbuf_append(out, num, n);
+    }
+    if (direct && out->len > 0) {
+        display_bytes(out->data, out->len);
+        strbuf_reset(out);
+    }
+    strbuf_free(&st.window);
+    *matches = st.matches;
+    return ret;
+}
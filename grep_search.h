@@ -0,0 +1,57 @@
+#ifndef GREP_SEARCH_H
+#define GREP_SEARCH_H
+
+#include <regex.h>    // For regex_t
+#include <stdint.h>   // For uint64_t
+#include "strbuf.h"
+
+/**
+ * Options for the grep builtin
+ */
+typedef struct GrepOpts {
+    int line_numbers;   // -n: prefix lines with their number
+    int count_only;     // -c: print only the number of matching lines
+    int invert;         // -v: select lines that do not match
+    int ignore_case;    // -i: case-insensitive matching
+    int fixed;          // -F: pattern is a literal string
+    int extended;       // -E: pattern is an extended regex
+} GrepOpts;
+
+/**
+ * A compiled grep pattern
+ * Literal patterns are found with SIMD memmem over whole buffers; anything
+ * else goes through a POSIX regex run over buffer ranges (REG_STARTEND).
+ */
+typedef struct Grep {
+    GrepOpts opts;
+    const char *pattern;   // Pattern text (literal searches use it directly)
+    size_t pattern_len;
+    int literal;           // Whether the memmem path is used
+    regex_t re;            // Compiled regex when not literal
+} Grep;
+
+/**
+ * Compiles a pattern
+ * @return 0 on success, -1 if the regex is invalid
+ */
+int grep_compile(Grep *grep, const char *pattern, GrepOpts opts);
+
+/**
+ * Releases a compiled pattern
+ */
+void grep_free(Grep *grep);
+
+/**
+ * Searches everything readable from fd
+ * @param grep Compiled pattern
+ * @param fd Input; regular files are memory mapped, others are streamed
+ * @param prefix Printed before each line, e.g. "file:" (may be NULL)
+ * @param out Matching lines are appended here
+ * @param direct If set, out is written to standard output whenever it grows
+ *               large, so only the calling thread may use it
+ * @param matches Set to the number of selected lines
+ * @return 0 on success, -1 on read error
+ */
+int grep_fd(const Grep *grep, int fd, const char *prefix, StrBuf *out, int direct, uint64_t *matches);
+
+#endif
@@ -6,8 +6,8 @@
 // Maximum number of simultaneous client connections
 #define MAX_CLIENTS 10
 
-// Length of client ID string (including null terminator)
-#define CLIENT_ID_LEN 16
+// Length of client ID string (including null terminator); fits "client" + any int + ":"
+#define CLIENT_ID_LEN 20
 
 // Size of communication buffer
 #define BUF_SIZE 1024
@@ -1,126 +1,476 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include "io_helpers.h"
 #include "variables.h"
+#include "strbuf.h"
+#include "trace.h"
 #include <ctype.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 // ===== Output helpers =====
 
+// Smallest flush to a pipe that is gifted with vmsplice rather than written
+#define OUTBUF_GIFT_MIN (OUTBUF_SIZE / 2)
+
+// Buffered standard output shared by display_message and the builtins
+static OutBuf stdout_buf = OUTBUF_INIT(STDOUT_FILENO);
+// Buffer used by this thread instead of stdout_buf (background builtins)
+static __thread OutBuf *thread_out = NULL;
+// Descriptor read instead of standard input by this thread (background builtins)
+static __thread int thread_in = STDIN_FILENO;
+
+static OutBuf *current_out(void) {
+    return thread_out != NULL ? thread_out : &stdout_buf;
+}
+
+/**
+ * Writes all of buf to fd, retrying on short writes and EINTR
+ * @return 0 on success, -1 on error
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Hands the first gift_len bytes buffered in out to a pipe without
+ * copying them, then writes the rest
+ * @param out Output buffer whose fd is a pipe
+ * @param gift_len Whole pages at the start of the buffer to gift
+ * Note: SPLICE_F_GIFT gives the pages to the pipe, so the buffer is
+ *       unmapped afterwards and the next write maps fresh pages. Anything
+ *       vmsplice refuses is written normally.
+ */
+static void outbuf_gift(OutBuf *out, size_t gift_len) {
+    struct iovec iov = {out->buf, gift_len};
+    while (iov.iov_len > 0) {
+        ssize_t n = vmsplice(out->fd, &iov, 1, SPLICE_F_GIFT);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            write_all(out->fd, iov.iov_base, iov.iov_len);
+            break;
+        }
+        iov.iov_base = (char *)iov.iov_base + n;
+        iov.iov_len -= n;
+    }
+    write_all(out->fd, out->buf + gift_len, out->len - gift_len);
+    munmap(out->buf, OUTBUF_SIZE);
+    out->buf = NULL;
+}
+
+/**
+ * Writes out everything buffered in out
+ * @param out Output buffer to flush
+ * Note: Only large flushes to a pipe are gifted; a small one is cheaper as
+ *       one write than as vmsplice plus munmap and a fresh mmap.
+ */
+void outbuf_flush(OutBuf *out) {
+    if (out->len == 0) return;
+    size_t gift_len = 0;
+    if (out->is_pipe && out->len >= OUTBUF_GIFT_MIN) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        gift_len = out->len & ~(page - 1);
+    }
+    if (gift_len > 0) {
+        outbuf_gift(out, gift_len);
+    } else {
+        write_all(out->fd, out->buf, out->len);
+    }
+    out->len = 0;
+}
+
+/**
+ * Flushes an output buffer and releases its storage
+ * @param out Output buffer to release
+ */
+void outbuf_release(OutBuf *out) {
+    outbuf_flush(out);
+    if (out->buf != NULL) {
+        munmap(out->buf, OUTBUF_SIZE);
+        out->buf = NULL;
+    }
+}
+
+/**
+ * Appends len bytes to an output buffer
+ * @param out Output buffer to append to
+ * @param str Bytes to write (need not be NULL terminated)
+ * @param len Number of bytes to write
+ * Note: Flushes when the buffer fills and, only when the fd is a
+ *       terminal, after each newline. Writes larger than the buffer
+ *       bypass it entirely.
+ */
+void outbuf_write(OutBuf *out, const char *str, size_t len) {
+    if (len == 0) return;
+    if (out->is_tty < 0) {
+        struct stat st;
+        out->is_tty = isatty(out->fd);
+        out->is_pipe = fstat(out->fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    }
+
+    if (out->len + len > OUTBUF_SIZE) {
+        outbuf_flush(out);
+        if (len >= OUTBUF_SIZE) {
+            write_all(out->fd, str, len);
+            return;
+        }
+    }
+    if (out->buf == NULL) {
+        void *pages = mmap(NULL, OUTBUF_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pages == MAP_FAILED) {
+            write_all(out->fd, str, len);
+            return;
+        }
+        out->buf = pages;
+    }
+    memcpy(out->buf + out->len, str, len);
+    out->len += len;
+
+    if (out->is_tty && memchr(str, '\n', len) != NULL) {
+        outbuf_flush(out);
+    }
+}
+
 /**
  * Displays a message to standard output
  * @param str Null-terminated string to display
- * Note: Limits output to MAX_STR_LEN characters for safety
+ * Note: Output is buffered; see flush_output()
  */
 void display_message(char *str) {
-    write(STDOUT_FILENO, str, strnlen(str, MAX_STR_LEN));
+    outbuf_write(current_out(), str, strlen(str));
+}
+
+/**
+ * Displays len bytes to standard output
+ * @param str Bytes to display (need not be NULL terminated)
+ * @param len Number of bytes to display
+ */
+void display_bytes(const char *str, size_t len) {
+    outbuf_write(current_out(), str, len);
+}
+
+/**
+ * Writes out any buffered standard output
+ * Note: Must be called before fork/exec, before prompting and before
+ *       anything else writes to STDOUT_FILENO directly
+ */
+void flush_output(void) {
+    outbuf_flush(current_out());
+}
+
+/**
+ * Discards cached knowledge about STDOUT_FILENO after it was redirected
+ */
+void reset_output(void) {
+    OutBuf *out = current_out();
+    out->len = 0;
+    out->is_tty = -1;
+}
+
+/**
+ * Returns the buffer display_message writes to on this thread
+ */
+OutBuf *get_thread_output(void) {
+    return current_out();
+}
+
+/**
+ * Sends this thread's output through its own buffer
+ * @param out Buffer to use, or NULL for the shared standard output buffer
+ * Note: Lets a builtin run on a background thread without interleaving
+ *       partial writes with the foreground command
+ */
+void set_thread_output(OutBuf *out) {
+    thread_out = out;
+}
+
+/**
+ * Returns the descriptor builtins on this thread read as standard input
+ */
+int get_thread_input(void) {
+    return thread_in;
+}
+
+/**
+ * Gives this thread its own standard input
+ * @param fd Descriptor to read, or STDIN_FILENO for the shared one
+ * Note: Keeps a builtin on a background thread from reading the terminal
+ *       out from under the foreground command
+ */
+void set_thread_input(int fd) {
+    thread_in = fd;
+}
+
+/**
+ * Parses a size with an optional K, M or G suffix
+ * @param arg Size such as 4096, 512K, 64M or 1G
+ * @return Size in bytes, or 0 if arg is not a valid size
+ */
+size_t parse_size(const char *arg) {
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg || arg[0] == '-') return 0;
+    switch (*end) {
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+    case 'g': case 'G': n <<= 30; end++; break;
+    }
+    return *end == '\0' ? (size_t)n : 0;
+}
+
+/**
+ * Reads everything left in a file descriptor
+ * @param fd Descriptor to read until EOF
+ * @param len Set to the number of bytes read
+ * @return Newly allocated NULL terminated contents, or NULL on error
+ * Note: The buffer is sized from fstat, so regular files are read
+ *       without reallocating.
+ */
+char *read_fd(int fd, size_t *len) {
+    struct stat st;
+    size_t cap = (fstat(fd, &st) == 0 && st.st_size > 0) ? (size_t)st.st_size + 1 : 4096;
+    char *text = malloc(cap);
+    size_t used = 0;
+    while (text != NULL) {
+        if (used + 1 == cap) {
+            char *grown = realloc(text, cap * 2);
+            if (grown == NULL) {
+                free(text);
+                return NULL;
+            }
+            text = grown;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, text + used, cap - used - 1);
+        if (n == 0) break;
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            int saved_errno = errno;
+            free(text);
+            errno = saved_errno;
+            return NULL;
+        }
+        used += n;
+    }
+    if (text == NULL) return NULL;
+    text[used] = '\0';
+    *len = used;
+    return text;
 }
 
 /**
  * Displays an error message to standard error
  * @param pre_str Prefix error message
  * @param str Main error message
- * Note: Combines both strings and adds a newline
+ * Note: Combines both strings and adds a newline. Pending standard
+ *       output is flushed first so messages stay in order.
  */
 void display_error(const char *pre_str, const char *str) {
-    write(STDERR_FILENO, pre_str, strnlen(pre_str, MAX_STR_LEN));
-    write(STDERR_FILENO, str, strnlen(str, MAX_STR_LEN));
-    write(STDERR_FILENO, "\n", 1); // Add a newline
+    flush_output();
+    struct iovec iov[3] = {
+        {(void *)pre_str, strlen(pre_str)},
+        {(void *)str, strlen(str)},
+        {"\n", 1} // Add a newline
+    };
+    writev(STDERR_FILENO, iov, 3);
 }
 
 // ===== Input handling =====
 
 /**
- * Reads input from stdin with safety checks
- * @param in_ptr Buffer to store input (must be > MAX_STR_LEN)
- * @return Number of bytes read, -1 on EOF/error, -2 if input was truncated
- * Note: Ensures null-termination and handles buffer overflow
+ * Makes room at the end of the reader's buffer for another read
+ * @return 0 on success, -1 on allocation failure
+ * Note: Consumed bytes are discarded first; the buffer only grows when a
+ *       single pending line already fills it
  */
-ssize_t get_input(char *in_ptr) {
-    // Read up to MAX_STR_LEN bytes to avoid overflow
-    ssize_t retval = read(STDIN_FILENO, in_ptr, MAX_STR_LEN);
-
-    if (retval == 0) {
-        // EOF condition (Ctrl+D)
-        return -1;
-    } else if (retval == -1) {
-        // Read error
-        perror("read");
-        return -1;
+static int reader_make_room(LineReader *reader) {
+    if (reader->start > 0) {
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->scan -= reader->start;
+        reader->start = 0;
     }
+    if (reader->end + 1 < reader->cap) return 0;
+
+    size_t new_cap = reader->cap ? reader->cap * 2 : READER_BUF_SIZE;
+    char *buf = realloc(reader->buf, new_cap);
+    if (buf == NULL) return -1;
+    reader->buf = buf;
+    reader->cap = new_cap;
+    return 0;
+}
 
-    // Null-terminate the input
-    in_ptr[retval] = '\0';
+/**
+ * Returns the next line from a buffered reader
+ * @param reader Reader to pull from
+ * @param line Set to the NULL terminated line (newline stripped)
+ * @return Length of the line, or -1 on EOF/error
+ * Note: A single read() may deliver many lines; they are handed out one
+ *       at a time without touching the fd again. The line stays valid
+ *       until the next call.
+ */
+ssize_t read_line(LineReader *reader, char **line) {
+    while (1) {
+        // Look for a newline in the bytes not yet scanned
+        char *nl = NULL;
+        if (reader->scan < reader->end) {
+            nl = memchr(reader->buf + reader->scan, '\n', reader->end - reader->scan);
+        }
+        if (nl != NULL) {
+            *nl = '\0';
+            *line = reader->buf + reader->start;
+            ssize_t len = nl - *line;
+            reader->start = reader->scan = nl - reader->buf + 1;
+            return len;
+        }
+        reader->scan = reader->end;
 
-    // Check for potential truncation
-    if (retval == MAX_STR_LEN) {
-        display_error("ERROR: input line too long", "");
+        if (reader->eof) {
+            if (reader->start == reader->end) return -1;
+            if (reader_make_room(reader) == -1) return -1;
+            // Final line without a trailing newline
+            reader->buf[reader->end] = '\0';
+            *line = reader->buf + reader->start;
+            ssize_t len = reader->end - reader->start;
+            reader->start = reader->scan = reader->end;
+            return len;
+        }
 
-        // Flush remaining input to prevent problems with next read
-        int c;
-        while ((c = getchar()) != '\n' && c != EOF);
+        if (reader_make_room(reader) == -1) {
+            perror("read_line");
+            return -1;
+        }
+        ssize_t n = read(reader->fd, reader->buf + reader->end, reader->cap - reader->end - 1);
+        if (n == 0) {
+            reader->eof = 1;
+        } else if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("read");
+            return -1;
+        } else {
+            reader->end += n;
+        }
+    }
+}
 
-        // Special return code for truncated input
-        return -2;
+/**
+ * Reads the next line of shell input from stdin
+ * @param line Set to the NULL terminated line (valid until the next call)
+ * @return Number of bytes in the line, -1 on EOF/error
+ */
+ssize_t get_input(char **line) {
+    flush_output();
+    static LineReader stdin_reader = LINE_READER_INIT(STDIN_FILENO);
+    return read_line(&stdin_reader, line);
+}
+
+/**
+ * Splits the next whitespace separated token off a line
+ * @param cursor Position to scan from; advanced past the token
+ * @return The token, NULL terminated in place, or NULL at the end of the line
+ * Note: A $( ... ) group is kept in one token even if it contains
+ *       whitespace, so $(( i + 1 )) reaches expansion whole.
+ */
+static char *next_token(char **cursor) {
+    char *p = *cursor;
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+    if (*p == '\0') {
+        *cursor = p;
+        return NULL;
     }
 
-    return retval;
+    char *token = p;
+    int depth = 0;   // Open parentheses of the current $( group
+    for (; *p != '\0'; p++) {
+        if (depth == 0 && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) break;
+        if (*p == '$' && p[1] == '(') {
+            depth++;
+            p++;
+        } else if (depth > 0 && *p == '(') {
+            depth++;
+        } else if (depth > 0 && *p == ')') {
+            depth--;
+        }
+    }
+    if (*p != '\0') *p++ = '\0';
+    *cursor = p;
+    return token;
 }
 
 /**
  * Tokenizes input string and handles variable expansion
  * @param input_buf Input string to tokenize (will be modified)
- * @param token_arr Array to store resulting tokens
+ * @param token_count Set to the number of tokens generated
  * @param var_list Pointer to variable list for expansion
- * @return Number of tokens generated
- * Note: Handles special characters ($, |) and variable expansion
- */
-size_t tokenize_input(char *input_buf, char *token_arr[], Variable **var_list) {
-    size_t token_count = 0;
-    char *token = strtok(input_buf, " \t\r\n"); // Split on whitespace
-
-    while (token != NULL) {
-        // Special case: standalone "$" character
-        if (strcmp(token, "$") == 0) {
-            token_arr[token_count++] = strdup("$");
-            token = strtok(NULL, " \t\r\n");
-            continue;
-        }
-
-        // Special case: pipe character
-        if (strcmp(token, "|") == 0) {
-            token_arr[token_count++] = strdup("|");
-            token = strtok(NULL, " \t\r\n");
-            continue;
-        }
+ * @param arena Arena that owns the token array and expanded tokens
+ * @return NULL terminated token array
+ * Note: Tokens without a $ point straight into input_buf; only expanded
+ *       tokens are copied, and every allocation comes from the arena.
+ *       If an arithmetic expansion fails, no tokens are returned.
+ */
+char **tokenize_input(char *input_buf, size_t *token_count, Variable **var_list, Arena *arena) {
+    // A line of n bytes holds at most n / 2 + 1 tokens
+    size_t input_len = strlen(input_buf);
+    char **token_arr = arena_alloc(arena, (input_len / 2 + 2) * sizeof(char *));
+    size_t count = 0;
 
-        // Buffer for expanded variables
-        char expanded[MAX_STR_LEN] = {0};
+    // Scratch buffer for expansion, kept across calls to avoid reallocating.
+    // A $(cmd) substitution tokenizes its command while the outer call is
+    // still using the shared buffer, so nested calls get their own.
+    static StrBuf shared = STRBUF_INIT;
+    static int nesting = 0;
+    StrBuf local = STRBUF_INIT;
+    StrBuf *expanded = nesting == 0 ? &shared : &local;
+    nesting++;
 
-        // Handle variable expansion if token starts with '$'
-        if (token[0] == '$' && strlen(token) > 1) {
-            expand_variables(token, expanded, *var_list);
-        } else {
-            strncpy(expanded, token, MAX_STR_LEN - 1);
-        }
+    char *cursor = input_buf;
+    char *token;
+    while ((token = next_token(&cursor)) != NULL) {
+        size_t token_len = strlen(token);
 
-        // Store the token (either expanded or original)
-        token_arr[token_count] = strdup(expanded);
-        if (token_arr[token_count] == NULL) {
-            // Cleanup on allocation failure
-            for (size_t i = 0; i < token_count; i++) {
-                free(token_arr[i]);
+        // Expand variable references anywhere in the token
+        if (token_len > 1 && memchr(token, '$', token_len) != NULL) {
+            uint64_t trace_start_ns = trace_now();
+            strbuf_reset(expanded);
+            int err = expand_variables(token, token_len, expanded, var_list);
+            if (err == -1) {
+                perror("expand_variables failed");
+                exit(EXIT_FAILURE);
+            }
+            if (err == -2) {
+                // Already reported; drop the whole command
+                count = 0;
+                break;
             }
-            perror("strdup failed");
-            exit(EXIT_FAILURE);
+            trace_event("expand", trace_start_ns, token);
+            token = arena_strndup(arena, expanded->len ? expanded->data : "", expanded->len);
         }
-        token_count++;
 
-        token = strtok(NULL, " \t\r\n");
+        token_arr[count++] = token;
     }
 
+    nesting--;
+    strbuf_free(&local);
+
     // Null-terminate the token array
-    token_arr[token_count] = NULL;
-    return token_count;
+    token_arr[count] = NULL;
+    *token_count = count;
+    return token_arr;
 }
@@ -4,26 +4,107 @@
 #include <sys/types.h>
 #include <stddef.h>
 #include "variables.h"
+#include "arena.h"
 
 #define MAX_STR_LEN 128
 #define DELIMITERS " \t\n"     // Assumption: all input tokens are whitespace delimited
 
 
+// Size of the buffer behind display_message
+#define OUTBUF_SIZE 65536
+
+/* Output buffer for one file descriptor
+ * When fd is a pipe, full buffers are gifted to it with vmsplice rather
+ * than copied by write, so the storage is page-aligned anonymous memory
+ * that is replaced after every such flush.
+ */
+typedef struct OutBuf {
+    int fd;                 // Descriptor the buffer drains to
+    int is_tty;             // 1 if fd is a terminal, -1 until checked
+    int is_pipe;            // 1 if fd is a pipe (valid once is_tty is)
+    size_t len;             // Bytes currently buffered
+    char *buf;              // Pending output (OUTBUF_SIZE bytes, mapped on first write)
+} OutBuf;
+
+#define OUTBUF_INIT(fd) {(fd), -1, 0, 0, NULL}
+
+void outbuf_write(OutBuf *out, const char *str, size_t len);
+void outbuf_flush(OutBuf *out);
+// Flush out and unmap its storage
+void outbuf_release(OutBuf *out);
+
 /* Prereq: pre_str, str are NULL terminated string
+ * display_message is buffered: it flushes on newline only for terminals,
+ * when the buffer fills, and on flush_output()
  */
 void display_message(char *str);
+void display_bytes(const char *str, size_t len);
 void display_error(const char *pre_str, const char *str);
 
+/* Flush buffered standard output; call before fork/exec and prompting
+ */
+void flush_output(void);
+
+/* Forget buffered state after STDOUT_FILENO has been redirected
+ */
+void reset_output(void);
+
+/* Per-thread output: display_message and friends write to the calling
+ * thread's buffer, which is the shared standard output buffer unless
+ * set_thread_output() gave the thread its own (NULL restores the default)
+ */
+OutBuf *get_thread_output(void);
+void set_thread_output(OutBuf *out);
+
+/* Per-thread input: the descriptor builtins read when given no file, which
+ * is STDIN_FILENO unless set_thread_input() gave the thread another one
+ */
+int get_thread_input(void);
+void set_thread_input(int fd);
+
+/* Parse a size such as 4096, 512K, 64M or 1G
+ * Return: the size in bytes, or 0 if arg is not a valid size
+ */
+size_t parse_size(const char *arg);
+
+/* Read everything left in fd
+ * Return: malloc'd NULL terminated contents with its length in *len, or
+ *         NULL on a read or allocation error (errno is set)
+ */
+char *read_fd(int fd, size_t *len);
+
+
+// Initial size of a LineReader buffer; grows for longer lines
+#define READER_BUF_SIZE 65536
+
+/* Buffered line reader over a file descriptor
+ * buf[start, end) holds unconsumed input; buf[start, scan) has no newline
+ */
+typedef struct LineReader {
+    int fd;         // Descriptor lines are read from
+    int eof;        // Set once read() has returned 0
+    char *buf;      // Input buffer (allocated on first read)
+    size_t cap;     // Allocated size of buf
+    size_t start;   // First unconsumed byte
+    size_t scan;    // First byte not yet searched for a newline
+    size_t end;     // One past the last byte read
+} LineReader;
+
+#define LINE_READER_INIT(fd) {(fd), 0, NULL, 0, 0, 0, 0}
+
+/* Return: length of the next line from reader (stored NULL terminated in
+ *         *line, valid until the next call) or -1 on EOF/error
+ */
+ssize_t read_line(LineReader *reader, char **line);
 
-/* Prereq: in_ptr points to a character buffer of size > MAX_STR_LEN
- * Return: number of bytes read
+/* Return: length of the next line of stdin (see read_line) or -1 on EOF/error
  */
-ssize_t get_input(char *in_ptr);
+ssize_t get_input(char **line);
 
 
-/* Prereq: in_ptr is a string, tokens is of size >= len(in_ptr)
- * Warning: in_ptr is modified
- * Return: number of tokens.
+/* Prereq: input_buf is a string
+ * Warning: input_buf is modified and must outlive the returned tokens
+ * Return: NULL terminated token array owned by arena; *token_count is set
  */
-size_t tokenize_input(char *input_buf, char *token_arr[], Variable **var_list);
+char **tokenize_input(char *input_buf, size_t *token_count, Variable **var_list, Arena *arena);
 #endif
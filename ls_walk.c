@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "ls_walk.h"
+#include "pattern.h"
+#include "workpool.h"
+#include "strbuf.h"
+#include "io_helpers.h"
+
+// Unordered output is written out once a directory buffers this much
+#define LS_FLUSH_SIZE 65536
+
+typedef struct LsWalk LsWalk;
+typedef struct LsNode LsNode;
+
+// Position in a parent's output where a subdirectory's listing belongs
+typedef struct LsChild {
+    size_t offset;   // Byte offset into the parent's out buffer
+    LsNode *node;    // Subdirectory listed there
+} LsChild;
+
+/* One directory in the walk
+ * A node holds a reference on its parent for its whole life, so the
+ * parent's directory fd stays open for openat() and the path stays
+ * available for error messages.
+ */
+struct LsNode {
+    LsWalk *walk;          // Walk this node belongs to
+    LsNode *parent;        // Containing directory (NULL for the root)
+    char *name;            // Entry name, or the starting path for the root
+    int depth;             // 0 for the root
+    uint64_t state;        // Pattern components still possible here
+    DIR *dir;              // Open stream, closed when refs drops to 0
+    int refs;              // Own task plus live children
+    StrBuf out;            // Names listed in this directory
+    LsChild *children;     // Subdirectories in listing order (ordered mode)
+    size_t nchildren;      // Entries used in children
+    size_t cap;            // Entries allocated in children
+};
+
+// Settings and shared state for one ls --rec invocation
+struct LsWalk {
+    const Pattern *filter;     // Name filter, or NULL
+    int max_depth;             // Levels to list, or -1
+    int ordered;               // Whether output is deferred for ordering
+    WorkPool *pool;            // Pool running directory tasks
+    pthread_mutex_t out_lock;  // Serializes writes to stdout and stderr
+    int root_failed;           // Set if the starting path cannot be opened
+};
+
+static void list_dir(void *arg);
+
+// Build the path of node for messages
+static void node_path(LsNode *node, StrBuf *path) {
+    if (node->parent) {
+        node_path(node->parent, path);
+        strbuf_appendc(path, '/');
+    }
+    strbuf_append(path, node->name, strlen(node->name));
+}
+
+// Report a directory that cannot be opened
+static void report_invalid(LsNode *node) {
+    StrBuf path = STRBUF_INIT;
+    node_path(node, &path);
+    pthread_mutex_lock(&node->walk->out_lock);
+    display_error("ERROR: Invalid path: ", path.data ? path.data : "");
+    pthread_mutex_unlock(&node->walk->out_lock);
+    strbuf_free(&path);
+}
+
+/* Drop one reference; the last one closes the directory and releases
+ * the parent. Unordered nodes are freed then; ordered nodes are freed
+ * after their output has been printed.
+ */
+static void node_release(LsNode *node) {
+    while (node != NULL && __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        LsNode *parent = node->parent;
+        if (node->dir) {
+            closedir(node->dir);
+            node->dir = NULL;
+        }
+        if (!node->walk->ordered) {
+            strbuf_free(&node->out);
+            free(node->name);
+            free(node);
+        }
+        node = parent;
+    }
+}
+
+static LsNode *node_new(LsWalk *walk, LsNode *parent, const char *name, size_t name_len) {
+    LsNode *node = calloc(1, sizeof(LsNode));
+    if (node == NULL) return NULL;
+    node->name = malloc(name_len + 1);
+    if (node->name == NULL) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->name, name, name_len);
+    node->name[name_len] = '\0';
+    node->walk = walk;
+    node->parent = parent;
+    node->depth = parent ? parent->depth + 1 : 0;
+    node->refs = 1;
+    return node;
+}
+
+// Write out a directory's buffered names (unordered mode)
+static void flush_node(LsNode *node) {
+    if (node->out.len == 0) return;
+    pthread_mutex_lock(&node->walk->out_lock);
+    display_bytes(node->out.data, node->out.len);
+    pthread_mutex_unlock(&node->walk->out_lock);
+    strbuf_reset(&node->out);
+}
+
+// Record a subdirectory at the current point of the listing and queue it
+static void add_child(LsNode *node, const char *name, size_t name_len, uint64_t state) {
+    LsNode *child = node_new(node->walk, node, name, name_len);
+    if (child == NULL) return;
+    child->state = state;
+
+    if (node->walk->ordered) {
+        if (node->nchildren == node->cap) {
+            size_t new_cap = node->cap ? node->cap * 2 : 8;
+            LsChild *children = realloc(node->children, new_cap * sizeof(LsChild));
+            if (children == NULL) {
+                free(child->name);
+                free(child);
+                return;
+            }
+            node->children = children;
+            node->cap = new_cap;
+        }
+        node->children[node->nchildren++] = (LsChild){node->out.len, child};
+    }
+
+    __atomic_add_fetch(&node->refs, 1, __ATOMIC_ACQ_REL);
+    workpool_submit(node->walk->pool, list_dir, child);
+}
+
+/* Work item: read one directory
+ * d_type is trusted when the filesystem provides it; fstatat() is only
+ * used for DT_UNKNOWN. Symbolic links are listed but not followed.
+ */
+static void list_dir(void *arg) {
+    LsNode *node = arg;
+    LsWalk *walk = node->walk;
+
+    int fd;
+    if (node->parent == NULL) {
+        fd = open(node->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    } else {
+        fd = openat(dirfd(node->parent->dir), node->name,
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    }
+    if (fd != -1) {
+        node->dir = fdopendir(fd);
+        if (node->dir == NULL) close(fd);
+    }
+    if (node->dir == NULL) {
+        if (node->parent == NULL) walk->root_failed = 1;
+        report_invalid(node);
+        node_release(node);
+        return;
+    }
+
+    int descend = walk->max_depth < 0 || node->depth + 1 < walk->max_depth;
+    struct dirent *entry;
+    while ((entry = readdir(node->dir)) != NULL) {
+        const char *name = entry->d_name;
+        size_t name_len = strlen(name);
+        int dot = name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+
+        // Display entry if it matches filter (or no filter)
+        if (walk->filter == NULL ||
+            pattern_match_entry(walk->filter, node->state, name, name_len)) {
+            strbuf_append(&node->out, name, name_len);
+            strbuf_appendc(&node->out, '\n');
+        }
+
+        // Recurse into subdirectories if allowed by depth and the filter
+        if (dot || !descend) continue;
+        uint64_t state = 0;
+        if (walk->filter != NULL) {
+            state = pattern_descend(walk->filter, node->state, name, name_len);
+            if (state == 0) continue;
+        }
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dirfd(node->dir), name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                     S_ISDIR(st.st_mode);
+        }
+        if (is_dir) {
+            add_child(node, name, name_len, state);
+        }
+
+        if (!walk->ordered && node->out.len >= LS_FLUSH_SIZE) {
+            flush_node(node);
+        }
+    }
+
+    if (!walk->ordered) {
+        flush_node(node);
+    }
+    node_release(node);
+}
+
+// Print an ordered subtree depth-first, freeing it as it goes
+static void emit_ordered(LsNode *node) {
+    size_t pos = 0;
+    for (size_t i = 0; i < node->nchildren; i++) {
+        LsChild *child = &node->children[i];
+        display_bytes(node->out.data + pos, child->offset - pos);
+        pos = child->offset;
+        emit_ordered(child->node);
+    }
+    if (node->out.len > pos) {
+        display_bytes(node->out.data + pos, node->out.len - pos);
+    }
+
+    free(node->children);
+    strbuf_free(&node->out);
+    free(node->name);
+    free(node);
+}
+
+/**
+ * Lists a directory tree for ls --rec
+ */
+int ls_walk(const char *path, const Pattern *filter, int max_depth, int ordered) {
+    // Base case: nothing to list at depth 0
+    if (max_depth == 0) return 0;
+
+    LsWalk walk = {filter, max_depth, ordered, NULL, PTHREAD_MUTEX_INITIALIZER, 0};
+    walk.pool = workpool_create(0);
+    if (walk.pool == NULL) return -1;
+
+    LsNode *root = node_new(&walk, NULL, path, strlen(path));
+    if (root == NULL) {
+        workpool_destroy(walk.pool);
+        return -1;
+    }
+    // Keep the root alive for emit_ordered until the walk is done
+    root->refs++;
+    root->state = filter ? pattern_start(filter) : 0;
+
+    workpool_submit(walk.pool, list_dir, root);
+    workpool_wait(walk.pool);
+    workpool_destroy(walk.pool);
+
+    if (ordered) {
+        node_release(root);
+        emit_ordered(root);
+    } else {
+        node_release(root);
+    }
+    pthread_mutex_destroy(&walk.out_lock);
+    return walk.root_failed ? -1 : 0;
+}
@@ -0,0 +1,20 @@
+#ifndef LS_WALK_H
+#define LS_WALK_H
+
+#include "pattern.h"
+
+/**
+ * Lists a directory tree for ls --rec
+ * @param path Directory to start from
+ * @param filter Only names matching filter are printed (NULL for all);
+ *               subdirectories its path components rule out are skipped
+ * @param max_depth Number of levels to list, or -1 for no limit
+ * @param ordered 1 to print in depth-first order, 0 to print each
+ *                directory as soon as it has been read
+ * @return 0 on success, -1 if path could not be opened
+ * Note: Subdirectories are read in parallel on a work-stealing pool.
+ *       Ordered output is held in memory until the walk completes.
+ */
+int ls_walk(const char *path, const Pattern *filter, int max_depth, int ordered);
+
+#endif
@@ -1,11 +1,16 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <pthread.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -16,99 +21,168 @@
 #include "variables.h"
 #include "helper.h"
 #include "commands.h"
-char *token_arr[MAX_STR_LEN] = {NULL};
+#include "arena.h"
+#include "trace.h"
+#include "script.h"
+#include "source_cache.h"
 Server server = {0};
-size_t token_count = 0;
 // Function prototype for execute_single_command
-void execute_single_command(char **tokens, int is_background);
+int execute_single_command(char **tokens, int is_background);
 extern Variable *var_list;  
 
-void free_tokens(char **tokens) {
-    if (tokens == NULL) return;
-    
-    for (int i = 0; tokens[i] != NULL; i++) {
-        free(tokens[i]);
+// Shell variable holding the capacity of pipeline pipes, e.g. 1M
+#define PIPE_SIZE_VAR "PIPE_SIZE"
+// Shell variable: report timing for any command taking at least this many ms
+#define TIME_THRESHOLD_VAR "TIME_THRESHOLD"
+// Shell variable set to the exit status of each stage of the last command
+#define PIPESTATUS_VAR "PIPESTATUS"
+
+// Owns the tokens and pipeline structures of the command being executed
+static Arena cmd_arena = ARENA_INIT;
+
+/**
+ * Records the exit status of each stage in the PIPESTATUS variable
+ * @param stages Stages of the command that just finished
+ * @param n Number of stages
+ * Note: Runs after every command, so the value is formatted on the stack
+ *       and written over the old one when it fits; only a longer value
+ *       (or a pipeline too long for the buffer) allocates.
+ */
+static void set_pipestatus(const StageStats *stages, size_t n) {
+    char buf[256];
+    StrBuf value = STRBUF_INIT;
+    size_t len = 0;
+    for (size_t i = 0; i < n; i++) {
+        char num[16];
+        int num_len = snprintf(num, sizeof(num), i == 0 ? "%d" : " %d", stages[i].status);
+        if (value.data == NULL && len + num_len < sizeof(buf)) {
+            memcpy(buf + len, num, num_len);
+            len += num_len;
+            continue;
+        }
+        if (value.data == NULL) strbuf_append(&value, buf, len);
+        strbuf_append(&value, num, num_len);
+    }
+    buf[len] = '\0';
+    const char *text = value.data != NULL ? value.data : buf;
+    size_t text_len = value.data != NULL ? value.len : len;
+
+    Variable *var = find_var(var_list, PIPESTATUS_VAR, sizeof(PIPESTATUS_VAR) - 1);
+    if (var == NULL || overwrite_var(var, text, text_len) == -1) {
+        set_var_verbatim(&var_list, text, PIPESTATUS_VAR);
     }
+    strbuf_free(&value);
 }
 
-void backproc() {
-    for (size_t i = 0; i < bg_count; i++) {
-        if (bg[i].pid != -1) {
-            int status;
-            pid_t result = waitpid(bg[i].pid, &status, WNOHANG);
-            if (result > 0) {
-                // Process has completed
-                char done_msg[MAX_STR_LEN];
-                snprintf(done_msg, MAX_STR_LEN, "[%zu]+  Done %s", i + 1, bg[i].command);
-                
-                // Use display_message instead of direct write
-                display_message(done_msg);
-                display_message("\n");
-                // Free the command string
-                free(bg[i].command);
-                bg[i].pid = -1; 
-            }
-            else if (result == -1) {
-                // Error case - still use display_message for consistency
-                display_message("ERROR: Failed to check background process status\n");
-                free(bg[i].command);
-                bg[i].pid = -1;
-            }
+/**
+ * Replaces the current process with a program
+ * @param tokens Program name and arguments
+ * Note: Never returns; exits with 127 if the program can't be run
+ */
+static void exec_external(char **tokens) {
+    signal(SIGINT, SIG_DFL);  // Reset SIGINT handling for the child
+    trace_instant("exec", tokens[0]);
+    // Exported variables are already in the environment array
+    execvpe(tokens[0], tokens, var_environ());
+
+    // If execvpe fails, print an error
+    display_error("ERROR: Unknown command: ", tokens[0]);
+    exit(127);
+}
+
+/**
+ * Runs a command line, which may be a pipeline
+ * @param tokens NULL terminated words; | separates pipeline stages
+ * @param is_background Whether the command was followed by &
+ * @return Exit status of the command (of its last stage for a pipeline)
+ */
+int execute_command(char **tokens, int is_background) {
+    // Count pipes
+    int token_total = 0;
+    int pipe_count = 0;
+    for (; tokens[token_total] != NULL; token_total++) {
+        if (strcmp(tokens[token_total], "|") == 0) {
+            pipe_count++;
         }
     }
 
-    // Compact the background process array
-    size_t new_count = 0;
-    for (size_t i = 0; i < bg_count; i++) {
-        if (bg[i].pid != -1) {
-            if (i != new_count) {
-                bg[new_count] = bg[i];
-            }
-            new_count++;
-        }
+    if (pipe_count == 0) {
+        return execute_single_command(tokens, is_background);  // Tokens are owned by cmd_arena
     }
-    bg_count = new_count;
-}
 
-void execute_command(char **tokens, int is_background) {
-    // Count pipes and store their positions
-    int pipe_count = 0;
-    int pipe_positions[MAX_STR_LEN] = {0};
+    uint64_t trace_start_ns = trace_now();
 
-    for (int i = 0; tokens[i] != NULL; i++) {
+    // Store pipe positions and split the token array into commands
+    int *pipe_positions = arena_alloc(&cmd_arena, pipe_count * sizeof(int));
+    for (int i = 0, p = 0; i < token_total; i++) {
         if (strcmp(tokens[i], "|") == 0) {
-            pipe_positions[pipe_count] = i;
-            pipe_count++;
-            free(tokens[i]);
+            pipe_positions[p++] = i;
             tokens[i] = NULL;
         }
     }
 
-    if (pipe_count == 0) {
-        execute_single_command(tokens, is_background);
-        return;  // main() handles token freeing
+    // Builtins that only make sense in the shell itself can't be stages
+    for (int i = 0; i <= pipe_count; i++) {
+        const char *cmd = tokens[i == 0 ? 0 : pipe_positions[i - 1] + 1];
+        const Builtin *builtin = script_has_command(cmd) ? NULL : find_builtin(cmd);
+        if (builtin != NULL && !(builtin->flags & BN_PIPELINE)) {
+            display_error("ERROR: Builtin cannot run in a pipeline: ", cmd);
+            return 1;
+        }
     }
 
-    // Create pipes
-    int pipes[pipe_count][2];
+    // Optional pipe capacity for high-throughput stages
+    size_t pipe_size = 0;
+    char *pipe_size_var = getVar(var_list, PIPE_SIZE_VAR);
+    if (pipe_size_var != NULL &&
+        ((pipe_size = parse_size(pipe_size_var)) == 0 || pipe_size > INT_MAX)) {
+        pipe_size = 0;
+        display_error("ERROR: Invalid " PIPE_SIZE_VAR ": ", pipe_size_var);
+    }
+
+    // Create pipes; close-on-exec keeps them out of exec'd programs, which
+    // only see the ends dup2'd onto their stdin and stdout
+    int (*pipes)[2] = arena_alloc(&cmd_arena, pipe_count * sizeof(*pipes));
     for (int i = 0; i < pipe_count; i++) {
-        if (pipe(pipes[i]) == -1) {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1) {
             display_error("ERROR: Failed to create pipe", "");
-            return;
+            for (int j = 0; j < i; j++) {
+                close(pipes[j][0]);
+                close(pipes[j][1]);
+            }
+            return 1;
+        }
+        if (pipe_size > 0 && fcntl(pipes[i][1], F_SETPIPE_SZ, (int)pipe_size) == -1 && i == 0) {
+            display_error("ERROR: Cannot set pipe size: ", pipe_size_var);
+        }
+    }
+
+    StageStats *stages = begin_stages(pipe_count + 1);
+    if (stages == NULL) {
+        display_error("ERROR: Out of memory", "");
+        for (int i = 0; i < pipe_count; i++) {
+            close(pipes[i][0]);
+            close(pipes[i][1]);
         }
+        return 1;
     }
 
-    // Save original variables
-    Variable *original_vars = var_list;
-    var_list = copy_vars(original_vars);
+    trace_event("pipeline setup", trace_start_ns, tokens[0]);
+
+    // Children must not inherit pending output
+    flush_output();
 
     int cmd_start = 0;
     for (int i = 0; i <= pipe_count; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &stages[i].start);
+        trace_start_ns = trace_now();
         pid_t pid = fork();
+        if (pid > 0) trace_event("fork", trace_start_ns, tokens[cmd_start]);
         if (pid == 0) {  // Child process
             // Set up pipes
             if (i > 0) dup2(pipes[i-1][0], STDIN_FILENO);
             if (i < pipe_count) dup2(pipes[i][1], STDOUT_FILENO);
+            reset_output();
 
             // Close all pipes
             for (int j = 0; j < pipe_count; j++) {
@@ -116,10 +190,23 @@ void execute_command(char **tokens, int is_background) {
                 close(pipes[j][1]);
             }
 
-            execute_single_command(&tokens[cmd_start], 0);
-            exit(0);
+            // Programs replace this child so the stage pid is the program's;
+            // functions and builtins run in it
+            char **stage = &tokens[cmd_start];
+            if (stage[0] != NULL && strchr(stage[0], '=') == NULL && find_builtin(stage[0]) == NULL &&
+                !script_has_command(stage[0])) {
+                exec_external(stage);
+            }
+            int status = execute_single_command(stage, 0);
+            flush_output();
+            exit(status);
+        }
+        stages[i].pid = pid;
+        if (pid == -1) {
+            display_error("ERROR: Failed to fork process", "");
+            stages[i].status = 1;
         }
-        cmd_start = pipe_positions[i] + 1;
+        if (i < pipe_count) cmd_start = pipe_positions[i] + 1;
     }
 
     // Parent cleanup
@@ -128,161 +215,618 @@ void execute_command(char **tokens, int is_background) {
         close(pipes[i][1]);
     }
 
-    // Wait for children
-    for (int i = 0; i <= pipe_count; i++) {
-        wait(NULL);
-    }
-
-    // Restore variables
-    freeVars(var_list);  // Free the temporary copy
-    var_list = original_vars;
+    // Wait for exactly this pipeline's children
+    trace_start_ns = trace_now();
+    wait_stages(stages, pipe_count + 1);
+    trace_event("wait", trace_start_ns, tokens[0]);
+    set_pipestatus(stages, pipe_count + 1);
+    return stages[pipe_count].status;
 }
 
 
 
-void execute_single_command(char **tokens, int is_background) {
+/**
+ * Announces a background job and adds it to the job table
+ * @param tokens Command the job runs
+ * @param pid Process ID, or thread ID for a builtin job
+ * @param job Background builtin, or NULL for a process
+ */
+static void add_background_job(char **tokens, pid_t pid, BuiltinJob *job) {
+    // Display the background job message
+    char bg_msg[MAX_STR_LEN];
+    snprintf(bg_msg, MAX_STR_LEN, "[%zu] %d\n", bg_count + 1, pid);
+    display_message(bg_msg); // Display job number and PID
+
+    // Add the process to the background job list
+    if (bg_count < MAX_STR_LEN) {
+        bg[bg_count].pid = pid;
+        bg[bg_count].job = job;
+
+        // Store the full command (including arguments)
+        char full_command[MAX_STR_LEN] = {0};
+        for (int i = 0; tokens[i] != NULL; i++) {
+            strncat(full_command, tokens[i], MAX_STR_LEN - strlen(full_command) - 1);
+            if (tokens[i + 1] != NULL) {
+                strncat(full_command, " ", MAX_STR_LEN - strlen(full_command) - 1);
+            }
+        }
+        bg[bg_count].command = strdup(full_command); // Store the full command
+        bg_count++;
+    } else {
+        display_error("ERROR: Too many background processes", "");
+    }
+}
+
+/**
+ * Runs one command: an assignment, a builtin or a program
+ * @param tokens NULL terminated command and arguments
+ * @param is_background Whether the command was followed by &
+ * @return Exit status of a foreground command, 0 otherwise
+ */
+int execute_single_command(char **tokens, int is_background) {
     if (tokens == NULL || tokens[0] == NULL) {
-        return;  // Skip empty commands
+        return 0;  // Skip empty commands
     }    
     if (strchr(tokens[0], '=') != NULL) {
     // Process variable assignment
     char *equals_sign = strchr(tokens[0], '=');
-    *equals_sign = '\0';
-    char *var_name = tokens[0];
+    // Copy the name: the token may belong to a parsed script that runs again
+    char *var_name = arena_strndup(&cmd_arena, tokens[0], equals_sign - tokens[0]);
     char *var_value = equals_sign + 1;
-    setVar(&var_list, var_value, var_name);
-    return;  // Skip command execution
+    // The tokenizer already expanded the value; don't expand it twice
+    set_var_verbatim(&var_list, var_value, var_name);
+    return 0;  // Skip command execution
 }
+
+    // Functions and control commands; in the background they run in a
+    // child, so they cannot change the shell's own state
+    int status;
+    if (is_background && script_has_command(tokens[0])) {
+        flush_output();
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (!script_run_command(tokens, &status)) status = 1;
+            flush_output();
+            exit(status);
+        }
+        if (pid == -1) {
+            display_error("ERROR: Failed to fork process", "");
+            return 1;
+        }
+        add_background_job(tokens, pid, NULL);
+        return 0;
+    }
+    if (!is_background && script_run_command(tokens, &status)) {
+        return status;
+    }
     
-    bn_ptr builtin_fn = check_builtin(tokens[0]);
-    if (builtin_fn != NULL && is_background == 0) {
-        ssize_t err = builtin_fn(tokens);
+    const Builtin *builtin = find_builtin(tokens[0]);
+    if (builtin != NULL && is_background == 0) {
+        uint64_t trace_start_ns = trace_now();
+        ssize_t err = builtin->fn(tokens);
+        trace_event("builtin", trace_start_ns, tokens[0]);
         if (err == -1) {
             display_error("ERROR: Builtin failed: ", tokens[0]);
 
         }
-    } else {
-        // Not a builtin, try to execute from /bin or /usr/bin
-        pid_t pid = fork();
+        // Builtins run in the shell: there is no child to report on
+        StageStats result = {0};
+        result.status = err == -1 ? 1 : (int)err;
+        last_stage_count = 0;
+        set_pipestatus(&result, 1);
+        return result.status;
+    } else if (builtin != NULL) {
+        // Background builtin: run it on a thread instead of exec'ing a
+        // program of the same name
+        if (!(builtin->flags & BN_BACKGROUND)) {
+            display_error("ERROR: Builtin cannot run in the background: ", tokens[0]);
+            return 1;
+        }
+        if (bg_count >= MAX_STR_LEN) {
+            display_error("ERROR: Too many background processes", "");
+            return 1;
+        }
+        pid_t tid;
+        BuiltinJob *job = builtin_job_start(builtin->fn, tokens, &tid);
+        if (job == NULL) {
+            display_error("ERROR: Failed to start background builtin: ", tokens[0]);
+            return 1;
+        }
+        add_background_job(tokens, tid, job);
+        return 0;
+    }
 
-        if (pid == 0) { // Child process
-            signal(SIGINT, SIG_DFL);  // Reset SIGINT handling for the child
-            execvp(tokens[0], tokens);  // Run the command
-
-            // If execvp fails, print an error
-            display_error("ERROR: Unknown command: ", tokens[0]);
-            exit(1);
-
-        } else if (pid > 0) { // Parent process
-            if (is_background) {
-		usleep(10000);
-                // If it's a background process, display the background job message
-                char bg_msg[MAX_STR_LEN];
-                snprintf(bg_msg, MAX_STR_LEN, "[%zu] %d\n", bg_count + 1, pid);
-                display_message(bg_msg); // Display job number and PID
-
-                // Add the process to the background job list
-                if (bg_count < MAX_STR_LEN) {
-                    bg[bg_count].pid = pid;
-
-                    // Store the full command (including arguments)
-                    char full_command[MAX_STR_LEN] = {0};
-                    for (int i = 0; tokens[i] != NULL; i++) {
-                        strncat(full_command, tokens[i], MAX_STR_LEN - strlen(full_command) - 1);
-                        if (tokens[i + 1] != NULL) {
-                            strncat(full_command, " ", MAX_STR_LEN - strlen(full_command) - 1);
-                        }
-                    }
-                    bg[bg_count].command = strdup(full_command); // Store the full command
-                    bg_count++;
-                } else {
-                    display_error("ERROR: Too many background processes", "");
-                }
-            } else {
-                // Foreground process: wait for the process to finish
-                waitpid(pid, NULL, 0);
-            }
-        } else {
-            // Error in forking
-            display_error("ERROR: Failed to fork process", "");
+    // Not a builtin, try to execute from /bin or /usr/bin
+    flush_output();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t trace_start_ns = trace_now();
+    pid_t pid = fork();
+    if (pid > 0) trace_event("fork", trace_start_ns, tokens[0]);
+
+    if (pid == 0) { // Child process
+        exec_external(tokens);
+    } else if (pid > 0) { // Parent process
+        if (is_background) {
+	    usleep(10000);
+            add_background_job(tokens, pid, NULL);
+            return 0;
         }
+        // Foreground process: wait for exactly this child
+        StageStats *stage = begin_stages(1);
+        if (stage == NULL) {
+            waitpid(pid, NULL, 0);
+            return 1;
+        }
+        stage->pid = pid;
+        stage->start = start;
+        trace_start_ns = trace_now();
+        wait_stages(stage, 1);
+        trace_event("wait", trace_start_ns, tokens[0]);
+        set_pipestatus(stage, 1);
+        return stage->status;
     }
+    // Error in forking
+    display_error("ERROR: Failed to fork process", "");
+    return 1;
 }
-void handle_sigint(int sig) {
-    (void)sig;  // Unused parameter
-    display_message("\nmysh$ ");
-}
-
-int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[]) {
-    // Handle SIGINT (Ctrl+C) to print a newline
-    signal(SIGINT, handle_sigint);
-
-    char *prompt = "mysh$ ";
-    char input_buf[MAX_STR_LEN + 1];
-    input_buf[MAX_STR_LEN] = '\0';
-    char *token_arr[MAX_STR_LEN] = {NULL};
+/**
+ * Runs a pipeline of builtins in the shell, capturing its output
+ * @param tokens Stages separated by NULL entries at pipe_positions
+ * @param stage_count Number of stages
+ * @param starts Index of the first token of each stage
+ * @param out Buffer the output is appended to
+ * @return 0 on success, -1 on error
+ * Note: Each stage writes to a memfd through its thread output buffer;
+ *       the next stage reads it back as stdin, so no process is created.
+ */
+static int capture_builtins(char **tokens, size_t stage_count, const size_t *starts, StrBuf *out) {
+    OutBuf *prev_out = get_thread_output();
+    int saved_stdin = -1;
+    int prev_fd = -1;
+    int ret = 0;
+
+    StageStats *stages = arena_alloc(&cmd_arena, stage_count * sizeof(StageStats));
+    for (size_t i = 0; i < stage_count && ret == 0; i++) {
+        int fd = memfd_create("mysh-subst", MFD_CLOEXEC);
+        if (fd == -1) {
+            ret = -1;
+            break;
+        }
+        if (prev_fd != -1) {
+            if (saved_stdin == -1) saved_stdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+            lseek(prev_fd, 0, SEEK_SET);
+            dup2(prev_fd, STDIN_FILENO);
+            close(prev_fd);
+        }
 
-    while (1) {
-        // Check for completed background processes
-        backproc();
+        OutBuf capture = OUTBUF_INIT(fd);
+        set_thread_output(&capture);
+        stages[i] = (StageStats){0};
+        stages[i].status = execute_single_command(&tokens[starts[i]], 0);
+        outbuf_release(&capture);
+        set_thread_output(prev_out);
+        prev_fd = fd;
+    }
 
-        // Display prompt and get input
-        display_message(prompt);
-        int ret = get_input(input_buf);
+    if (saved_stdin != -1) {
+        dup2(saved_stdin, STDIN_FILENO);
+        close(saved_stdin);
+    }
+    if (ret == -1) {
+        display_error("ERROR: Cannot capture command output", "");
+        if (prev_fd != -1) close(prev_fd);
+        return -1;
+    }
 
-        // Handle EOF (Ctrl+D)
-        if (ret == -1) {
-            break; // Exit the shell
+    // Append the last stage's output
+    off_t size = lseek(prev_fd, 0, SEEK_END);
+    if (size > 0 && strbuf_reserve(out, size) == 0) {
+        for (off_t off = 0; off < size; ) {
+            ssize_t n = pread(prev_fd, out->data + out->len, size - off, off);
+            if (n <= 0) break;
+            out->len += n;
+            off += n;
         }
+        out->data[out->len] = '\0';
+    }
+    close(prev_fd);
+    set_pipestatus(stages, stage_count);
+    return 0;
+}
 
-        // Tokenize the input
-        size_t token_count = tokenize_input(input_buf, token_arr, &var_list);
+// How a $(cmd) substitution has to run
+typedef enum {
+    SUBST_BUILTINS,   // Builtins only: in the shell, no process
+    SUBST_PROGRAM,    // One program: exec'd in the child
+    SUBST_SCRIPT      // Anything else: parsed and run in the child
+} SubstKind;
+
+/**
+ * Decides how a substitution runs from its raw text
+ * @param cmd Command text (not NULL terminated)
+ * @param len Number of bytes of cmd
+ * @return How the command must be run
+ * Note: Only the unexpanded words are looked at, so no expansion (and
+ *       none of its side effects) happens before the decision.
+ */
+static SubstKind classify_substitution(const char *cmd, size_t len) {
+    static const char *const KEYWORDS[] = {
+        "if", "while", "until", "for", "function", "{", "break", "continue",
+        "return", "exit", "time", "&", NULL
+    };
+    int builtins = 1;     // Every stage so far is a pipeline builtin
+    size_t stages = 0;
+    int at_command = 1;   // The next word names a command
+    const char *p = cmd, *end = cmd + len;
+    while (p < end) {
+        if (*p == ' ' || *p == '\t') {
+            p++;
+            continue;
+        }
+        if (*p == ';' || *p == '\n' || *p == '#') return SUBST_SCRIPT;
+
+        // Find the end of the word, keeping $( ) groups whole
+        const char *word = p;
+        int depth = 0;
+        for (; p < end && (depth > 0 || (*p != ' ' && *p != '\t' && *p != ';' && *p != '\n')); p++) {
+            if (*p == '$' && p + 1 < end && p[1] == '(') {
+                depth++;
+                p++;
+            } else if (depth > 0 && *p == '(') {
+                depth++;
+            } else if (depth > 0 && *p == ')') {
+                depth--;
+            }
+        }
+        size_t word_len = p - word;
 
-        // Skip empty input (user pressed Enter without typing anything)
-        if (token_count == 0 || ret == -2) {
+        if (word_len == 1 && *word == '|') {
+            at_command = 1;
             continue;
         }
+        if (!at_command) continue;
+        at_command = 0;
+        stages++;
+
+        char name[64];
+        if (word_len >= sizeof(name) || memchr(word, '$', word_len) || memchr(word, '=', word_len) ||
+            memchr(word, '(', word_len)) {
+            return SUBST_SCRIPT;
+        }
+        memcpy(name, word, word_len);
+        name[word_len] = '\0';
+        for (size_t i = 0; KEYWORDS[i] != NULL; i++) {
+            if (strcmp(name, KEYWORDS[i]) == 0) return SUBST_SCRIPT;
+        }
+        if (script_has_command(name)) return SUBST_SCRIPT;
+        const Builtin *builtin = find_builtin(name);
+        if (builtin != NULL && !(builtin->flags & BN_PIPELINE)) return SUBST_SCRIPT;
+        if (builtin == NULL) builtins = 0;
+    }
+    if (stages == 0 || builtins) return stages == 0 ? SUBST_SCRIPT : SUBST_BUILTINS;
+    return stages == 1 ? SUBST_PROGRAM : SUBST_SCRIPT;
+}
 
-        // Check for the "exit" command
-        if (strcmp(token_arr[0], "exit") == 0) {
-	    free(token_arr[0]);
-            break; // Exit the shell
+/**
+ * Runs a command in a child process, capturing its output through a pipe
+ * @param cmd Command text (not NULL terminated)
+ * @param len Number of bytes of cmd
+ * @param kind SUBST_PROGRAM or SUBST_SCRIPT
+ * @param out Buffer the output is appended to
+ * @return 0 on success, -1 on error
+ * Note: Expansion happens in the child, as it would in a subshell
+ */
+static int capture_process(const char *cmd, size_t len, SubstKind kind, StrBuf *out) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        display_error("ERROR: Failed to create pipe", "");
+        return -1;
+    }
+    flush_output();
+    pid_t pid = fork();
+    if (pid == -1) {
+        display_error("ERROR: Failed to fork process", "");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        reset_output();
+        if (kind == SUBST_PROGRAM) {
+            // A lone program replaces the child directly
+            size_t token_count = 0;
+            char *line = arena_strndup(&cmd_arena, cmd, len);
+            char **tokens = tokenize_input(line, &token_count, &var_list, &cmd_arena);
+            if (token_count == 0) exit(0);
+            exec_external(tokens);
+        }
+        int incomplete;
+        int status = 2;
+        Script *script = script_parse(cmd, len, &incomplete);
+        if (script != NULL) {
+            status = script_run(script);
+            script_release(script);
+        } else if (incomplete) {
+            display_error("ERROR: Unexpected end of input", "");
         }
+        flush_output();
+        exit(status);
+    }
 
-        // Check for background process
-        int is_background = 0;
-        if (token_count > 0 && strcmp(token_arr[token_count - 1], "&") == 0) {
-            is_background = 1;
-            token_arr[token_count - 1] = NULL; // Remove '&' from tokens
+    close(fds[1]);
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            break;
         }
+        strbuf_append(out, buf, n);
+    }
+    close(fds[0]);
 
-        // Execute the command with the background flag
-        execute_command(token_arr, is_background);
+    StageStats stage = {0};
+    stage.pid = pid;
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+        // Retry if interrupted by SIGINT
+    }
+    stage.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    set_pipestatus(&stage, 1);
+    return 0;
+}
 
-        // Free tokens after executing the command (only in main)
+/**
+ * Runs the command of a $(cmd) substitution and appends its output
+ * @param cmd Command text (not NULL terminated)
+ * @param len Number of bytes of cmd
+ * @param out Buffer the output is appended to, minus trailing newlines
+ * @return 0; failures are reported and substitute nothing
+ * Note: A builtin or a pipeline of builtins runs in the shell and writes
+ *       to memory; anything else runs in a child behind a pipe.
+ */
+static int substitute_command(const char *cmd, size_t len, StrBuf *out) {
+    uint64_t trace_start_ns = trace_now();
+    size_t start_len = out->len;
+    SubstKind kind = classify_substitution(cmd, len);
+    if (kind != SUBST_BUILTINS) {
+        capture_process(cmd, len, kind, out);
+    } else {
+        char *line = arena_strndup(&cmd_arena, cmd, len);
+        size_t token_count = 0;
+        char **tokens = tokenize_input(line, &token_count, &var_list, &cmd_arena);
+
+        // Split into stages at each |
+        size_t *starts = arena_alloc(&cmd_arena, (token_count + 1) * sizeof(size_t));
+        size_t stage_count = 1;
+        starts[0] = 0;
         for (size_t i = 0; i < token_count; i++) {
-            free(token_arr[i]);
-            token_arr[i] = NULL;
+            if (strcmp(tokens[i], "|") == 0) {
+                tokens[i] = NULL;
+                starts[stage_count++] = i + 1;
+            }
         }
+        if (token_count > 0) capture_builtins(tokens, stage_count, starts, out);
+    }
+
+    // Trailing newlines are dropped, as in other shells
+    while (out->len > start_len && out->data[out->len - 1] == '\n') {
+        out->data[--out->len] = '\0';
+    }
+    trace_event("substitute", trace_start_ns, NULL);
+    return 0;
+}
+
+void handle_sigint(int sig) {
+    (void)sig;  // Unused parameter
+    // Async-signal-safe: bypass the output buffer
+    write(STDOUT_FILENO, "\nmysh$ ", 7);
+}
+
+/**
+ * Runs one expanded simple command for the script executor
+ * @param token_arr NULL terminated words (the array is modified)
+ * @param token_count Number of words
+ * @return Exit status of the command
+ * Note: Handles a trailing &, the time prefix and TIME_THRESHOLD reports
+ */
+static int run_tokens(char **token_arr, size_t token_count) {
+    // Reap finished background jobs without polling when there are none
+    if (bg_count > 0) backproc();
+
+    // Check for background process
+    int is_background = 0;
+    if (strcmp(token_arr[token_count - 1], "&") == 0) {
+        is_background = 1;
+        token_arr[token_count - 1] = NULL; // Remove '&' from tokens
     }
 
+    // "time cmd" reports on cmd; TIME_THRESHOLD reports on slow commands
+    int timed = strcmp(token_arr[0], "time") == 0;
+    if (timed) {
+        token_arr++;
+        if (token_arr[0] == NULL) return 0;
+    }
+    long threshold_ms = -1;
+    char *threshold_var = getVar(var_list, TIME_THRESHOLD_VAR);
+    if (threshold_var != NULL) {
+        char *end;
+        threshold_ms = strtol(threshold_var, &end, 10);
+        if (end == threshold_var || *end != '\0' || threshold_ms < 0) threshold_ms = -1;
+    }
+
+    CommandTimer timer;
+    if (timed || threshold_ms >= 0) {
+        command_timer_start(&timer);
+    }
+    last_stage_count = 0;
+
+    // Execute the command with the background flag
+    int status = execute_command(token_arr, is_background);
+
+    if (timed || (threshold_ms >= 0 && command_timer_elapsed(&timer) >= threshold_ms)) {
+        command_timer_report(&timer);
+    }
+    return status;
+}
+
+// Status of the last command line run (or 2 after a syntax error); the
+// shell exits with it
+static int shell_status = 0;
+
+/**
+ * Parses and runs a piece of shell text
+ * @param text Commands, possibly spanning several lines
+ * @param len Length of text
+ * @return 1 if the shell should exit, -1 if text ends inside an
+ *         if/while/for/function (nothing was run), 0 otherwise
+ * Note: Sets shell_status
+ */
+static int run_text(const char *text, size_t len) {
+    // Release everything the previous command allocated
+    arena_reset(&cmd_arena);
+
+    int incomplete;
+    Script *script = script_parse(text, len, &incomplete);
+    if (script == NULL) {
+        if (incomplete) return -1;
+        shell_status = 2;
+        return 0;
+    }
+    shell_status = script_run(script);
+    script_release(script);
+    return script_exiting();
+}
+
+/**
+ * Reads a whole script file into memory
+ * @param path Script to read
+ * @param len Set to the number of bytes read
+ * @return Newly allocated NULL terminated contents, or NULL on error
+ */
+static char *read_script(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        display_error("ERROR: Cannot open file: ", path);
+        return NULL;
+    }
+
+    char *text = read_fd(fd, len);
+    if (text == NULL) display_error("ERROR: Cannot read file: ", path);
+    close(fd);
+    return text;
+}
+
+/**
+ * Parses a whole script up front and runs it
+ * @param text Script contents
+ * @param len Length of text
+ * Note: No prompt is written and no terminal input is read while the
+ *       script runs. A syntax error anywhere stops the script from running.
+ */
+static void run_script(const char *text, size_t len) {
+    if (run_text(text, len) == -1) {
+        display_error("ERROR: Unexpected end of input", "");
+        shell_status = 2;
+    }
+}
 
+int main(int argc, char* argv[]) {
+    set_command_substitution(substitute_command);
+    script_init(&cmd_arena, run_tokens);
 
+    if (argc > 1) {
+        // Non-interactive mode: mysh -c 'cmds' or mysh script.sh
+        if (strcmp(argv[1], "-c") == 0) {
+            if (argc < 3) {
+                display_error("ERROR: -c requires an argument", "");
+                return 2;
+            }
+            run_script(argv[2], strlen(argv[2]));
+        } else {
+            size_t len = 0;
+            char *text = read_script(argv[1], &len);
+            if (text == NULL) {
+                return 127;
+            }
+            run_script(text, len);
+            free(text);
+        }
+    } else {
+        // Handle SIGINT (Ctrl+C) to print a newline
+        signal(SIGINT, handle_sigint);
+
+        char *prompt = "mysh$ ";
+        char *input_buf = NULL;
+        // Lines of an if/while/for/function still waiting for its end
+        StrBuf pending = STRBUF_INIT;
+
+        while (1) {
+            // Check for completed background processes
+            backproc();
+
+            // Display prompt and get input
+            display_message(pending.len > 0 ? "> " : prompt);
+
+            // Handle EOF (Ctrl+D)
+            ssize_t len = get_input(&input_buf);
+            if (len == -1) {
+                if (pending.len > 0) display_error("ERROR: Unexpected end of input", "");
+                break; // Exit the shell
+            }
+
+            const char *text = input_buf;
+            if (pending.len > 0) {
+                strbuf_append(&pending, "\n", 1);
+                strbuf_append(&pending, input_buf, len);
+                text = pending.data;
+                len = pending.len;
+            }
+
+            int result = run_text(text, len);
+            if (result == -1) {
+                // Keep reading lines until the construct is closed
+                if (pending.len == 0) strbuf_append(&pending, input_buf, len);
+                continue;
+            }
+            strbuf_reset(&pending);
+            if (result == 1) {
+                break; // Exit the shell
+            }
+        }
+        strbuf_free(&pending);
+    }
+
+    source_cache_clear();
+    script_clear_functions();
     freeVars(var_list);
+    free_environ();
+    arena_free(&cmd_arena);
+    free(last_stages);
+    trace_stop();
 
     // Free background process commands
     for (size_t i = 0; i < bg_count; i++) {
+        // Builtin jobs are threads of this process and would die with it
+        if (bg[i].job != NULL) {
+            builtin_job_join(bg[i].job);
+        }
         if (bg[i].command != NULL) {
             free(bg[i].command);
         }
     }
 
 
-// Right before the final return 0
+// Right before the final return
 if (server.running) {
     char *close_cmd[] = {"close-server", NULL};
     bn_close_server(close_cmd);
 }
 pthread_mutex_destroy(&server.lock);
-    return 0;
+    flush_output();
+    return shell_status;
 }
@@ -0,0 +1,567 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include "pattern.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Upper bound on alternatives produced by {a,b} expansion
+#define MAX_ALTS 1024
+// Path components are tracked in a 64-bit state
+#define MAX_COMPONENTS 64
+// Globs with more non-star atoms than this use the backtracking matcher
+#define NFA_MAX_ATOMS 63
+
+// Pieces a glob is parsed into
+typedef enum { ATOM_LIT, ATOM_ANY, ATOM_CLASS, ATOM_STAR } AtomKind;
+
+typedef struct Atom {
+    AtomKind kind;
+    unsigned char c;          // ATOM_LIT: the byte
+    unsigned char cls[32];    // ATOM_CLASS: bitset of accepted bytes
+} Atom;
+
+// Matcher chosen for one alternative
+typedef enum {
+    MATCH_ANY,         // *
+    MATCH_EXACT,       // lit
+    MATCH_PREFIX,      // lit*
+    MATCH_SUFFIX,      // *lit
+    MATCH_AFFIX,       // lit*lit
+    MATCH_SUBSTR,      // *lit* (and plain text)
+    MATCH_NFA,         // general glob, bit-parallel
+    MATCH_BACKTRACK    // general glob too long for the NFA
+} MatchKind;
+
+typedef struct GlobAlt {
+    MatchKind kind;
+    char *lit;          // Literal, or the prefix for MATCH_AFFIX
+    size_t lit_len;
+    char *suf;          // Suffix for MATCH_AFFIX
+    size_t suf_len;
+    uint64_t *masks;    // MATCH_NFA: per byte, states entered by it
+    uint64_t loops;     // MATCH_NFA: states with a * self-loop
+    uint64_t accept;    // MATCH_NFA: final state
+    Atom *atoms;        // MATCH_BACKTRACK: parsed glob
+    size_t natoms;
+} GlobAlt;
+
+typedef struct Component {
+    int globstar;       // Component is ** (any number of directories)
+    GlobAlt *alts;      // Alternatives; a name matches if any does
+    size_t nalts;
+} Component;
+
+struct Pattern {
+    Component *comps;
+    size_t ncomp;
+};
+
+// ===== Literal search =====
+
+/**
+ * Finds the first occurrence of needle in haystack
+ * Note: The SSE2 path compares the needle's first and last bytes against
+ *       16 positions at once and only verifies the candidates
+ */
+const char *simd_memmem(const char *haystack, size_t hlen, const char *needle, size_t nlen) {
+    if (nlen == 0) return haystack;
+    if (nlen > hlen) return NULL;
+    if (nlen == 1) return memchr(haystack, needle[0], hlen);
+
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+    for (; i + nlen - 1 + 16 <= hlen; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(haystack + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(haystack + i + nlen - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(haystack + i + bit + 1, needle + 1, nlen - 2) == 0) {
+                return haystack + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    return memmem(haystack + i, hlen - i, needle, nlen);
+}
+
+// ===== Parsing =====
+
+static void class_set(unsigned char *cls, unsigned char c) {
+    cls[c >> 3] |= 1u << (c & 7);
+}
+
+static int class_has(const unsigned char *cls, unsigned char c) {
+    return (cls[c >> 3] >> (c & 7)) & 1;
+}
+
+/* Parse a bracket expression starting after '['
+ * Return: bytes consumed including the closing ']', or 0 if unterminated
+ */
+static size_t parse_class(const char *s, size_t len, unsigned char *cls) {
+    size_t i = 0;
+    int negate = 0;
+    memset(cls, 0, 32);
+    if (i < len && (s[i] == '!' || s[i] == '^')) {
+        negate = 1;
+        i++;
+    }
+
+    int first = 1;
+    while (i < len && (s[i] != ']' || first)) {
+        first = 0;
+        unsigned char lo = s[i++];
+        if (lo == '\\' && i < len) lo = s[i++];
+        unsigned char hi = lo;
+        if (i + 1 < len && s[i] == '-' && s[i + 1] != ']') {
+            hi = s[i + 1];
+            i += 2;
+            if (hi == '\\' && i < len) hi = s[i++];
+        }
+        for (unsigned c = lo; c <= hi; c++) {
+            class_set(cls, c);
+        }
+    }
+    if (i >= len) return 0;
+
+    if (negate) {
+        for (int b = 0; b < 32; b++) cls[b] = ~cls[b];
+    }
+    return i + 1;
+}
+
+/* Split a glob into atoms; runs of * collapse to one
+ * Return: number of atoms (atoms must hold len entries)
+ */
+static size_t parse_atoms(const char *s, size_t len, Atom *atoms) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; ) {
+        Atom *a = &atoms[n];
+        char c = s[i];
+        if (c == '*') {
+            i++;
+            if (n > 0 && atoms[n - 1].kind == ATOM_STAR) continue;
+            a->kind = ATOM_STAR;
+        } else if (c == '?') {
+            i++;
+            a->kind = ATOM_ANY;
+        } else if (c == '[') {
+            size_t used = parse_class(s + i + 1, len - i - 1, a->cls);
+            if (used > 0) {
+                a->kind = ATOM_CLASS;
+                i += used + 1;
+            } else {
+                // Unterminated bracket is a literal '['
+                a->kind = ATOM_LIT;
+                a->c = '[';
+                i++;
+            }
+        } else {
+            if (c == '\\' && i + 1 < len) i++;
+            a->kind = ATOM_LIT;
+            a->c = s[i++];
+        }
+        n++;
+    }
+    return n;
+}
+
+// Does atom a accept byte c (stars excluded)
+static int atom_accepts(const Atom *a, unsigned char c) {
+    switch (a->kind) {
+    case ATOM_LIT: return a->c == c;
+    case ATOM_ANY: return 1;
+    case ATOM_CLASS: return class_has(a->cls, c);
+    default: return 0;
+    }
+}
+
+// Copy the bytes of a run of literal atoms
+static char *atoms_literal(const Atom *atoms, size_t n) {
+    char *lit = malloc(n + 1);
+    if (lit == NULL) return NULL;
+    for (size_t i = 0; i < n; i++) lit[i] = atoms[i].c;
+    lit[n] = '\0';
+    return lit;
+}
+
+/* Pick a matcher for one brace-free glob
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int compile_alt(GlobAlt *alt, const char *s, size_t len) {
+    memset(alt, 0, sizeof(GlobAlt));
+    Atom *atoms = malloc((len + 1) * sizeof(Atom));
+    if (atoms == NULL) return -1;
+    size_t n = parse_atoms(s, len, atoms);
+
+    // Shape: leading star, literal run, optional star, literal run, trailing star
+    size_t lead = (n > 0 && atoms[0].kind == ATOM_STAR);
+    size_t trail = (n > lead && atoms[n - 1].kind == ATOM_STAR);
+    size_t stars = 0, others = 0, mid_star = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (atoms[i].kind == ATOM_STAR) {
+            stars++;
+            if (i >= lead && i < n - trail) mid_star = i;
+        } else if (atoms[i].kind != ATOM_LIT) {
+            others++;
+        }
+    }
+
+    if (others == 0 && stars == n) {
+        alt->kind = MATCH_ANY;
+    } else if (others == 0 && stars == lead + trail) {
+        alt->lit_len = n - lead - trail;
+        alt->lit = atoms_literal(atoms + lead, alt->lit_len);
+        alt->kind = lead ? (trail ? MATCH_SUBSTR : MATCH_SUFFIX)
+                         : (trail ? MATCH_PREFIX : MATCH_EXACT);
+    } else if (others == 0 && stars == 1 && !lead && !trail) {
+        alt->kind = MATCH_AFFIX;
+        alt->lit_len = mid_star;
+        alt->lit = atoms_literal(atoms, mid_star);
+        alt->suf_len = n - mid_star - 1;
+        alt->suf = atoms_literal(atoms + mid_star + 1, alt->suf_len);
+    } else if (n - stars <= NFA_MAX_ATOMS) {
+        // State i means i non-star atoms have matched
+        alt->kind = MATCH_NFA;
+        alt->masks = calloc(256, sizeof(uint64_t));
+        if (alt->masks == NULL) {
+            free(atoms);
+            return -1;
+        }
+        size_t state = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (atoms[i].kind == ATOM_STAR) {
+                alt->loops |= 1ull << state;
+                continue;
+            }
+            for (unsigned c = 0; c < 256; c++) {
+                if (atom_accepts(&atoms[i], c)) alt->masks[c] |= 1ull << (state + 1);
+            }
+            state++;
+        }
+        alt->accept = 1ull << state;
+    } else {
+        alt->kind = MATCH_BACKTRACK;
+        alt->atoms = atoms;
+        alt->natoms = n;
+        return 0;
+    }
+
+    free(atoms);
+    if ((alt->lit_len && alt->lit == NULL) || (alt->suf_len && alt->suf == NULL)) return -1;
+    return 0;
+}
+
+// Glob matching for patterns too long for the NFA; backtracks to the last star
+static int match_backtrack(const Atom *atoms, size_t n, const char *name, size_t len) {
+    size_t a = 0, c = 0;
+    size_t star_a = (size_t)-1, star_c = 0;
+    while (c < len) {
+        if (a < n && atoms[a].kind == ATOM_STAR) {
+            star_a = a++;
+            star_c = c;
+        } else if (a < n && atom_accepts(&atoms[a], (unsigned char)name[c])) {
+            a++;
+            c++;
+        } else if (star_a != (size_t)-1) {
+            a = star_a + 1;
+            c = ++star_c;
+        } else {
+            return 0;
+        }
+    }
+    while (a < n && atoms[a].kind == ATOM_STAR) a++;
+    return a == n;
+}
+
+static int match_alt(const GlobAlt *alt, const char *name, size_t len) {
+    switch (alt->kind) {
+    case MATCH_ANY:
+        return 1;
+    case MATCH_EXACT:
+        return len == alt->lit_len && memcmp(name, alt->lit, len) == 0;
+    case MATCH_PREFIX:
+        return len >= alt->lit_len && memcmp(name, alt->lit, alt->lit_len) == 0;
+    case MATCH_SUFFIX:
+        return len >= alt->lit_len &&
+               memcmp(name + len - alt->lit_len, alt->lit, alt->lit_len) == 0;
+    case MATCH_AFFIX:
+        return len >= alt->lit_len + alt->suf_len &&
+               memcmp(name, alt->lit, alt->lit_len) == 0 &&
+               memcmp(name + len - alt->suf_len, alt->suf, alt->suf_len) == 0;
+    case MATCH_SUBSTR:
+        return simd_memmem(name, len, alt->lit, alt->lit_len) != NULL;
+    case MATCH_NFA: {
+        uint64_t states = 1;
+        for (size_t i = 0; i < len && states != 0; i++) {
+            states = ((states << 1) & alt->masks[(unsigned char)name[i]]) | (states & alt->loops);
+        }
+        return (states & alt->accept) != 0;
+    }
+    case MATCH_BACKTRACK:
+        return match_backtrack(alt->atoms, alt->natoms, name, len);
+    }
+    return 0;
+}
+
+// ===== Brace expansion =====
+
+typedef struct AltList {
+    char **items;
+    size_t count;
+} AltList;
+
+// Find the brace group to expand first: returns 1 and its bounds if found
+static int find_brace(const char *s, size_t len, size_t *open, size_t *close) {
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\\') {
+            i++;
+            continue;
+        }
+        if (s[i] != '{') continue;
+
+        int depth = 0, comma = 0;
+        for (size_t j = i; j < len; j++) {
+            if (s[j] == '\\') {
+                j++;
+            } else if (s[j] == '{') {
+                depth++;
+            } else if (s[j] == '}') {
+                if (--depth == 0) {
+                    if (!comma) break;  // {x} is literal
+                    *open = i;
+                    *close = j;
+                    return 1;
+                }
+            } else if (s[j] == ',' && depth == 1) {
+                comma = 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Append every expansion of s to list; returns -1 on failure or overflow
+static int expand_braces(const char *s, size_t len, AltList *list) {
+    size_t open, close;
+    if (!find_brace(s, len, &open, &close)) {
+        if (list->count >= MAX_ALTS) return -1;
+        char *copy = malloc(len + 1);
+        if (copy == NULL) return -1;
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+        list->items[list->count++] = copy;
+        return 0;
+    }
+
+    // Expand prefix + part + suffix for each top-level part of the group
+    size_t part_start = open + 1;
+    int depth = 0;
+    for (size_t j = open + 1; j <= close; j++) {
+        if (s[j] == '\\') {
+            j++;
+            continue;
+        }
+        if (s[j] == '{') depth++;
+        if (s[j] == '}' && depth > 0) {
+            depth--;
+            continue;
+        }
+        if ((s[j] == ',' && depth == 0) || j == close) {
+            size_t part_len = j - part_start;
+            size_t total = open + part_len + (len - close - 1);
+            char *joined = malloc(total + 1);
+            if (joined == NULL) return -1;
+            memcpy(joined, s, open);
+            memcpy(joined + open, s + part_start, part_len);
+            memcpy(joined + open + part_len, s + close + 1, len - close - 1);
+            int err = expand_braces(joined, total, list);
+            free(joined);
+            if (err == -1) return -1;
+            part_start = j + 1;
+        }
+    }
+    return 0;
+}
+
+// ===== Compilation =====
+
+static void free_component(Component *comp) {
+    for (size_t i = 0; i < comp->nalts; i++) {
+        GlobAlt *alt = &comp->alts[i];
+        free(alt->lit);
+        free(alt->suf);
+        free(alt->masks);
+        free(alt->atoms);
+    }
+    free(comp->alts);
+}
+
+// Compile one '/'-separated component (or the legacy substring form)
+static int compile_component(Component *comp, const char *s, size_t len, int substring) {
+    memset(comp, 0, sizeof(Component));
+    if (len == 2 && s[0] == '*' && s[1] == '*') {
+        comp->globstar = 1;
+        return 0;
+    }
+
+    if (substring) {
+        // Plain text keeps the old ls --f meaning: name contains text
+        comp->alts = calloc(1, sizeof(GlobAlt));
+        if (comp->alts == NULL) return -1;
+        comp->nalts = 1;
+        comp->alts[0].kind = MATCH_SUBSTR;
+        comp->alts[0].lit = malloc(len + 1);
+        if (comp->alts[0].lit == NULL) return -1;
+        memcpy(comp->alts[0].lit, s, len);
+        comp->alts[0].lit[len] = '\0';
+        comp->alts[0].lit_len = len;
+        return 0;
+    }
+
+    AltList list = {malloc(MAX_ALTS * sizeof(char *)), 0};
+    if (list.items == NULL) return -1;
+    int err = expand_braces(s, len, &list);
+    if (err == 0) {
+        comp->alts = calloc(list.count, sizeof(GlobAlt));
+        if (comp->alts == NULL) err = -1;
+    }
+    for (size_t i = 0; i < list.count; i++) {
+        if (err == 0) {
+            comp->nalts++;
+            err = compile_alt(&comp->alts[i], list.items[i], strlen(list.items[i]));
+        }
+        free(list.items[i]);
+    }
+    free(list.items);
+    return err;
+}
+
+/**
+ * Compiles a pattern
+ * Note: Patterns without '/' are stored as "**" followed by the pattern,
+ *       so they apply at every depth of a walk
+ */
+Pattern *pattern_compile(const char *pat) {
+    size_t len = strlen(pat);
+    int has_meta = strpbrk(pat, "*?[{\\") != NULL;
+    int has_path = strchr(pat, '/') != NULL;
+
+    Pattern *pattern = calloc(1, sizeof(Pattern));
+    if (pattern == NULL) return NULL;
+    pattern->comps = calloc(MAX_COMPONENTS, sizeof(Component));
+    if (pattern->comps == NULL) {
+        free(pattern);
+        return NULL;
+    }
+
+    if (!has_path) {
+        pattern->comps[0].globstar = 1;
+        pattern->ncomp = 2;
+        if (compile_component(&pattern->comps[1], pat, len, !has_meta) == -1) {
+            pattern_free(pattern);
+            return NULL;
+        }
+        return pattern;
+    }
+
+    // Split on '/', skipping empty components from leading or doubled slashes
+    const char *start = pat;
+    for (const char *p = pat; ; p++) {
+        if (*p != '/' && *p != '\0') continue;
+        if (p > start) {
+            if (pattern->ncomp == MAX_COMPONENTS) {
+                pattern_free(pattern);
+                return NULL;
+            }
+            Component *comp = &pattern->comps[pattern->ncomp++];
+            if (compile_component(comp, start, p - start, 0) == -1) {
+                pattern_free(pattern);
+                return NULL;
+            }
+        }
+        if (*p == '\0') break;
+        start = p + 1;
+    }
+    if (pattern->ncomp == 0) {
+        pattern_free(pattern);
+        return NULL;
+    }
+    return pattern;
+}
+
+/**
+ * Frees a compiled pattern
+ */
+void pattern_free(Pattern *pattern) {
+    if (pattern == NULL) return;
+    for (size_t i = 0; i < pattern->ncomp; i++) {
+        free_component(&pattern->comps[i]);
+    }
+    free(pattern->comps);
+    free(pattern);
+}
+
+// ===== Matching =====
+
+static int component_match(const Component *comp, const char *name, size_t len) {
+    for (size_t i = 0; i < comp->nalts; i++) {
+        if (match_alt(&comp->alts[i], name, len)) return 1;
+    }
+    return 0;
+}
+
+// Add the states reachable by skipping ** components
+static uint64_t closure(const Pattern *pattern, uint64_t state) {
+    for (size_t k = 0; k < pattern->ncomp; k++) {
+        if ((state >> k & 1) && pattern->comps[k].globstar && k + 1 < pattern->ncomp) {
+            state |= 1ull << (k + 1);
+        }
+    }
+    return state;
+}
+
+uint64_t pattern_start(const Pattern *pattern) {
+    return closure(pattern, 1);
+}
+
+/**
+ * Tests whether an entry of a directory in the given state matches
+ */
+int pattern_match_entry(const Pattern *pattern, uint64_t state, const char *name, size_t len) {
+    size_t last = pattern->ncomp - 1;
+    if (!(state >> last & 1)) return 0;
+    const Component *comp = &pattern->comps[last];
+    return comp->globstar || component_match(comp, name, len);
+}
+
+/**
+ * Computes the state of a subdirectory; 0 means prune it
+ */
+uint64_t pattern_descend(const Pattern *pattern, uint64_t state, const char *name, size_t len) {
+    uint64_t next = 0;
+    for (size_t k = 0; k < pattern->ncomp; k++) {
+        if (!(state >> k & 1)) continue;
+        const Component *comp = &pattern->comps[k];
+        if (comp->globstar) {
+            next |= 1ull << k;
+        } else if (k + 1 < pattern->ncomp && component_match(comp, name, len)) {
+            next |= 1ull << (k + 1);
+        }
+    }
+    return closure(pattern, next);
+}
+
+/**
+ * Tests a single name against a pattern that has no '/' components
+ */
+int pattern_match(const Pattern *pattern, const char *name, size_t len) {
+    return pattern_match_entry(pattern, pattern_start(pattern), name, len);
+}
@@ -0,0 +1,60 @@
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <stddef.h>   // For size_t
+#include <stdint.h>   // For uint64_t
+
+/**
+ * A name filter compiled once per command
+ *
+ * Syntax:
+ *   text        no metacharacters: matches names containing text
+ *   * ? [a-z]   glob: matches the whole name; [!...] or [^...] negates
+ *   {a,b}       alternation, may be nested
+ *   \c          matches c literally
+ *   a/b/c       matches path components below the starting directory;
+ *               a component of ** matches any number of directories
+ *
+ * Each alternative is compiled to the cheapest matcher that fits it:
+ * exact, prefix, suffix, prefix+suffix, substring (SIMD memmem), or a
+ * bit-parallel NFA for general globs.
+ */
+typedef struct Pattern Pattern;
+
+/**
+ * Compiles a pattern
+ * @param pat Pattern text
+ * @return Newly allocated pattern, or NULL if pat is malformed
+ */
+Pattern *pattern_compile(const char *pat);
+
+/**
+ * Frees a compiled pattern
+ */
+void pattern_free(Pattern *pattern);
+
+/**
+ * Tests a single name against a pattern that has no '/' components
+ * @return 1 if name matches, 0 otherwise
+ */
+int pattern_match(const Pattern *pattern, const char *name, size_t len);
+
+/* Path matching during a recursive walk
+ * A walk state is a bitmask of pattern components the current directory
+ * may still match. The starting directory uses pattern_start(); each
+ * entry is tested with pattern_match_entry(), and pattern_descend()
+ * gives the state for a subdirectory. A state of 0 means nothing below
+ * that directory can match, so it need not be read.
+ */
+uint64_t pattern_start(const Pattern *pattern);
+int pattern_match_entry(const Pattern *pattern, uint64_t state, const char *name, size_t len);
+uint64_t pattern_descend(const Pattern *pattern, uint64_t state, const char *name, size_t len);
+
+/**
+ * Finds the first occurrence of needle in haystack
+ * @return Pointer to the match, or NULL
+ * Note: Uses an SSE2 first/last-byte filter on x86, memmem() elsewhere
+ */
+const char *simd_memmem(const char *haystack, size_t hlen, const char *needle, size_t nlen);
+
+#endif
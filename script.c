@@ -0,0 +1,950 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "script.h"
+#include "variables.h"
+#include "io_helpers.h"
+#include "strbuf.h"
+#include "trace.h"
+
+extern Variable *var_list;
+
+// Function calls nested deeper than this are refused
+#define SCRIPT_MAX_DEPTH 256
+
+// ===== Parsed form =====
+
+typedef enum { NODE_CMD, NODE_IF, NODE_WHILE, NODE_FOR, NODE_FUNC, NODE_GROUP } NodeKind;
+
+/**
+ * One command of a parsed script; lists are chained through next
+ */
+typedef struct Node {
+    NodeKind kind;
+    struct Node *next;        // Next command in the same list
+    char **words;             // CMD: command words; FOR: list words
+    unsigned char *expand;    // Per word: 1 if it has references to expand
+    size_t count;             // Number of words
+    char **argv;              // CMD: argument vector reused on every run
+    const char *name;         // FOR: loop variable; FUNC: function name
+    struct Node *cond;        // IF, WHILE: condition list
+    struct Node *body;        // IF: then list; WHILE, FOR, FUNC, GROUP: body
+    struct Node *alt;         // IF: else list (an elif is a nested IF)
+    int until;                // WHILE: loop while the condition fails
+} Node;
+
+struct Script {
+    Arena arena;              // Owns the nodes, words and argument vectors
+    Node *body;               // Top-level command list
+    int refs;                 // The parser's caller plus functions defined in it
+};
+
+// A released script kept so the next parse reuses its arena
+static Script *spare = NULL;
+
+// ===== Parser =====
+
+typedef enum { TOK_WORD, TOK_SEP, TOK_END } TokKind;
+
+typedef struct Parser {
+    const char *pos;
+    const char *end;
+    Arena *arena;
+    TokKind kind;             // Current token
+    const char *text;         // TOK_WORD: the word (not NULL terminated)
+    size_t len;
+    const char *error;        // First syntax error, or NULL
+    const char *error_word;   // Word the error is reported at
+    int incomplete;           // The error is running out of input
+} Parser;
+
+// Keywords that end a list; any other use of them is a syntax error
+static const char *const TERMINATORS[] = {"then", "elif", "else", "fi", "do", "done", "}", NULL};
+static const char *const STOP_THEN[] = {"then", NULL};
+static const char *const STOP_ELSE[] = {"elif", "else", "fi", NULL};
+static const char *const STOP_FI[] = {"fi", NULL};
+static const char *const STOP_DO[] = {"do", NULL};
+static const char *const STOP_DONE[] = {"done", NULL};
+static const char *const STOP_BRACE[] = {"}", NULL};
+
+static Node *parse_list(Parser *p, const char *const *stops);
+
+static int is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static void fail_end(Parser *p) {
+    if (p->error != NULL) return;
+    p->error = "ERROR: Unexpected end of input";
+    p->error_word = "";
+    p->incomplete = 1;
+}
+
+// Report a syntax error at the current token
+static void fail_at(Parser *p) {
+    if (p->error != NULL) return;
+    if (p->kind == TOK_END) {
+        fail_end(p);
+        return;
+    }
+    p->error = "ERROR: Syntax error near: ";
+    p->error_word = p->kind == TOK_SEP ? "newline or ;" : arena_strndup(p->arena, p->text, p->len);
+}
+
+/* Advance to the next token
+ * Words end at blanks, ; and newlines, except inside a $( ) group.
+ */
+static void next_tok(Parser *p) {
+    while (p->pos < p->end && is_blank(*p->pos)) p->pos++;
+    if (p->pos < p->end && *p->pos == '#') {
+        while (p->pos < p->end && *p->pos != '\n') p->pos++;
+    }
+    if (p->pos >= p->end) {
+        p->kind = TOK_END;
+        return;
+    }
+    if (*p->pos == '\n' || *p->pos == ';') {
+        p->kind = TOK_SEP;
+        p->pos++;
+        return;
+    }
+
+    const char *start = p->pos;
+    int depth = 0;   // Open parentheses of the current $( group
+    for (; p->pos < p->end; p->pos++) {
+        char c = *p->pos;
+        if (depth == 0 && (is_blank(c) || c == '\n' || c == ';')) break;
+        if (c == '$' && p->pos + 1 < p->end && p->pos[1] == '(') {
+            depth++;
+            p->pos++;
+        } else if (depth > 0 && c == '(') {
+            depth++;
+        } else if (depth > 0 && c == ')') {
+            depth--;
+        }
+    }
+    if (depth > 0) fail_end(p);
+    p->kind = TOK_WORD;
+    p->text = start;
+    p->len = p->pos - start;
+}
+
+static int is_word(const Parser *p, const char *word) {
+    size_t n = strlen(word);
+    return p->kind == TOK_WORD && p->len == n && memcmp(p->text, word, n) == 0;
+}
+
+static int is_one_of(const Parser *p, const char *const *words) {
+    for (; words != NULL && *words != NULL; words++) {
+        if (is_word(p, *words)) return 1;
+    }
+    return 0;
+}
+
+// Consume keyword, or report a syntax error
+static int expect(Parser *p, const char *keyword) {
+    if (!is_word(p, keyword)) {
+        fail_at(p);
+        return 0;
+    }
+    next_tok(p);
+    return 1;
+}
+
+static Node *new_node(Parser *p, NodeKind kind) {
+    Node *node = arena_alloc(p->arena, sizeof(Node));
+    memset(node, 0, sizeof(Node));
+    node->kind = kind;
+    return node;
+}
+
+// Store every word up to the end of the command in node
+static void collect_words(Parser *p, Node *node) {
+    // Count first so the arrays are allocated at their final size
+    Parser save = *p;
+    size_t count = 0;
+    for (; p->kind == TOK_WORD; next_tok(p)) count++;
+    *p = save;
+
+    node->count = count;
+    node->words = arena_alloc(p->arena, (count + 1) * sizeof(char *));
+    node->expand = arena_alloc(p->arena, count + 1);
+    for (size_t i = 0; i < count; i++, next_tok(p)) {
+        node->words[i] = arena_strndup(p->arena, p->text, p->len);
+        // Same rule as tokenize_input: a lone $ is literal
+        node->expand[i] = p->len > 1 && memchr(p->text, '$', p->len) != NULL;
+    }
+    node->words[count] = NULL;
+}
+
+/* Parse the rest of a function definition; the name has been consumed
+ * name() { list; }  or  function name [()] { list; }
+ */
+static Node *parse_function(Parser *p, const char *name, size_t len) {
+    if (name == NULL) {
+        if (p->kind != TOK_WORD) {
+            fail_at(p);
+            return NULL;
+        }
+        name = p->text;
+        len = p->len;
+        next_tok(p);
+        if (is_word(p, "()")) next_tok(p);
+    }
+    if (len == 0 || memchr(name, '$', len) || memchr(name, '=', len) ||
+        memchr(name, '(', len) || memchr(name, ')', len)) {
+        p->error = "ERROR: Invalid function name: ";
+        p->error_word = arena_strndup(p->arena, name, len);
+        return NULL;
+    }
+
+    Node *node = new_node(p, NODE_FUNC);
+    node->name = arena_strndup(p->arena, name, len);
+    while (p->kind == TOK_SEP) next_tok(p);
+    if (!expect(p, "{")) return NULL;
+    node->body = parse_list(p, STOP_BRACE);
+    expect(p, "}");
+    return node;
+}
+
+// A simple command, or a function definition written name() { ... }
+static Node *parse_simple(Parser *p) {
+    if (p->len > 2 && memcmp(p->text + p->len - 2, "()", 2) == 0) {
+        const char *name = p->text;
+        size_t len = p->len - 2;
+        next_tok(p);
+        return parse_function(p, name, len);
+    }
+    Parser save = *p;
+    next_tok(p);
+    if (is_word(p, "()")) {
+        next_tok(p);
+        return parse_function(p, save.text, save.len);
+    }
+    *p = save;
+
+    Node *node = new_node(p, NODE_CMD);
+    collect_words(p, node);
+    node->argv = arena_alloc(p->arena, (node->count + 1) * sizeof(char *));
+    return node;
+}
+
+// if/elif: the keyword is the current token
+static Node *parse_if(Parser *p) {
+    next_tok(p);
+    Node *node = new_node(p, NODE_IF);
+    node->cond = parse_list(p, STOP_THEN);
+    if (node->cond == NULL) fail_at(p);
+    if (!expect(p, "then")) return node;
+    node->body = parse_list(p, STOP_ELSE);
+    if (is_word(p, "elif")) {
+        // The elif chain shares the final fi
+        node->alt = parse_if(p);
+        return node;
+    }
+    if (is_word(p, "else")) {
+        next_tok(p);
+        node->alt = parse_list(p, STOP_FI);
+    }
+    expect(p, "fi");
+    return node;
+}
+
+// while/until list; do list; done
+static Node *parse_while(Parser *p) {
+    Node *node = new_node(p, NODE_WHILE);
+    node->until = is_word(p, "until");
+    next_tok(p);
+    node->cond = parse_list(p, STOP_DO);
+    if (node->cond == NULL) fail_at(p);
+    if (!expect(p, "do")) return node;
+    node->body = parse_list(p, STOP_DONE);
+    expect(p, "done");
+    return node;
+}
+
+// for name in word...; do list; done
+static Node *parse_for(Parser *p) {
+    next_tok(p);
+    Node *node = new_node(p, NODE_FOR);
+    int valid = p->kind == TOK_WORD && p->len > 0 &&
+                !(p->text[0] >= '0' && p->text[0] <= '9');
+    for (size_t i = 0; valid && i < p->len; i++) {
+        char c = p->text[i];
+        valid = c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                (c >= '0' && c <= '9');
+    }
+    if (!valid) {
+        fail_at(p);
+        return node;
+    }
+    node->name = arena_strndup(p->arena, p->text, p->len);
+    next_tok(p);
+    if (!expect(p, "in")) return node;
+    collect_words(p, node);
+    while (p->kind == TOK_SEP) next_tok(p);
+    if (!expect(p, "do")) return node;
+    node->body = parse_list(p, STOP_DONE);
+    expect(p, "done");
+    return node;
+}
+
+static Node *parse_command(Parser *p) {
+    if (is_word(p, "if")) return parse_if(p);
+    if (is_word(p, "while") || is_word(p, "until")) return parse_while(p);
+    if (is_word(p, "for")) return parse_for(p);
+    if (is_word(p, "function")) {
+        next_tok(p);
+        return parse_function(p, NULL, 0);
+    }
+    if (is_word(p, "{")) {
+        next_tok(p);
+        Node *node = new_node(p, NODE_GROUP);
+        node->body = parse_list(p, STOP_BRACE);
+        expect(p, "}");
+        return node;
+    }
+    return parse_simple(p);
+}
+
+/* Parse commands until one of stops (left as the current token) or the
+ * end of input
+ */
+static Node *parse_list(Parser *p, const char *const *stops) {
+    Node *head = NULL;
+    Node **tail = &head;
+    while (p->error == NULL) {
+        while (p->kind == TOK_SEP) next_tok(p);
+        if (p->kind == TOK_END || is_one_of(p, stops)) break;
+        if (is_one_of(p, TERMINATORS)) {
+            fail_at(p);
+            break;
+        }
+
+        Node *node = parse_command(p);
+        if (node != NULL) {
+            *tail = node;
+            tail = &node->next;
+        }
+        // A compound command must be followed by a separator
+        if (p->error == NULL && p->kind == TOK_WORD && !is_one_of(p, TERMINATORS)) {
+            fail_at(p);
+        }
+    }
+    return head;
+}
+
+// An empty script, reusing the spare one's arena when there is one
+static Script *new_script(void) {
+    Script *script = spare;
+    spare = NULL;
+    if (script == NULL) {
+        script = calloc(1, sizeof(Script));
+        if (script == NULL) display_error("ERROR: Out of memory", "");
+    }
+    return script;
+}
+
+/**
+ * Parses shell text
+ */
+Script *script_parse(const char *text, size_t len, int *incomplete) {
+    Script *script = new_script();
+    if (script == NULL) {
+        *incomplete = 0;
+        return NULL;
+    }
+
+    uint64_t trace_start_ns = trace_now();
+    Parser p = {text, text + len, &script->arena, TOK_END, NULL, 0, NULL, NULL, 0};
+    next_tok(&p);
+    script->body = parse_list(&p, NULL);
+    script->refs = 1;
+    trace_event("parse", trace_start_ns, NULL);
+
+    *incomplete = p.incomplete;
+    if (p.error != NULL) {
+        if (!p.incomplete) display_error(p.error, p.error_word);
+        script_release(script);
+        return NULL;
+    }
+    return script;
+}
+
+/**
+ * Drops a reference to a parsed script
+ */
+void script_release(Script *script) {
+    if (script == NULL || --script->refs > 0) return;
+    if (spare == NULL) {
+        arena_reset(&script->arena);
+        script->body = NULL;
+        spare = script;
+        return;
+    }
+    arena_free(&script->arena);
+    free(script);
+}
+
+// ===== Binary form =====
+
+/* Encoding of a command list: each node as
+ *   kind, until (1 byte each), word count (u32), each word (u32 length
+ *   and bytes), the expand flags (1 byte per word), name (u32 length
+ *   and bytes, NO_NAME if NULL), then its cond, body and alt lists
+ * followed by END_OF_LIST. Integers are in native byte order.
+ */
+#define END_OF_LIST 0xff
+#define NO_NAME UINT32_MAX
+// Lists nested deeper than this are rejected by the decoder
+#define DECODE_MAX_DEPTH 1024
+
+static int put_u32(StrBuf *out, uint32_t value) {
+    return strbuf_append(out, (const char *)&value, sizeof(value));
+}
+
+static int put_str(StrBuf *out, const char *str) {
+    if (str == NULL) return put_u32(out, NO_NAME);
+    size_t len = strlen(str);
+    if (put_u32(out, (uint32_t)len) == -1) return -1;
+    return strbuf_append(out, str, len);
+}
+
+static int encode_list(const Node *list, StrBuf *out) {
+    for (const Node *node = list; node != NULL; node = node->next) {
+        char head[2] = {(char)node->kind, (char)node->until};
+        if (strbuf_append(out, head, sizeof(head)) == -1 ||
+            put_u32(out, (uint32_t)node->count) == -1) return -1;
+        for (size_t i = 0; i < node->count; i++) {
+            if (put_str(out, node->words[i]) == -1) return -1;
+        }
+        if ((node->count > 0 && strbuf_append(out, (const char *)node->expand, node->count) == -1) ||
+            put_str(out, node->name) == -1 ||
+            encode_list(node->cond, out) == -1 ||
+            encode_list(node->body, out) == -1 ||
+            encode_list(node->alt, out) == -1) return -1;
+    }
+    return strbuf_appendc(out, (char)END_OF_LIST);
+}
+
+/**
+ * Appends the binary form of a parsed script
+ */
+int script_encode(const Script *script, StrBuf *out) {
+    return encode_list(script->body, out);
+}
+
+typedef struct Decoder {
+    const char *pos;
+    const char *end;
+    Arena *arena;
+    int depth;
+    int error;                // Set on truncated or malformed input
+} Decoder;
+
+static uint32_t get_u32(Decoder *d) {
+    uint32_t value = 0;
+    if ((size_t)(d->end - d->pos) < sizeof(value)) {
+        d->error = 1;
+        return 0;
+    }
+    memcpy(&value, d->pos, sizeof(value));
+    d->pos += sizeof(value);
+    return value;
+}
+
+// Return: an arena copy of the next string, or NULL for NO_NAME or an error
+static char *get_str(Decoder *d) {
+    uint32_t len = get_u32(d);
+    if (d->error || len == NO_NAME) return NULL;
+    if ((size_t)(d->end - d->pos) < len) {
+        d->error = 1;
+        return NULL;
+    }
+    char *str = arena_strndup(d->arena, d->pos, len);
+    d->pos += len;
+    return str;
+}
+
+static Node *decode_list(Decoder *d) {
+    Node *head = NULL;
+    Node **tail = &head;
+    if (++d->depth > DECODE_MAX_DEPTH) d->error = 1;
+    while (!d->error) {
+        if (d->pos >= d->end) {
+            d->error = 1;
+            break;
+        }
+        unsigned char kind = (unsigned char)*d->pos++;
+        if (kind == END_OF_LIST) break;
+        if (kind > NODE_GROUP || d->pos >= d->end) {
+            d->error = 1;
+            break;
+        }
+
+        Node *node = arena_alloc(d->arena, sizeof(Node));
+        memset(node, 0, sizeof(Node));
+        node->kind = kind;
+        node->until = *d->pos++ != 0;
+        node->count = get_u32(d);
+        // Every word takes at least its length and flag byte
+        if (d->error || node->count > (size_t)(d->end - d->pos) / (sizeof(uint32_t) + 1)) {
+            d->error = 1;
+            break;
+        }
+        node->words = arena_alloc(d->arena, (node->count + 1) * sizeof(char *));
+        for (size_t i = 0; i < node->count; i++) {
+            node->words[i] = get_str(d);
+            if (node->words[i] == NULL) d->error = 1;
+        }
+        node->words[node->count] = NULL;
+        node->expand = arena_alloc(d->arena, node->count + 1);
+        if (d->error || (size_t)(d->end - d->pos) < node->count) {
+            d->error = 1;
+            break;
+        }
+        memcpy(node->expand, d->pos, node->count);
+        d->pos += node->count;
+        node->name = get_str(d);
+        if ((kind == NODE_FOR || kind == NODE_FUNC) && node->name == NULL) d->error = 1;
+        node->cond = decode_list(d);
+        node->body = decode_list(d);
+        node->alt = decode_list(d);
+        if (kind == NODE_CMD) {
+            node->argv = arena_alloc(d->arena, (node->count + 1) * sizeof(char *));
+        }
+        *tail = node;
+        tail = &node->next;
+    }
+    d->depth--;
+    return head;
+}
+
+/**
+ * Rebuilds a script from its binary form
+ */
+Script *script_decode(const char *data, size_t len) {
+    Script *script = new_script();
+    if (script == NULL) return NULL;
+
+    uint64_t trace_start_ns = trace_now();
+    Decoder d = {data, data + len, &script->arena, 0, 0};
+    script->body = decode_list(&d);
+    script->refs = 1;
+    trace_event("decode", trace_start_ns, NULL);
+
+    if (d.error || d.pos != d.end) {
+        script_release(script);
+        return NULL;
+    }
+    return script;
+}
+
+// ===== Executor =====
+
+typedef enum { CTRL_NONE, CTRL_BREAK, CTRL_CONTINUE, CTRL_RETURN, CTRL_EXIT } Ctrl;
+
+/**
+ * A defined function; holds a reference to the script its body is in
+ */
+typedef struct Function {
+    char *name;
+    Node *body;
+    Script *script;
+    struct Function *next;
+} Function;
+
+static Function *functions = NULL;
+
+static Arena *exec_arena = NULL;     // Expansions of the running commands
+static ScriptRunFn exec_run = NULL;  // Runs expanded simple commands
+static Script *current_script = NULL;
+static Ctrl ctrl = CTRL_NONE;        // Pending break/continue/return/exit
+static long ctrl_levels = 0;         // Loops a break or continue still has to leave
+static int loop_depth = 0;           // Loops running in the current function
+static int call_depth = 0;           // Function calls in progress
+static size_t positional = 0;        // $1... set by the current function call
+static int last_status = 0;
+static int exit_status = 0;          // Status given to exit
+
+static int exec_list(Node *list);
+
+/**
+ * Sets how simple commands are run
+ */
+void script_init(Arena *arena, ScriptRunFn run) {
+    exec_arena = arena;
+    exec_run = run;
+}
+
+/**
+ * Return: 1 once exit has run
+ */
+int script_exiting(void) {
+    return ctrl == CTRL_EXIT;
+}
+
+/* Expand one word into the exec arena
+ * Return: the expanded word, or NULL if an arithmetic expansion failed
+ */
+static char *expand_word(const char *word) {
+    // $(cmd) can run a script while an outer expansion is in progress
+    static StrBuf shared = STRBUF_INIT;
+    static int nesting = 0;
+    StrBuf local = STRBUF_INIT;
+    StrBuf *buf = nesting == 0 ? &shared : &local;
+
+    nesting++;
+    strbuf_reset(buf);
+    int err = expand_variables(word, strlen(word), buf, &var_list);
+    nesting--;
+    if (err == -1) {
+        perror("expand_variables failed");
+        exit(EXIT_FAILURE);
+    }
+    char *result = err == 0 ? arena_strndup(exec_arena, buf->len ? buf->data : "", buf->len) : NULL;
+    strbuf_free(&local);
+    return result;
+}
+
+// Set a variable, reusing its storage when the new value fits
+static void set_loop_var(const char *name, const char *value) {
+    Variable *var = find_var(var_list, name, strlen(name));
+    if (var == NULL || overwrite_var(var, value, strlen(value)) == -1) {
+        set_var_verbatim(&var_list, value, name);
+    }
+}
+
+static Function *find_function(const char *name) {
+    for (Function *fn = functions; fn != NULL; fn = fn->next) {
+        if (strcmp(fn->name, name) == 0) return fn;
+    }
+    return NULL;
+}
+
+// Bind name to body, replacing any earlier definition
+static void define_function(const char *name, Node *body) {
+    Function *fn = find_function(name);
+    if (fn == NULL) {
+        fn = malloc(sizeof(Function));
+        if (fn == NULL || (fn->name = strdup(name)) == NULL) {
+            free(fn);
+            display_error("ERROR: Out of memory", "");
+            return;
+        }
+        fn->script = NULL;
+        fn->next = functions;
+        functions = fn;
+    }
+    current_script->refs++;
+    script_release(fn->script);
+    fn->script = current_script;
+    fn->body = body;
+}
+
+/* Run a function with argv[1...] as $1...
+ * The caller's positional parameters are restored afterwards.
+ */
+static int call_function(Function *fn, char **argv, size_t argc) {
+    if (call_depth >= SCRIPT_MAX_DEPTH) {
+        display_error("ERROR: Function calls nested too deeply: ", fn->name);
+        return 1;
+    }
+
+    size_t saved_count = positional;
+    char **saved = saved_count ? malloc(saved_count * sizeof(char *)) : NULL;
+    char name[24];
+    for (size_t i = 0; i < saved_count; i++) {
+        snprintf(name, sizeof(name), "%zu", i + 1);
+        const char *val = saved ? getVar(var_list, name) : NULL;
+        if (saved) saved[i] = strdup(val ? val : "");
+    }
+    for (size_t i = 1; i < argc || i <= saved_count; i++) {
+        snprintf(name, sizeof(name), "%zu", i);
+        set_var_verbatim(&var_list, i < argc ? argv[i] : "", name);
+    }
+    positional = argc - 1;
+
+    // The body's script stays alive even if the function is redefined
+    Script *script = fn->script;
+    Script *saved_script = current_script;
+    int saved_loops = loop_depth;
+    script->refs++;
+    current_script = script;
+    loop_depth = 0;
+    call_depth++;
+
+    int status = exec_list(fn->body);
+    if (ctrl == CTRL_RETURN || ctrl == CTRL_BREAK || ctrl == CTRL_CONTINUE) ctrl = CTRL_NONE;
+
+    call_depth--;
+    loop_depth = saved_loops;
+    current_script = saved_script;
+    script_release(script);
+
+    for (size_t i = 1; i <= positional || i <= saved_count; i++) {
+        snprintf(name, sizeof(name), "%zu", i);
+        const char *val = i <= saved_count && saved && saved[i - 1] ? saved[i - 1] : "";
+        set_var_verbatim(&var_list, val, name);
+    }
+    for (size_t i = 0; saved && i < saved_count; i++) free(saved[i]);
+    free(saved);
+    positional = saved_count;
+    return status;
+}
+
+/* Parse the optional count of break, continue or return
+ * Return: the count, or -1 if arg is not a number
+ */
+static long control_arg(const char *arg, long fallback) {
+    if (arg == NULL) return fallback;
+    char *end;
+    long n = strtol(arg, &end, 10);
+    return end == arg || *end != '\0' ? -1 : n;
+}
+
+/**
+ * Runs a control command or a function call
+ */
+int script_run_command(char **argv, int *status) {
+    const char *cmd = argv[0];
+    int is_break = strcmp(cmd, "break") == 0;
+    if (is_break || strcmp(cmd, "continue") == 0) {
+        long n = control_arg(argv[1], 1);
+        *status = 1;
+        if (n < 1) {
+            display_error("ERROR: Invalid loop count: ", argv[1]);
+            return 1;
+        }
+        if (loop_depth == 0) {
+            display_error("ERROR: Not in a loop: ", cmd);
+            return 1;
+        }
+        ctrl = is_break ? CTRL_BREAK : CTRL_CONTINUE;
+        ctrl_levels = n < loop_depth ? n : loop_depth;
+        *status = 0;
+        return 1;
+    }
+    if (strcmp(cmd, "return") == 0) {
+        long n = control_arg(argv[1], last_status);
+        if (n == -1 && argv[1] != NULL) {
+            display_error("ERROR: Invalid return status: ", argv[1]);
+            n = 1;
+        }
+        ctrl = CTRL_RETURN;
+        *status = (int)(n & 0xff);
+        return 1;
+    }
+    if (strcmp(cmd, "exit") == 0) {
+        long n = control_arg(argv[1], last_status);
+        if (n == -1 && argv[1] != NULL) {
+            display_error("ERROR: Invalid exit status: ", argv[1]);
+            n = 2;
+        }
+        ctrl = CTRL_EXIT;
+        exit_status = (int)(n & 0xff);
+        *status = exit_status;
+        return 1;
+    }
+
+    Function *fn = functions != NULL ? find_function(cmd) : NULL;
+    if (fn == NULL) return 0;
+    size_t argc = 1;
+    while (argv[argc] != NULL) argc++;
+    *status = call_function(fn, argv, argc);
+    return 1;
+}
+
+// Expand a simple command into its argument vector and run it
+static int exec_cmd(Node *node) {
+    ArenaMark mark = arena_mark(exec_arena);
+    for (size_t i = 0; i < node->count; i++) {
+        if (!node->expand[i]) {
+            node->argv[i] = node->words[i];
+            continue;
+        }
+        uint64_t trace_start_ns = trace_now();
+        node->argv[i] = expand_word(node->words[i]);
+        trace_event("expand", trace_start_ns, node->words[i]);
+        if (node->argv[i] == NULL) {
+            // Already reported; drop the whole command
+            arena_rewind(exec_arena, mark);
+            return 1;
+        }
+    }
+    node->argv[node->count] = NULL;
+
+    int status = exec_run(node->argv, node->count);
+    arena_rewind(exec_arena, mark);
+    return status;
+}
+
+/* After a loop's condition or body: handle break and continue
+ * Return: 1 if the loop must stop, 0 if it goes on
+ */
+static int loop_should_stop(void) {
+    if (ctrl == CTRL_BREAK || ctrl == CTRL_CONTINUE) {
+        int is_continue = ctrl == CTRL_CONTINUE;
+        if (--ctrl_levels == 0) ctrl = CTRL_NONE;
+        return ctrl != CTRL_NONE || !is_continue;
+    }
+    return ctrl != CTRL_NONE;
+}
+
+static int exec_while(Node *node) {
+    int status = 0;
+    loop_depth++;
+    while (1) {
+        int cond = exec_list(node->cond);
+        if (loop_should_stop() || (cond == 0) == node->until) break;
+        status = exec_list(node->body);
+        if (loop_should_stop()) break;
+    }
+    loop_depth--;
+    return status;
+}
+
+/* Run a for loop
+ * Words with references are expanded once and split at blanks and
+ * newlines, so "for f in $(ls)" visits each name.
+ */
+static int exec_for(Node *node) {
+    ArenaMark mark = arena_mark(exec_arena);
+
+    // Expand and split the list; fields point into the arena
+    char **expanded = arena_alloc(exec_arena, (node->count + 1) * sizeof(char *));
+    size_t field_count = 0;
+    for (size_t i = 0; i < node->count; i++) {
+        if (!node->expand[i]) {
+            expanded[i] = node->words[i];
+            field_count++;
+            continue;
+        }
+        expanded[i] = expand_word(node->words[i]);
+        if (expanded[i] == NULL) {
+            arena_rewind(exec_arena, mark);
+            return 1;
+        }
+        for (char *s = expanded[i]; *s; ) {
+            s += strspn(s, " \t\n");
+            if (*s == '\0') break;
+            field_count++;
+            s += strcspn(s, " \t\n");
+        }
+    }
+    char **fields = arena_alloc(exec_arena, (field_count + 1) * sizeof(char *));
+    size_t n = 0;
+    for (size_t i = 0; i < node->count; i++) {
+        if (!node->expand[i]) {
+            fields[n++] = expanded[i];
+            continue;
+        }
+        for (char *s = expanded[i]; *s; ) {
+            s += strspn(s, " \t\n");
+            if (*s == '\0') break;
+            fields[n++] = s;
+            s += strcspn(s, " \t\n");
+            if (*s != '\0') *s++ = '\0';
+        }
+    }
+
+    int status = 0;
+    loop_depth++;
+    for (size_t i = 0; i < field_count; i++) {
+        set_loop_var(node->name, fields[i]);
+        status = exec_list(node->body);
+        if (loop_should_stop()) break;
+    }
+    loop_depth--;
+    arena_rewind(exec_arena, mark);
+    return status;
+}
+
+static int exec_node(Node *node) {
+    switch (node->kind) {
+        case NODE_CMD:
+            return exec_cmd(node);
+        case NODE_IF: {
+            int cond = exec_list(node->cond);
+            if (ctrl != CTRL_NONE) return cond;
+            if (cond == 0) return exec_list(node->body);
+            return exec_list(node->alt);
+        }
+        case NODE_WHILE:
+            return exec_while(node);
+        case NODE_FOR:
+            return exec_for(node);
+        case NODE_FUNC:
+            define_function(node->name, node->body);
+            return 0;
+        case NODE_GROUP:
+            return exec_list(node->body);
+    }
+    return 0;
+}
+
+// Run a list until it ends or a control command interrupts it
+static int exec_list(Node *list) {
+    int status = 0;
+    for (Node *node = list; node != NULL && ctrl == CTRL_NONE; node = node->next) {
+        status = exec_node(node);
+        last_status = status;
+    }
+    return status;
+}
+
+/**
+ * Runs a parsed script
+ * Note: break, continue and return stop at the end of the script; exit
+ *       stays pending so the caller can see it with script_exiting(), and
+ *       its status is returned
+ */
+int script_run(Script *script) {
+    Script *saved_script = current_script;
+    int saved_loops = loop_depth;
+    script->refs++;
+    current_script = script;
+    loop_depth = 0;
+
+    int status = exec_list(script->body);
+    if (ctrl == CTRL_EXIT) {
+        status = exit_status;
+    } else {
+        ctrl = CTRL_NONE;
+    }
+
+    loop_depth = saved_loops;
+    current_script = saved_script;
+    script_release(script);
+    return status;
+}
+
+/**
+ * Return: 1 if name is a function or a control command
+ */
+int script_has_command(const char *name) {
+    static const char *const CONTROL[] = {"break", "continue", "return", "exit", NULL};
+    for (size_t i = 0; CONTROL[i] != NULL; i++) {
+        if (strcmp(name, CONTROL[i]) == 0) return 1;
+    }
+    return find_function(name) != NULL;
+}
+
+/**
+ * Forgets every function definition and the spare script
+ */
+void script_clear_functions(void) {
+    while (functions != NULL) {
+        Function *fn = functions;
+        functions = fn->next;
+        script_release(fn->script);
+        free(fn->name);
+        free(fn);
+    }
+    if (spare != NULL) {
+        arena_free(&spare->arena);
+        free(spare);
+        spare = NULL;
+    }
+}
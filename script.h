@@ -0,0 +1,108 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stddef.h>   // For size_t
+#include "arena.h"
+#include "strbuf.h"
+
+/**
+ * Shell text parsed once into a tree of commands
+ *
+ * Syntax (keywords are only recognized as the first word of a command;
+ * commands are separated by ; or newlines, and # starts a comment):
+ *   if list; then list; [elif list; then list;]... [else list;] fi
+ *   while list; do list; done      until list; do list; done
+ *   for name in word...; do list; done
+ *   name() { list; }               function name { list; }
+ *   { list; }
+ *   break [n]  continue [n]  return [n]  exit [n]
+ *
+ * Each simple command keeps its words split and its argument vector
+ * allocated, so running it again (a loop body, a function call) only
+ * expands the words that contain $.
+ */
+typedef struct Script Script;
+
+/**
+ * Runs one expanded simple command
+ * @param argv NULL terminated words; the array may be modified
+ * @param argc Number of words
+ * @return Exit status of the command
+ * Note: argv may still hold |, & and time; each command left once those
+ *       are handled goes to script_run_command first.
+ */
+typedef int (*ScriptRunFn)(char **argv, size_t argc);
+
+/**
+ * Sets how simple commands are run and where their expansions live
+ * @param arena Arena expansions are allocated from; rewound after each command
+ * @param run Function that runs an expanded simple command
+ */
+void script_init(Arena *arena, ScriptRunFn run);
+
+/**
+ * Parses shell text
+ * @param text Text to parse (need not be NULL terminated)
+ * @param len Number of bytes of text
+ * @param incomplete Set to 1 if text ends inside a construct that more
+ *        input could complete (no error is reported then), 0 otherwise
+ * @return Parsed script, or NULL on a syntax error or incomplete input
+ */
+Script *script_parse(const char *text, size_t len, int *incomplete);
+
+/**
+ * Appends a compact binary form of a parsed script, for script_decode
+ * @param script Script to encode
+ * @param out Buffer the encoding is appended to
+ * @return 0 on success, -1 on allocation failure
+ * Note: Integers are stored in native byte order, so the encoding is only
+ *       meant to be read back on the machine that wrote it.
+ */
+int script_encode(const Script *script, StrBuf *out);
+
+/**
+ * Rebuilds a script from the output of script_encode
+ * @param data Encoded script
+ * @param len Number of bytes of data
+ * @return Script as if freshly parsed, or NULL if data is malformed
+ *         (nothing is reported)
+ */
+Script *script_decode(const char *data, size_t len);
+
+/**
+ * Drops a reference to a parsed script
+ * Note: Functions the script defined keep it alive until redefined
+ */
+void script_release(Script *script);
+
+/**
+ * Runs a parsed script
+ * @return Exit status of the last command run, or the status given to exit
+ */
+int script_run(Script *script);
+
+/**
+ * Return: 1 once the exit command has run, 0 otherwise
+ */
+int script_exiting(void);
+
+/**
+ * Runs a function call or break, continue, return or exit
+ * @param argv NULL terminated words of one command (one pipeline stage)
+ * @param status Set to the exit status of the command when it ran
+ * @return 1 if argv named a function or control command (and it ran), 0 if
+ *         it is something else and nothing was done
+ */
+int script_run_command(char **argv, int *status);
+
+/**
+ * Return: 1 if name is a function or a control command, 0 otherwise
+ */
+int script_has_command(const char *name);
+
+/**
+ * Forgets every function definition and releases cached memory
+ */
+void script_clear_functions(void);
+
+#endif
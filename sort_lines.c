@@ -0,0 +1,582 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "sort_lines.h"
+#include "io_helpers.h"
+#include "strbuf.h"
+#include "workpool.h"
+
+// Batches with fewer lines than this are sorted on the calling thread
+#define SORT_PARALLEL_MIN 65536
+// Write buffer used when spilling a run
+#define SORT_SPILL_BUF (1 << 20)
+// First size of the input buffer; it doubles up to the memory budget
+#define SORT_INITIAL_BUF (64 << 10)
+
+// One line of the current batch: an offset into the batch buffer
+typedef struct SortLine {
+    size_t off;     // Start of the line in the batch buffer
+    size_t len;     // Length without the newline
+    double num;     // Numeric key, when sorting with -n
+} SortLine;
+
+// Comparison context shared by every sort and merge
+typedef struct SortCtx {
+    const SortOpts *opts;
+    const char *base;       // Batch buffer SortLine offsets refer to
+} SortCtx;
+
+// ===== Keys and comparison =====
+
+static int is_blank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// Locate the key: field key_field to the end of the line, leading blanks skipped
+static void line_key(const SortOpts *opts, const char *line, size_t len,
+                     const char **key, size_t *key_len) {
+    size_t i = 0;
+    for (int field = 1; field < opts->key_field && i < len; field++) {
+        while (i < len && is_blank(line[i])) i++;
+        while (i < len && !is_blank(line[i])) i++;
+    }
+    if (opts->key_field > 0) {
+        while (i < len && is_blank(line[i])) i++;
+    }
+    *key = line + i;
+    *key_len = len - i;
+}
+
+// Parse the leading number of a key; anything unparsable is 0
+static double parse_num(const char *s, size_t len) {
+    size_t i = 0;
+    while (i < len && is_blank(s[i])) i++;
+    int negative = 0;
+    if (i < len && s[i] == '-') {
+        negative = 1;
+        i++;
+    }
+    double value = 0;
+    while (i < len && s[i] >= '0' && s[i] <= '9') {
+        value = value * 10 + (s[i++] - '0');
+    }
+    if (i < len && s[i] == '.') {
+        double scale = 0.1;
+        for (i++; i < len && s[i] >= '0' && s[i] <= '9'; i++) {
+            value += (s[i] - '0') * scale;
+            scale /= 10;
+        }
+    }
+    return negative ? -value : value;
+}
+
+static double line_num(const SortOpts *opts, const char *line, size_t len) {
+    const char *key;
+    size_t key_len;
+    line_key(opts, line, len, &key, &key_len);
+    return parse_num(key, key_len);
+}
+
+static int bytes_compare(const char *a, size_t alen, const char *b, size_t blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    if (c != 0) return c;
+    return (alen > blen) - (alen < blen);
+}
+
+/* Compare two lines by key, ignoring -r
+ * Return: <0, 0 or >0
+ */
+static int key_compare(const SortOpts *opts, const char *a, size_t alen, double anum,
+                       const char *b, size_t blen, double bnum) {
+    if (opts->numeric) {
+        return (anum > bnum) - (anum < bnum);
+    }
+    const char *ka, *kb;
+    size_t kalen, kblen;
+    line_key(opts, a, alen, &ka, &kalen);
+    line_key(opts, b, blen, &kb, &kblen);
+    return bytes_compare(ka, kalen, kb, kblen);
+}
+
+/* Total order used for sorting
+ * Equal keys fall back to comparing whole lines, except with -u where
+ * lines with equal keys are interchangeable
+ */
+static int full_compare(const SortOpts *opts, const char *a, size_t alen, double anum,
+                        const char *b, size_t blen, double bnum) {
+    int c = key_compare(opts, a, alen, anum, b, blen, bnum);
+    if (c == 0 && !opts->unique && (opts->numeric || opts->key_field > 0)) {
+        c = bytes_compare(a, alen, b, blen);
+    }
+    return opts->reverse ? -c : c;
+}
+
+static int line_compare(const void *x, const void *y, void *arg) {
+    const SortCtx *ctx = arg;
+    const SortLine *a = x, *b = y;
+    int c = full_compare(ctx->opts, ctx->base + a->off, a->len, a->num,
+                         ctx->base + b->off, b->len, b->num);
+    // Equal lines keep input order, so -u keeps the first of each key
+    return c != 0 ? c : (a->off > b->off) - (a->off < b->off);
+}
+
+// ===== In-memory sort =====
+
+// A run of sorted lines being merged
+typedef struct MergeSrc {
+    SortLine *cur;
+    SortLine *end;
+} MergeSrc;
+
+// Restore the heap property below slot i (heap of source indices)
+static void heap_down(size_t *heap, size_t n, size_t i, MergeSrc *srcs, const SortCtx *ctx) {
+    while (1) {
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < n && line_compare(srcs[heap[l]].cur, srcs[heap[m]].cur, (void *)ctx) < 0) m = l;
+        if (r < n && line_compare(srcs[heap[r]].cur, srcs[heap[m]].cur, (void *)ctx) < 0) m = r;
+        if (m == i) return;
+        size_t t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+// Merge nsrc sorted runs into out with a binary heap
+static void merge_runs(MergeSrc *srcs, size_t nsrc, SortLine *out, const SortCtx *ctx) {
+    size_t heap[nsrc ? nsrc : 1];
+    size_t n = 0;
+    for (size_t i = 0; i < nsrc; i++) {
+        if (srcs[i].cur < srcs[i].end) heap[n++] = i;
+    }
+    for (size_t i = n; i-- > 0; ) heap_down(heap, n, i, srcs, ctx);
+
+    while (n > 0) {
+        MergeSrc *top = &srcs[heap[0]];
+        *out++ = *top->cur++;
+        if (top->cur == top->end) heap[0] = heap[--n];
+        heap_down(heap, n, 0, srcs, ctx);
+    }
+}
+
+// Shared state for sorting one batch in parallel
+typedef struct ParSort {
+    SortCtx ctx;
+    SortLine *lines;      // Input, sorted in place chunk by chunk
+    SortLine *out;        // Merged result
+    size_t nchunks;
+    size_t *chunk_start;  // nchunks + 1 boundaries into lines
+    SortLine *splitters;  // nchunks - 1 keys bounding the merge partitions
+} ParSort;
+
+typedef struct ParTask {
+    ParSort *ps;
+    size_t index;         // Chunk or partition number
+} ParTask;
+
+static void sort_chunk(void *arg) {
+    ParTask *task = arg;
+    ParSort *ps = task->ps;
+    size_t start = ps->chunk_start[task->index];
+    qsort_r(ps->lines + start, ps->chunk_start[task->index + 1] - start,
+            sizeof(SortLine), line_compare, &ps->ctx);
+}
+
+// First index in lines[lo, hi) not ordered before key
+static size_t lower_bound(const ParSort *ps, size_t lo, size_t hi, const SortLine *key) {
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (line_compare(&ps->lines[mid], key, (void *)&ps->ctx) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Merge one key range of every chunk into its place in the output
+ * Partition p holds keys in [splitter p-1, splitter p); its output
+ * offset is the number of lines below splitter p-1 across all chunks
+ */
+static void merge_partition(void *arg) {
+    ParTask *task = arg;
+    ParSort *ps = task->ps;
+    size_t p = task->index;
+    MergeSrc srcs[ps->nchunks];
+    size_t out_off = 0;
+
+    for (size_t c = 0; c < ps->nchunks; c++) {
+        size_t lo = ps->chunk_start[c], hi = ps->chunk_start[c + 1];
+        size_t from = p > 0 ? lower_bound(ps, lo, hi, &ps->splitters[p - 1]) : lo;
+        size_t to = p + 1 < ps->nchunks ? lower_bound(ps, lo, hi, &ps->splitters[p]) : hi;
+        srcs[c].cur = ps->lines + from;
+        srcs[c].end = ps->lines + to;
+        out_off += from - lo;
+    }
+    merge_runs(srcs, ps->nchunks, ps->out + out_off, &ps->ctx);
+}
+
+/* Sort a batch, in parallel when it is large
+ * The pool is created by the first batch that is large enough to use it,
+ * so small sorts never start threads.
+ * Return: the sorted array (lines itself or a new array that replaces it)
+ */
+static SortLine *sort_batch(SortLine *lines, size_t n, const SortCtx *ctx, WorkPool **poolp) {
+    if (n >= SORT_PARALLEL_MIN && *poolp == NULL) *poolp = workpool_create(0);
+    WorkPool *pool = *poolp;
+    size_t nchunks = pool ? pool->nworkers : 1;
+    if (n < SORT_PARALLEL_MIN || nchunks < 2) {
+        qsort_r(lines, n, sizeof(SortLine), line_compare, (void *)ctx);
+        return lines;
+    }
+
+    ParSort ps = {*ctx, lines, malloc(n * sizeof(SortLine)), nchunks,
+                  malloc((nchunks + 1) * sizeof(size_t)),
+                  malloc(nchunks * nchunks * sizeof(SortLine))};
+    ParTask *tasks = malloc(nchunks * sizeof(ParTask));
+    if (!ps.out || !ps.chunk_start || !ps.splitters || !tasks) {
+        free(ps.out);
+        free(ps.chunk_start);
+        free(ps.splitters);
+        free(tasks);
+        qsort_r(lines, n, sizeof(SortLine), line_compare, (void *)ctx);
+        return lines;
+    }
+
+    // Sort equal-sized chunks independently
+    for (size_t c = 0; c <= nchunks; c++) {
+        ps.chunk_start[c] = n * c / nchunks;
+    }
+    for (size_t c = 0; c < nchunks; c++) {
+        tasks[c] = (ParTask){&ps, c};
+        workpool_submit(pool, sort_chunk, &tasks[c]);
+    }
+    workpool_wait(pool);
+
+    // Pick splitters from evenly spaced samples of every chunk
+    size_t nsamples = 0;
+    for (size_t c = 0; c < nchunks; c++) {
+        size_t lo = ps.chunk_start[c], len = ps.chunk_start[c + 1] - lo;
+        for (size_t s = 0; s < nchunks; s++) {
+            ps.splitters[nsamples++] = lines[lo + len * s / nchunks];
+        }
+    }
+    qsort_r(ps.splitters, nsamples, sizeof(SortLine), line_compare, (void *)ctx);
+    for (size_t p = 1; p < nchunks; p++) {
+        ps.splitters[p - 1] = ps.splitters[p * nchunks];
+    }
+
+    // Merge each key range of all chunks concurrently
+    for (size_t p = 0; p < nchunks; p++) {
+        workpool_submit(pool, merge_partition, &tasks[p]);
+    }
+    workpool_wait(pool);
+
+    free(ps.chunk_start);
+    free(ps.splitters);
+    free(tasks);
+    free(lines);
+    return ps.out;
+}
+
+// ===== Output and spilling =====
+
+// Display sorted lines, dropping repeated keys with -u
+static void emit_sorted(const SortLine *lines, size_t n, const SortCtx *ctx) {
+    for (size_t i = 0; i < n; i++) {
+        const SortLine *l = &lines[i];
+        if (ctx->opts->unique && i > 0 &&
+            key_compare(ctx->opts, ctx->base + lines[i - 1].off, lines[i - 1].len, lines[i - 1].num,
+                        ctx->base + l->off, l->len, l->num) == 0) {
+            continue;
+        }
+        display_bytes(ctx->base + l->off, l->len);
+        display_bytes("\n", 1);
+    }
+}
+
+// Write a sorted batch to an unlinked temp file; returns its fd or -1
+static int spill_run(const SortLine *lines, size_t n, const SortCtx *ctx) {
+    const char *dir = getenv("TMPDIR");
+    StrBuf path = STRBUF_INIT;
+    strbuf_append(&path, dir ? dir : "/tmp", strlen(dir ? dir : "/tmp"));
+    strbuf_append(&path, "/mysh-sortXXXXXX", 16);
+    if (path.data == NULL) return -1;
+
+    int fd = mkostemp(path.data, O_CLOEXEC);
+    if (fd != -1) unlink(path.data);
+    strbuf_free(&path);
+    if (fd == -1) return -1;
+
+    char *buf = malloc(SORT_SPILL_BUF);
+    size_t used = 0;
+    int err = buf == NULL;
+    for (size_t i = 0; i < n && !err; i++) {
+        const char *line = ctx->base + lines[i].off;
+        size_t len = lines[i].len + 1;  // Include the newline
+        if (used + len > SORT_SPILL_BUF || i + 1 == n) {
+            if (used + len <= SORT_SPILL_BUF) {
+                memcpy(buf + used, line, len);
+                used += len;
+                len = 0;
+            }
+            for (size_t off = 0; off < used && !err; ) {
+                ssize_t w = write(fd, buf + off, used - off);
+                if (w == -1 && errno != EINTR) err = 1;
+                if (w > 0) off += w;
+            }
+            used = 0;
+            for (size_t off = 0; off < len && !err; ) {
+                // Line larger than the buffer (or the last line): write directly
+                ssize_t w = write(fd, line + off, len - off);
+                if (w == -1 && errno != EINTR) err = 1;
+                if (w > 0) off += w;
+            }
+            continue;
+        }
+        memcpy(buf + used, line, len);
+        used += len;
+    }
+    free(buf);
+
+    if (err || lseek(fd, 0, SEEK_SET) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// A spilled run being merged
+typedef struct RunSrc {
+    LineReader reader;
+    char *line;       // Current line (owned by reader)
+    size_t len;
+    double num;
+} RunSrc;
+
+// Runs are spilled in input order, so ties go to the earlier run
+static int run_compare(const RunSrc *a, const RunSrc *b, const SortOpts *opts) {
+    int c = full_compare(opts, a->line, a->len, a->num, b->line, b->len, b->num);
+    return c != 0 ? c : (a > b) - (a < b);
+}
+
+static int run_advance(RunSrc *run, const SortOpts *opts) {
+    ssize_t len = read_line(&run->reader, &run->line);
+    if (len < 0) return 0;
+    run->len = len;
+    if (opts->numeric) run->num = line_num(opts, run->line, run->len);
+    return 1;
+}
+
+static void run_heap_down(size_t *heap, size_t n, size_t i, RunSrc *runs, const SortOpts *opts) {
+    while (1) {
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < n && run_compare(&runs[heap[l]], &runs[heap[m]], opts) < 0) m = l;
+        if (r < n && run_compare(&runs[heap[r]], &runs[heap[m]], opts) < 0) m = r;
+        if (m == i) return;
+        size_t t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+// Merge spilled runs from disk and display them
+static int merge_spilled(int *run_fds, size_t nruns, const SortOpts *opts) {
+    RunSrc *runs = calloc(nruns, sizeof(RunSrc));
+    size_t *heap = malloc(nruns * sizeof(size_t));
+    if (runs == NULL || heap == NULL) {
+        free(runs);
+        free(heap);
+        return -1;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < nruns; i++) {
+        runs[i].reader = (LineReader)LINE_READER_INIT(run_fds[i]);
+        if (run_advance(&runs[i], opts)) heap[n++] = i;
+    }
+    for (size_t i = n; i-- > 0; ) run_heap_down(heap, n, i, runs, opts);
+
+    StrBuf prev = STRBUF_INIT;
+    double prev_num = 0;
+    int have_prev = 0;
+    while (n > 0) {
+        RunSrc *top = &runs[heap[0]];
+        if (!opts->unique || !have_prev ||
+            key_compare(opts, prev.data, prev.len, prev_num, top->line, top->len, top->num) != 0) {
+            display_bytes(top->line, top->len);
+            display_bytes("\n", 1);
+            if (opts->unique) {
+                strbuf_reset(&prev);
+                strbuf_append(&prev, top->line, top->len);
+                prev_num = top->num;
+                have_prev = 1;
+            }
+        }
+        if (!run_advance(top, opts)) heap[0] = heap[--n];
+        run_heap_down(heap, n, 0, runs, opts);
+    }
+
+    strbuf_free(&prev);
+    for (size_t i = 0; i < nruns; i++) free(runs[i].reader.buf);
+    free(runs);
+    free(heap);
+    return 0;
+}
+
+// ===== Driver =====
+
+// Index the complete lines in buf[0, len) (every line ends in '\n')
+static SortLine *index_lines(const char *buf, size_t len, const SortOpts *opts, size_t *count) {
+    size_t cap = 1024, n = 0;
+    SortLine *lines = malloc(cap * sizeof(SortLine));
+    for (size_t pos = 0; lines != NULL && pos < len; ) {
+        const char *nl = memchr(buf + pos, '\n', len - pos);
+        size_t end = nl - buf;
+        if (n == cap) {
+            SortLine *grown = realloc(lines, cap * 2 * sizeof(SortLine));
+            if (grown == NULL) {
+                free(lines);
+                return NULL;
+            }
+            lines = grown;
+            cap *= 2;
+        }
+        lines[n].off = pos;
+        lines[n].len = end - pos;
+        lines[n].num = opts->numeric ? line_num(opts, buf + pos, end - pos) : 0;
+        n++;
+        pos = end + 1;
+    }
+    *count = n;
+    return lines;
+}
+
+/**
+ * Sorts the lines of several inputs together and displays them
+ */
+int sort_fds(const int *fds, size_t nfds, const SortOpts *opts) {
+    size_t budget = opts->mem_budget ? opts->mem_budget : SORT_DEFAULT_BUDGET;
+    size_t cap = budget < SORT_INITIAL_BUF ? budget : SORT_INITIAL_BUF;
+    char *buf = malloc(cap + 1);
+    if (buf == NULL) return -1;
+
+    WorkPool *pool = NULL;
+    int *runs = NULL;
+    size_t nruns = 0;
+    size_t used = 0;   // Bytes in buf; buf[0, complete) is whole lines
+    int err = 0;
+
+    for (size_t f = 0; f <= nfds && !err; f++) {
+        int at_end = (f == nfds);
+        while (!at_end && !err) {
+            if (used == cap && cap < budget) {
+                // Grow towards the budget before spilling anything
+                size_t want = cap * 2 < budget ? cap * 2 : budget;
+                char *grown = realloc(buf, want + 1);
+                if (grown == NULL) {
+                    err = 1;
+                    break;
+                }
+                buf = grown;
+                cap = want;
+            } else if (used == cap) {
+                // Budget reached: spill the complete lines as a sorted run
+                const char *last_nl = memrchr(buf, '\n', used);
+                if (last_nl == NULL) {
+                    // A single line longer than the budget: make room for it
+                    char *grown = realloc(buf, cap * 2 + 1);
+                    if (grown == NULL) {
+                        err = 1;
+                        break;
+                    }
+                    buf = grown;
+                    cap *= 2;
+                    continue;
+                }
+                size_t complete = last_nl - buf + 1, n = 0;
+                SortLine *lines = index_lines(buf, complete, opts, &n);
+                SortCtx ctx = {opts, buf};
+                int *grown = realloc(runs, (nruns + 1) * sizeof(int));
+                if (lines == NULL || grown == NULL) {
+                    free(lines);
+                    if (grown) runs = grown;
+                    err = 1;
+                    break;
+                }
+                runs = grown;
+                lines = sort_batch(lines, n, &ctx, &pool);
+                runs[nruns] = spill_run(lines, n, &ctx);
+                free(lines);
+                if (runs[nruns] == -1) {
+                    err = 1;
+                    break;
+                }
+                nruns++;
+                memmove(buf, buf + complete, used - complete);
+                used -= complete;
+            }
+
+            ssize_t r = read(fds[f], buf + used, cap - used);
+            if (r == -1) {
+                if (errno == EINTR) continue;
+                err = 1;
+            } else if (r == 0) {
+                break;
+            } else {
+                used += r;
+            }
+        }
+        // Each input ends a line, even without a trailing newline
+        if (used > 0 && buf[used - 1] != '\n') {
+            buf[used++] = '\n';  // buf has one spare byte past cap
+            if (used > cap) {
+                char *grown = realloc(buf, cap * 2 + 1);
+                if (grown == NULL) {
+                    err = 1;
+                    break;
+                }
+                buf = grown;
+                cap *= 2;
+            }
+        }
+    }
+
+    if (!err) {
+        size_t n = 0;
+        SortLine *lines = index_lines(buf, used, opts, &n);
+        SortCtx ctx = {opts, buf};
+        if (lines == NULL) {
+            err = 1;
+        } else {
+            lines = sort_batch(lines, n, &ctx, &pool);
+            if (nruns == 0) {
+                emit_sorted(lines, n, &ctx);
+            } else {
+                int *grown = realloc(runs, (nruns + 1) * sizeof(int));
+                if (grown != NULL) {
+                    runs = grown;
+                    runs[nruns] = spill_run(lines, n, &ctx);
+                    if (runs[nruns] != -1) nruns++;
+                    else err = 1;
+                } else {
+                    err = 1;
+                }
+                if (!err) err = merge_spilled(runs, nruns, opts) == -1;
+            }
+            free(lines);
+        }
+    }
+
+    for (size_t i = 0; i < nruns; i++) close(runs[i]);
+    free(runs);
+    free(buf);
+    workpool_destroy(pool);
+    return err ? -1 : 0;
+}
@@ -0,0 +1,33 @@
+#ifndef SORT_LINES_H
+#define SORT_LINES_H
+
+#include <stddef.h>   // For size_t
+
+// Input held in memory before sorted runs are spilled to temp files
+#define SORT_DEFAULT_BUDGET ((size_t)256 << 20)
+
+/**
+ * Options for the sort builtin
+ */
+typedef struct SortOpts {
+    int numeric;          // -n: compare leading numbers
+    int reverse;          // -r: reverse the order
+    int unique;           // -u: print one line per distinct key
+    int key_field;        // -k N: key starts at field N (1-based, 0 for whole line)
+    size_t mem_budget;    // -S: bytes of input held before spilling
+} SortOpts;
+
+/**
+ * Sorts the lines of several inputs together and displays them
+ * @param fds Descriptors to read, in order
+ * @param nfds Number of descriptors
+ * @param opts Sort options
+ * @return 0 on success, -1 on error
+ * Note: Lines live in one contiguous buffer indexed by an offset array.
+ *       Batches are sorted in parallel chunks joined by a parallel
+ *       multiway merge; input beyond mem_budget is spilled as sorted
+ *       runs to temp files in $TMPDIR (or /tmp) and merged at the end.
+ */
+int sort_fds(const int *fds, size_t nfds, const SortOpts *opts);
+
+#endif
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "source_cache.h"
+#include "io_helpers.h"
+#include "strbuf.h"
+#include "trace.h"
+
+// First bytes of an on-disk cache file; bump the digit when the encoding changes
+#define DISK_MAGIC "mysh-sc1"
+
+/**
+ * Identity and version of a sourced file
+ */
+typedef struct FileKey {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+} FileKey;
+
+typedef struct CacheEntry {
+    FileKey key;
+    Script *script;           // One reference held by the cache
+    struct CacheEntry *next;  // Next less recently sourced entry
+} CacheEntry;
+
+/**
+ * Header of an on-disk cache file, followed by the script_encode output
+ */
+typedef struct DiskHeader {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+} DiskHeader;
+
+static CacheEntry *entries = NULL;   // Most recently sourced first
+static size_t entry_count = 0;
+
+static size_t memory_hits = 0;
+static size_t disk_hits = 0;
+static size_t parses = 0;
+
+static FileKey key_of(const struct stat *st) {
+    FileKey key = {st->st_dev, st->st_ino, st->st_mtim, st->st_size};
+    return key;
+}
+
+static int same_file(const FileKey *a, const FileKey *b) {
+    return a->dev == b->dev && a->ino == b->ino;
+}
+
+static int same_version(const FileKey *a, const FileKey *b) {
+    return a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec &&
+           a->size == b->size;
+}
+
+static DiskHeader header_of(const FileKey *key) {
+    DiskHeader header;
+    memcpy(header.magic, DISK_MAGIC, sizeof(header.magic));
+    header.dev = key->dev;
+    header.ino = key->ino;
+    header.mtime_sec = key->mtime.tv_sec;
+    header.mtime_nsec = key->mtime.tv_nsec;
+    header.size = key->size;
+    return header;
+}
+
+/* Build the on-disk cache path of a file
+ * Return: 0 on success, -1 if it does not fit in buf
+ */
+static int disk_path(char *buf, size_t size, const char *dir, const FileKey *key) {
+    int n = snprintf(buf, size, "%s/%llu-%llu.msc", dir,
+                     (unsigned long long)key->dev, (unsigned long long)key->ino);
+    return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+// Return: the script cached on disk for key, or NULL if there is no valid one
+static Script *load_disk(const char *dir, const FileKey *key) {
+    char path[PATH_MAX];
+    if (disk_path(path, sizeof(path), dir, key) == -1) return NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    size_t len = 0;
+    char *data = read_fd(fd, &len);
+    close(fd);
+    if (data == NULL) return NULL;
+
+    Script *script = NULL;
+    DiskHeader header = header_of(key);
+    if (len >= sizeof(header) && memcmp(data, &header, sizeof(header)) == 0) {
+        script = script_decode(data + sizeof(header), len - sizeof(header));
+    }
+    free(data);
+    return script;
+}
+
+/* Write the cache file for key
+ * The file is written under a temporary name and renamed into place, so
+ * concurrent shells never read a partial one.
+ */
+static void save_disk(const char *dir, const FileKey *key, const Script *script) {
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    if (disk_path(path, sizeof(path), dir, key) == -1) return;
+    int n = snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if (n < 0 || (size_t)n >= sizeof(tmp)) return;
+
+    StrBuf out = STRBUF_INIT;
+    DiskHeader header = header_of(key);
+    if (strbuf_append(&out, (const char *)&header, sizeof(header)) == -1 ||
+        script_encode(script, &out) == -1) {
+        strbuf_free(&out);
+        return;
+    }
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd != -1) {
+        size_t off = 0;
+        while (off < out.len) {
+            ssize_t written = write(fd, out.data + off, out.len - off);
+            if (written <= 0) break;
+            off += written;
+        }
+        if (close(fd) == 0 && off == out.len && rename(tmp, path) == 0) {
+            strbuf_free(&out);
+            return;
+        }
+        unlink(tmp);
+    }
+    strbuf_free(&out);
+}
+
+/* Read and parse a script file
+ * Return: the parsed script, or NULL on error (reported); *key is set to
+ *         the version of the file that was read
+ */
+static Script *parse_file(const char *path, FileKey *key) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        display_error("ERROR: Cannot open file: ", path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) *key = key_of(&st);
+    size_t len = 0;
+    char *text = read_fd(fd, &len);
+    close(fd);
+    if (text == NULL) {
+        display_error("ERROR: Cannot read file: ", path);
+        return NULL;
+    }
+
+    int incomplete;
+    Script *script = script_parse(text, len, &incomplete);
+    if (script == NULL && incomplete) {
+        display_error("ERROR: Unexpected end of input: ", path);
+    }
+    free(text);
+    return script;
+}
+
+static void free_entry(CacheEntry *entry) {
+    script_release(entry->script);
+    free(entry);
+    entry_count--;
+}
+
+/**
+ * Looks up the parsed form of a script file
+ */
+Script *source_cache_get(const char *path, const char *disk_dir) {
+    uint64_t trace_start_ns = trace_now();
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        display_error("ERROR: Cannot open file: ", path);
+        return NULL;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        display_error("ERROR: Is a directory: ", path);
+        return NULL;
+    }
+    FileKey key = key_of(&st);
+
+    // Take the file's entry out of the list; it goes back at the front
+    CacheEntry *entry = NULL;
+    for (CacheEntry **link = &entries; *link != NULL; link = &(*link)->next) {
+        if (same_file(&(*link)->key, &key)) {
+            entry = *link;
+            *link = entry->next;
+            break;
+        }
+    }
+
+    if (entry != NULL && same_version(&entry->key, &key)) {
+        memory_hits++;
+        entry->next = entries;
+        entries = entry;
+        trace_event("source", trace_start_ns, "memory");
+        return entry->script;
+    }
+
+    const char *tier = "disk";
+    Script *script = disk_dir != NULL ? load_disk(disk_dir, &key) : NULL;
+    if (script != NULL) {
+        disk_hits++;
+    } else {
+        tier = "parse";
+        script = parse_file(path, &key);
+        if (script == NULL) {
+            if (entry != NULL) free_entry(entry);
+            return NULL;
+        }
+        parses++;
+        if (disk_dir != NULL) save_disk(disk_dir, &key, script);
+    }
+
+    if (entry == NULL) {
+        entry = malloc(sizeof(CacheEntry));
+        if (entry == NULL) {
+            display_error("ERROR: Out of memory", "");
+            script_release(script);
+            return NULL;
+        }
+        entry->script = NULL;
+        entry_count++;
+    }
+    script_release(entry->script);
+    entry->key = key;
+    entry->script = script;
+    entry->next = entries;
+    entries = entry;
+
+    // Evict the least recently sourced file
+    if (entry_count > SOURCE_CACHE_MAX) {
+        CacheEntry **link = &entries;
+        while ((*link)->next != NULL) link = &(*link)->next;
+        free_entry(*link);
+        *link = NULL;
+    }
+    trace_event("source", trace_start_ns, tier);
+    return script;
+}
+
+/**
+ * Displays the cache counters
+ */
+void source_cache_report(void) {
+    char line[160];
+    snprintf(line, sizeof(line), "source cache: %zu memory hits, %zu disk hits, %zu parsed, %zu files cached\n",
+             memory_hits, disk_hits, parses, entry_count);
+    display_message(line);
+}
+
+/**
+ * Drops every cached script
+ */
+void source_cache_clear(void) {
+    while (entries != NULL) {
+        CacheEntry *entry = entries;
+        entries = entry->next;
+        free_entry(entry);
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef SOURCE_CACHE_H
+#define SOURCE_CACHE_H
+
+#include "script.h"
+
+// Shell variable naming the directory of the on-disk cache (unset: memory only)
+#define SOURCE_CACHE_DIR_VAR "SOURCE_CACHE_DIR"
+// Files whose parsed form is kept in memory; the least recently sourced goes first
+#define SOURCE_CACHE_MAX 64
+
+/**
+ * Looks up the parsed form of a script file, parsing it on a miss
+ * @param path Script file to source
+ * @param disk_dir Directory of the on-disk cache, or NULL for memory only
+ * @return Parsed script owned by the cache (valid until the next call),
+ *         or NULL on error (already reported)
+ * Note: Entries are keyed by device and inode and checked against the
+ *       file's mtime and size, so a hit costs one stat() and nothing is
+ *       read or parsed. On a memory miss, disk_dir/<dev>-<ino>.msc is
+ *       tried before parsing and rewritten after; failures to use the
+ *       disk cache are silent and fall back to parsing.
+ */
+Script *source_cache_get(const char *path, const char *disk_dir);
+
+/**
+ * Displays how many sources each tier of the cache served
+ */
+void source_cache_report(void);
+
+/**
+ * Drops every cached script
+ */
+void source_cache_clear(void);
+
+#endif
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <string.h>
+#include "strbuf.h"
+
+// Smallest allocation made for a non-empty buffer
+#define STRBUF_MIN_CAP 64
+
+/**
+ * Ensures room for at least extra more bytes plus a terminator
+ * Note: Capacity doubles so a sequence of appends is linear overall
+ */
+int strbuf_reserve(StrBuf *sb, size_t extra) {
+    if (sb->len + extra + 1 <= sb->cap) return 0;
+
+    size_t new_cap = sb->cap ? sb->cap : STRBUF_MIN_CAP;
+    while (new_cap < sb->len + extra + 1) {
+        new_cap *= 2;
+    }
+
+    char *data = realloc(sb->data, new_cap);
+    if (data == NULL) return -1;
+    sb->data = data;
+    sb->cap = new_cap;
+    return 0;
+}
+
+/**
+ * Appends len bytes of str to the buffer
+ */
+int strbuf_append(StrBuf *sb, const char *str, size_t len) {
+    if (strbuf_reserve(sb, len) == -1) return -1;
+    memcpy(sb->data + sb->len, str, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+    return 0;
+}
+
+/**
+ * Appends a single character to the buffer
+ */
+int strbuf_appendc(StrBuf *sb, char c) {
+    if (strbuf_reserve(sb, 1) == -1) return -1;
+    sb->data[sb->len++] = c;
+    sb->data[sb->len] = '\0';
+    return 0;
+}
+
+/**
+ * Empties the buffer but keeps its allocation for reuse
+ */
+void strbuf_reset(StrBuf *sb) {
+    sb->len = 0;
+    if (sb->data) sb->data[0] = '\0';
+}
+
+/**
+ * Transfers ownership of the contents to the caller and empties the buffer
+ * Note: Returns an empty allocated string if nothing was appended
+ */
+char *strbuf_detach(StrBuf *sb) {
+    if (strbuf_reserve(sb, 0) == -1) return NULL;
+    char *data = sb->data;
+    data[sb->len] = '\0';
+    sb->data = NULL;
+    sb->len = 0;
+    sb->cap = 0;
+    return data;
+}
+
+/**
+ * Frees the buffer's allocation
+ */
+void strbuf_free(StrBuf *sb) {
+    free(sb->data);
+    sb->data = NULL;
+    sb->len = 0;
+    sb->cap = 0;
+}
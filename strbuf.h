@@ -0,0 +1,54 @@
+#ifndef STRBUF_H
+#define STRBUF_H
+
+#include <stddef.h>  // For size_t
+
+/**
+ * Growable, length-tracked string buffer
+ * data is always NULL terminated once anything has been appended
+ */
+typedef struct StrBuf {
+    char *data;     // Buffer contents (NULL until first append)
+    size_t len;     // Bytes currently used, excluding the terminator
+    size_t cap;     // Bytes allocated
+} StrBuf;
+
+#define STRBUF_INIT {NULL, 0, 0}
+
+/**
+ * Ensures room for at least extra more bytes plus a terminator
+ * @param sb Buffer to grow
+ * @param extra Number of bytes about to be appended
+ * @return 0 on success, -1 on allocation failure
+ */
+int strbuf_reserve(StrBuf *sb, size_t extra);
+
+/**
+ * Appends len bytes of str to the buffer
+ * @return 0 on success, -1 on allocation failure
+ */
+int strbuf_append(StrBuf *sb, const char *str, size_t len);
+
+/**
+ * Appends a single character to the buffer
+ * @return 0 on success, -1 on allocation failure
+ */
+int strbuf_appendc(StrBuf *sb, char c);
+
+/**
+ * Empties the buffer but keeps its allocation for reuse
+ */
+void strbuf_reset(StrBuf *sb);
+
+/**
+ * Transfers ownership of the contents to the caller and empties the buffer
+ * @return NULL terminated string (must be freed by caller)
+ */
+char *strbuf_detach(StrBuf *sb);
+
+/**
+ * Frees the buffer's allocation
+ */
+void strbuf_free(StrBuf *sb);
+
+#endif
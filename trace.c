@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "trace.h"
+
+// One recorded event
+typedef struct TraceEvent {
+    _Atomic uint64_t seq;     // Event index + 1 once the slot is complete
+    uint64_t ts;              // Start time (CLOCK_MONOTONIC ns)
+    uint64_t dur;             // Duration in ns, or UINT64_MAX for an instant
+    const char *name;         // Static event name
+    int32_t pid;
+    int32_t tid;
+    char detail[TRACE_DETAIL_LEN];
+} TraceEvent;
+
+// Ring buffer shared with forked children
+typedef struct TraceRing {
+    _Atomic uint64_t next;    // Index of the next event to write
+    uint64_t origin;          // Time tracing started; JSON timestamps are relative
+    TraceEvent events[TRACE_RING_EVENTS];
+} TraceRing;
+
+// Mapped on first use and kept, so a late writer never touches freed memory
+static TraceRing *ring = NULL;
+static atomic_int enabled = 0;
+static char *trace_path = NULL;
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Starts recording events
+ */
+int trace_start(const char *path) {
+    if (ring == NULL) {
+        void *mem = mmap(NULL, sizeof(TraceRing), PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return -1;
+        ring = mem;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL) return -1;
+
+    // Discard any previous session
+    atomic_store(&enabled, 0);
+    free(trace_path);
+    trace_path = copy;
+    for (size_t i = 0; i < TRACE_RING_EVENTS; i++) {
+        atomic_store_explicit(&ring->events[i].seq, 0, memory_order_relaxed);
+    }
+    atomic_store(&ring->next, 0);
+    ring->origin = clock_ns();
+    atomic_store(&enabled, 1);
+    return 0;
+}
+
+/**
+ * Returns whether tracing is on
+ */
+int trace_active(void) {
+    return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+/**
+ * Returns a timestamp for trace_event, or 0 when tracing is off
+ */
+uint64_t trace_now(void) {
+    return trace_active() ? clock_ns() : 0;
+}
+
+// Claim a slot and fill it; seq is published last so readers skip partial slots
+static void record(const char *name, uint64_t ts, uint64_t dur, const char *detail) {
+    // The cached tid is only valid in the process that cached it: a forked
+    // pipeline stage inherits the parent's value
+    static __thread int32_t tid = 0;
+    static __thread pid_t tid_pid = 0;
+    pid_t pid = getpid();
+    if (tid_pid != pid) {
+        tid = gettid();
+        tid_pid = pid;
+    }
+
+    uint64_t index = atomic_fetch_add_explicit(&ring->next, 1, memory_order_relaxed);
+    TraceEvent *ev = &ring->events[index & (TRACE_RING_EVENTS - 1)];
+    atomic_store_explicit(&ev->seq, 0, memory_order_relaxed);
+    ev->ts = ts;
+    ev->dur = dur;
+    ev->name = name;
+    ev->pid = pid;
+    ev->tid = tid;
+    ev->detail[0] = '\0';
+    if (detail != NULL) {
+        strncpy(ev->detail, detail, TRACE_DETAIL_LEN - 1);
+        ev->detail[TRACE_DETAIL_LEN - 1] = '\0';
+    }
+    atomic_store_explicit(&ev->seq, index + 1, memory_order_release);
+}
+
+/**
+ * Records a complete event lasting from start until now
+ */
+void trace_event(const char *name, uint64_t start, const char *detail) {
+    if (start == 0 || !trace_active()) return;
+    record(name, start, clock_ns() - start, detail);
+}
+
+/**
+ * Records an instant event
+ */
+void trace_instant(const char *name, const char *detail) {
+    if (!trace_active()) return;
+    record(name, clock_ns(), UINT64_MAX, detail);
+}
+
+// Write s as the body of a JSON string
+static void json_escape(FILE *out, const char *s) {
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+}
+
+/**
+ * Stops recording and writes the buffered events
+ * Note: Only the last TRACE_RING_EVENTS events survive a long session.
+ */
+int trace_stop(void) {
+    if (!trace_active()) return 0;
+    atomic_store(&enabled, 0);
+
+    FILE *out = fopen(trace_path, "w");
+    if (out == NULL) return -1;
+
+    uint64_t end = atomic_load(&ring->next);
+    uint64_t begin = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0;
+    int first = 1;
+    fputs("{\"traceEvents\":[", out);
+    for (uint64_t i = begin; i < end; i++) {
+        TraceEvent *ev = &ring->events[i & (TRACE_RING_EVENTS - 1)];
+        if (atomic_load_explicit(&ev->seq, memory_order_acquire) != i + 1) continue;
+
+        fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,", first ? "" : ",",
+                ev->name, ev->dur == UINT64_MAX ? "i" : "X",
+                (int64_t)(ev->ts - ring->origin) / 1e3);
+        if (ev->dur == UINT64_MAX) {
+            fputs("\"s\":\"t\",", out);
+        } else {
+            fprintf(out, "\"dur\":%.3f,", ev->dur / 1e3);
+        }
+        fprintf(out, "\"pid\":%d,\"tid\":%d", ev->pid, ev->tid);
+        if (ev->detail[0] != '\0') {
+            fputs(",\"args\":{\"detail\":\"", out);
+            json_escape(out, ev->detail);
+            fputs("\"}", out);
+        }
+        fputc('}', out);
+        first = 0;
+    }
+    fputs("\n]}\n", out);
+    return fclose(out) == 0 ? 0 : -1;
+}
@@ -0,0 +1,52 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>   // For uint64_t
+
+// Events kept in the ring buffer; older ones are overwritten (power of two)
+#define TRACE_RING_EVENTS 65536
+// Bytes of per-event detail (e.g. a command name) kept, including the NUL
+#define TRACE_DETAIL_LEN 40
+
+/**
+ * Starts recording events
+ * @param path File the Chrome trace JSON is written to by trace_stop()
+ * @return 0 on success, -1 on error
+ * Note: The ring buffer lives in shared memory, so forked pipeline stages
+ *       record into it too. Recording is lock-free: writers claim a slot
+ *       with one atomic increment.
+ */
+int trace_start(const char *path);
+
+/**
+ * Stops recording and writes the buffered events as Chrome/Perfetto JSON
+ * @return 0 on success (or if tracing was off), -1 if the file can't be written
+ */
+int trace_stop(void);
+
+/**
+ * Return: 1 while tracing is on, 0 otherwise
+ */
+int trace_active(void);
+
+/**
+ * Return: timestamp to pass to trace_event, or 0 when tracing is off
+ */
+uint64_t trace_now(void);
+
+/**
+ * Records a complete event lasting from start until now
+ * @param name Event name (must be a string literal)
+ * @param start Value returned by trace_now(); nothing is recorded if 0
+ * @param detail Extra text shown with the event (copied, may be NULL)
+ */
+void trace_event(const char *name, uint64_t start, const char *detail);
+
+/**
+ * Records an instant event
+ * @param name Event name (must be a string literal)
+ * @param detail Extra text shown with the event (copied, may be NULL)
+ */
+void trace_instant(const char *name, const char *detail);
+
+#endif
@@ -4,153 +4,416 @@
 #include "variables.h"
 #include <ctype.h>
 #include "io_helpers.h"
-#define MAX_STR_LEN 128
+#include "strbuf.h"
+#include "arith.h"
+
+extern char **environ;
 
 // Global variable list (linked list head pointer)
 Variable *var_list = NULL;
 
+// Environment of child processes once anything is exported (NULL: environ)
+static char **env = NULL;
+static size_t env_count = 0;
+static size_t env_cap = 0;
+
+// Runs the command of a $(cmd) substitution; NULL leaves $( text as-is
+static CommandSubstFn command_subst = NULL;
+
+/**
+ * Installs the function that runs $(cmd) substitutions
+ * @param fn Substitution function, or NULL to disable substitution
+ */
+void set_command_substitution(CommandSubstFn fn) {
+    command_subst = fn;
+}
+
 /**
  * Creates a deep copy of a variable list
  * @param src Source variable list to copy
  * @return Newly allocated copy of the list
- * Note: Uses setVar() to ensure proper variable expansion in the copy
+ * Note: Values are copied verbatim; they were already expanded when set
  */
 Variable *copy_vars(Variable *src) {
     Variable *new_list = NULL;
-    Variable *curr = src;
+    Variable **tail = &new_list;
 
-    // Iterate through source list and copy each variable
-    while (curr != NULL) {
-        setVar(&new_list, curr->val, curr->title);
-        curr = curr->next;
+    // Iterate through source list and copy each variable, preserving order
+    for (Variable *curr = src; curr != NULL; curr = curr->next) {
+        Variable *node = malloc(sizeof(Variable));
+        if (node == NULL) break;
+        node->title = strdup(curr->title);
+        node->val = strdup(curr->val);
+        node->env_index = -1;   // Only the shell's own list is exported
+        node->next = NULL;
+        if (node->title == NULL || node->val == NULL) {
+            free(node->title);
+            free(node->val);
+            free(node);
+            break;
+        }
+        *tail = node;
+        tail = &node->next;
     }
     return new_list;
 }
 
 /**
- * Expands variables in a string (in-place version)
+ * Looks up a variable by a name that is not NULL terminated
+ * @param front Variable list head pointer
+ * @param name Start of the variable name
+ * @param len Length of the variable name
+ * @return The variable's node or NULL if not found
+ */
+Variable *find_var(Variable *front, const char *name, size_t len) {
+    for (Variable *curr = front; curr != NULL; curr = curr->next) {
+        if (strncmp(curr->title, name, len) == 0 && curr->title[len] == '\0') {
+            return curr;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Looks up a variable's value by a name that is not NULL terminated
+ * @return Value of variable or NULL if not found
+ */
+static char *getVarN(Variable *front, const char *name, size_t len) {
+    Variable *var = find_var(front, name, len);
+    return var ? var->val : NULL;
+}
+
+/**
+ * Finds the end of an arithmetic expansion
+ * @param expr Text just after the opening $((
+ * @param end End of the text
+ * @return Pointer to the closing )), or NULL if it is unterminated
+ */
+static const char *find_arith_end(const char *expr, const char *end) {
+    int depth = 0;
+    for (const char *p = expr; p < end; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')') {
+            if (depth == 0) return p + 1 < end && p[1] == ')' ? p : NULL;
+            depth--;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Checks whether c may appear in a variable name
+ */
+static int is_name_char(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+/**
+ * Finds the end of a command substitution
+ * @param cmd Text just after the opening $(
+ * @param end End of the text
+ * @return Pointer to the matching ), or NULL if it is unterminated
+ */
+static const char *find_subst_end(const char *cmd, const char *end) {
+    int depth = 0;
+    for (const char *p = cmd; p < end; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')') {
+            if (depth == 0) return p;
+            depth--;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Checks whether text contains a $(cmd) substitution (not $((expr)))
+ */
+static int contains_subst(const char *text, const char *end) {
+    for (const char *p = text; p + 1 < end; p++) {
+        if (p[0] == '$' && p[1] == '(' && (p + 2 >= end || p[2] != '(')) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Expands variables in a string, appending the result to a buffer
  * @param input String containing variables to expand
- * @param output Buffer to store expanded result
- * @param var_list Variable list to use for expansion
- * Note: Handles special cases like standalone $ and invalid variable names
+ * @param len Number of bytes of input to expand
+ * @param out Buffer the expanded result is appended to
+ * @param var_list Pointer to the variable list head pointer
+ * @return 0 on success, -1 on allocation failure, -2 if an arithmetic
+ *         expansion failed (already reported)
+ * Note: Literal runs are located with memchr and copied in one append,
+ *       so the cost is linear in the length of input plus output.
+ *       Supports $name, ${name}, $((expr)) and $(cmd); unknown variables
+ *       expand to nothing. Assignments inside $((expr)) update var_list.
+ *       A $ that does not start a valid reference is kept as-is.
  */
-void expand_variables(const char *input, char *output, Variable *var_list) {
+int expand_variables(const char *input, size_t len, StrBuf *out, Variable **var_list) {
     const char *src = input;
-    char *dest = output;
-    *dest = '\0'; // Initialize output as empty string
-
-    while (*src) {
-        if (*src == '$') {
-            // Check if this is a valid variable reference
-            if (src[1] == ' ' || src[1] == '\t' || src[1] == '\0') {
-                // Handle standalone $ character
-                *dest++ = *src++;
-                *dest = '\0';
-                continue;
-            }
+    const char *end = input + len;
 
-            src++; // Skip $
-            char var_name[MAX_STR_LEN] = {0};
-            int i = 0;
+    while (src < end) {
+        // Copy everything up to the next $ in one go
+        const char *dollar = memchr(src, '$', end - src);
+        if (dollar == NULL) {
+            return strbuf_append(out, src, end - src);
+        }
+        if (dollar > src && strbuf_append(out, src, dollar - src) == -1) {
+            return -1;
+        }
+        src = dollar + 1;
 
-            // Extract variable name (alphanumeric + underscore)
-            while (*src && (isalnum(*src) || *src == '_')) {
-                var_name[i++] = *src++;
+        if (end - src >= 2 && src[0] == '(' && src[1] == '(') {
+            // Arithmetic expansion: $((expr))
+            const char *close = find_arith_end(src + 2, end);
+            if (close == NULL) {
+                if (strbuf_appendc(out, '$') == -1) return -1;
+                continue;
             }
-            var_name[i] = '\0';
-
-            if (i > 0) {  // Valid variable name found
-                char *var_value = getVar(var_list, var_name);
-                if (var_value) {
-                    // Append variable value to output
-                    strncat(dest, var_value, MAX_STR_LEN - strlen(output) - 1);
-                    dest += strlen(var_value);
+            const char *expr = src + 2;
+            size_t expr_len = close - expr;
+            StrBuf inner = STRBUF_INIT;
+            if (command_subst != NULL && contains_subst(expr, close)) {
+                // Command substitutions inside are run before evaluating
+                int rc = expand_variables(expr, expr_len, &inner, var_list);
+                if (rc != 0) {
+                    strbuf_free(&inner);
+                    return rc;
                 }
-            } else {
-                // Invalid variable name, keep the $
-                *dest++ = '$';
-                *dest = '\0';
+                expr = inner.data;
+                expr_len = inner.len;
             }
+            int64_t value;
+            int rc = arith_eval(expr, expr_len, var_list, &value);
+            strbuf_free(&inner);
+            if (rc == -1) return -2;
+            char num[ARITH_NUM_MAX];
+            size_t n = arith_format(value, num);
+            if (strbuf_append(out, num, n) == -1) return -1;
+            src = close + 2;
+            continue;
+        }
+
+        if (src < end && *src == '(' && command_subst != NULL) {
+            // Command substitution: $(cmd)
+            const char *close = find_subst_end(src + 1, end);
+            if (close == NULL) {
+                if (strbuf_appendc(out, '$') == -1) return -1;
+                continue;
+            }
+            if (command_subst(src + 1, close - (src + 1), out) == -1) return -1;
+            src = close + 1;
+            continue;
+        }
+
+        const char *name = src;
+        size_t name_len = 0;
+        if (src < end && *src == '{') {
+            // Braced reference: ${name}
+            name = src + 1;
+            const char *close = memchr(name, '}', end - name);
+            if (close == NULL) {
+                // Unterminated brace, keep the text literally
+                if (strbuf_appendc(out, '$') == -1) return -1;
+                continue;
+            }
+            name_len = close - name;
+            src = close + 1;
         } else {
-            // Copy regular characters
-            *dest++ = *src++;
-            *dest = '\0';
+            while (src < end && is_name_char(*src)) {
+                src++;
+            }
+            name_len = src - name;
+            if (name_len == 0) {
+                // Standalone or invalid reference, keep the $
+                if (strbuf_appendc(out, '$') == -1) return -1;
+                continue;
+            }
+        }
+
+        char *var_value = getVarN(*var_list, name, name_len);
+        if (var_value && strbuf_append(out, var_value, strlen(var_value)) == -1) {
+            return -1;
         }
     }
+    return 0;
 }
 
 /**
  * Expands variables in a string (allocating version)
- * @param front Variable list head pointer
+ * @param front Pointer to the variable list head pointer
  * @param input String containing variables to expand
- * @return Newly allocated string with variables expanded
+ * @return Newly allocated string with variables expanded, or NULL on error
  * Note: Caller must free the returned string
  */
-char* expandVars(Variable *front, const char *input) {
-    char *output = malloc(MAX_STR_LEN);
-    if (output == NULL) return NULL;
-    output[0] = '\0'; // Initialize empty string
+char* expandVars(Variable **front, const char *input) {
+    StrBuf out = STRBUF_INIT;
+    if (expand_variables(input, strlen(input), &out, front) != 0) {
+        strbuf_free(&out);
+        return NULL;
+    }
+    return strbuf_detach(&out);
+}
+
+/**
+ * Rewrites the environment entry of an exported variable as name=value
+ * @param var Exported variable
+ * @return 0 on success, -1 on allocation failure (the old entry is kept)
+ */
+static int update_env_entry(Variable *var) {
+    size_t title_len = strlen(var->title);
+    size_t val_len = strlen(var->val);
+    char *entry = malloc(title_len + val_len + 2);
+    if (entry == NULL) return -1;
+    memcpy(entry, var->title, title_len);
+    entry[title_len] = '=';
+    memcpy(entry + title_len + 1, var->val, val_len + 1);
+    free(env[var->env_index]);
+    env[var->env_index] = entry;
 
-    for (size_t i = 0; input[i] != '\0'; i++) {
-        if (input[i] == '$') {
-            // Handle special case: $ followed by space
-            if (input[i+1] == ' ' || input[i+1] == '\t' || input[i+1] == '\0') {
-                strncat(output, "$", MAX_STR_LEN - strlen(output) - 1);
-                continue;
-            }
+    // execvpe searches the shell's own PATH
+    if (strcmp(var->title, "PATH") == 0) setenv("PATH", var->val, 1);
+    return 0;
+}
 
-            i++;  // Skip $
-            char var_name[MAX_STR_LEN] = {0};
-            size_t var_name_len = 0;
+/**
+ * Copies the inherited environment so entries can be replaced and added
+ * @return 0 on success, -1 on allocation failure
+ */
+static int init_env(void) {
+    size_t count = 0;
+    while (environ[count] != NULL) count++;
+    env_cap = count + 16;
+    env = malloc(env_cap * sizeof(char *));
+    if (env == NULL) return -1;
+    for (env_count = 0; env_count < count; env_count++) {
+        env[env_count] = strdup(environ[env_count]);
+        if (env[env_count] == NULL) {
+            free_environ();
+            return -1;
+        }
+    }
+    env[env_count] = NULL;
+    return 0;
+}
 
-            // Extract variable name
-            while (input[i] != '\0' && (isalnum(input[i]) || input[i] == '_')) {
-                var_name[var_name_len++] = input[i++];
-            }
-            var_name[var_name_len] = '\0';
-            i--;  // Adjust position after extraction
-
-            // Look up and expand variable
-            char *var_value = getVar(front, var_name);
-            if (var_value) {
-                strncat(output, var_value, MAX_STR_LEN - strlen(output) - 1);
-            } else {
-                // Variable not found, keep original syntax
-                strncat(output, "$", MAX_STR_LEN - strlen(output) - 1);
-                strncat(output, var_name, MAX_STR_LEN - strlen(output) - 1);
-            }
-        } else {
-            // Copy regular characters
-            size_t len = strlen(output);
-            if (len < MAX_STR_LEN - 1) {
-                output[len] = input[i];
-                output[len+1] = '\0';
+/**
+ * Finds or adds the environment slot of a name
+ * @param name Variable name
+ * @return Index of the slot, or -1 on allocation failure
+ */
+static long env_slot(const char *name) {
+    size_t len = strlen(name);
+    for (size_t i = 0; i < env_count; i++) {
+        if (strncmp(env[i], name, len) == 0 && env[i][len] == '=') return (long)i;
+    }
+    if (env_count + 1 == env_cap) {
+        char **grown = realloc(env, env_cap * 2 * sizeof(char *));
+        if (grown == NULL) return -1;
+        env = grown;
+        env_cap *= 2;
+    }
+    env[env_count] = NULL;
+    env[++env_count] = NULL;
+    return (long)env_count - 1;
+}
+
+/**
+ * Exports a variable to the environment of programs the shell runs
+ * @param front Pointer to the list head pointer
+ * @param title Name of the variable; if it is not set, it takes its
+ *        inherited environment value, or is created empty if it has none
+ * @return 0 on success, -1 on allocation failure
+ * Note: Only this call searches the environment; later changes rewrite
+ *       the variable's own slot.
+ */
+int export_var(Variable **front, const char *title) {
+    Variable *var = find_var(*front, title, strlen(title));
+    if (var == NULL) {
+        // An inherited variable keeps its value rather than becoming empty
+        size_t len = strlen(title);
+        const char *value = "";
+        for (char **entry = var_environ(); *entry != NULL; entry++) {
+            if (strncmp(*entry, title, len) == 0 && (*entry)[len] == '=') {
+                value = *entry + len + 1;
+                break;
             }
         }
+        set_var_verbatim(front, value, title);
+        var = find_var(*front, title, len);
+        if (var == NULL) return -1;
+    }
+    if (var->env_index >= 0) return 0;
+    if (env == NULL && init_env() == -1) return -1;
+
+    long slot = env_slot(title);
+    if (slot == -1) return -1;
+    var->env_index = slot;
+    if (update_env_entry(var) == -1) {
+        if (env[slot] == NULL) {
+            // Drop the slot that was just added
+            env_count--;
+        }
+        var->env_index = -1;
+        return -1;
     }
-    return output;
+    return 0;
 }
 
 /**
- * Sets or updates a variable in the list
+ * Return: the environment for programs the shell runs
+ */
+char **var_environ(void) {
+    return env != NULL ? env : environ;
+}
+
+/**
+ * Frees the environment built by export_var
+ */
+void free_environ(void) {
+    for (size_t i = 0; i < env_count; i++) {
+        free(env[i]);
+    }
+    free(env);
+    env = NULL;
+    env_count = 0;
+    env_cap = 0;
+}
+
+/**
+ * Overwrites a variable's value in its existing storage
+ * @param var Variable to update
+ * @param value New value (already expanded)
+ * @param len Length of value
+ * @return 0 on success, -1 if value does not fit
+ */
+int overwrite_var(Variable *var, const char *value, size_t len) {
+    if (strlen(var->val) < len) return -1;
+    memcpy(var->val, value, len);
+    var->val[len] = '\0';
+    if (var->env_index >= 0) update_env_entry(var);
+    return 0;
+}
+
+/**
+ * Stores a value in a variable, creating the variable if needed
  * @param front Pointer to the list head pointer
- * @param input Variable value (may contain other variables to expand)
+ * @param value Allocated value; ownership passes to the list
  * @param newtitle Variable name
- * Note: Handles memory allocation and variable expansion
  */
-void setVar(Variable **front, const char *input, const char *newtitle) {
-    // First expand any variables in the input value
-    char *expanded_value = expandVars(*front, input);
-    if (!expanded_value) return;
-
+static void store_var(Variable **front, char *value, const char *newtitle) {
     // Check if variable already exists
     Variable *curr = *front;
     while (curr != NULL) {
         if (strcmp(curr->title, newtitle) == 0) {
             // Update existing variable
             free(curr->val);
-            curr->val = strdup(expanded_value);
-            free(expanded_value);
+            curr->val = value;
+            if (curr->env_index >= 0) update_env_entry(curr);
             return;
         }
         curr = curr->next;
@@ -159,14 +422,14 @@ void setVar(Variable **front, const char *input, const char *newtitle) {
     // Create new variable node
     Variable *node = (Variable *)malloc(sizeof(Variable));
     if (node == NULL) {
-        free(expanded_value);
+        free(value);
         return;
     }
 
     // Initialize new node
     node->title = strdup(newtitle);
-    node->val = strdup(expanded_value);
-    free(expanded_value);
+    node->val = value;
+    node->env_index = -1;
 
     // Check for allocation errors
     if (node->title == NULL || node->val == NULL) {
@@ -181,6 +444,32 @@ void setVar(Variable **front, const char *input, const char *newtitle) {
     *front = node;
 }
 
+/**
+ * Sets or updates a variable in the list
+ * @param front Pointer to the list head pointer
+ * @param input Variable value (may contain other variables to expand)
+ * @param newtitle Variable name
+ * Note: Handles memory allocation and variable expansion
+ */
+void setVar(Variable **front, const char *input, const char *newtitle) {
+    // First expand any variables in the input value
+    char *expanded_value = expandVars(front, input);
+    if (!expanded_value) return;
+    store_var(front, expanded_value, newtitle);
+}
+
+/**
+ * Sets or updates a variable without expanding its value
+ * @param front Pointer to the list head pointer
+ * @param value Value to store as-is (already expanded)
+ * @param title Variable name
+ */
+void set_var_verbatim(Variable **front, const char *value, const char *title) {
+    char *copy = strdup(value);
+    if (copy == NULL) return;
+    store_var(front, copy, title);
+}
+
 /**
  * Gets the value of a variable
  * @param front Variable list head pointer
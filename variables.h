@@ -3,6 +3,7 @@
 
 #include <stdlib.h>  // For size_t, malloc, free
 #include <string.h>  // For string manipulation functions
+#include "strbuf.h"  // For StrBuf
 
 // Maximum length for strings stored in variables
 #define MAX_STR_LEN 128
@@ -14,6 +15,7 @@
 typedef struct Variable {
     char *title;            // Name of the variable
     char *val;             // Value of the variable
+    long env_index;         // Slot in the exported environment, or -1
     struct Variable *next;  // Pointer to next variable in list
 } Variable;
 
@@ -24,6 +26,15 @@ typedef struct Variable {
  */
 Variable *copy_vars(Variable *src);
 
+/**
+ * Looks up a variable by a name that is not NULL terminated
+ * @param front Variable list head pointer
+ * @param name Start of the variable name
+ * @param len Length of the variable name
+ * @return The variable's node or NULL if not found
+ */
+Variable *find_var(Variable *front, const char *name, size_t len);
+
 /**
  * Sets or updates a variable in the list
  * @param front Pointer to the list head pointer
@@ -32,6 +43,47 @@ Variable *copy_vars(Variable *src);
  */
 void setVar(Variable **front, const char *input, const char *newtitle);
 
+/**
+ * Sets or updates a variable without expanding its value
+ * @param front Pointer to the list head pointer
+ * @param value Value to store as-is (already expanded)
+ * @param title Name of the variable to set/update
+ */
+void set_var_verbatim(Variable **front, const char *value, const char *title);
+
+/**
+ * Overwrites a variable's value in its existing storage
+ * @param var Variable to update
+ * @param value New value (already expanded)
+ * @param len Length of value
+ * @return 0 on success, -1 if value is longer than the current value
+ *         (nothing is changed; use set_var_verbatim)
+ */
+int overwrite_var(Variable *var, const char *value, size_t len);
+
+/**
+ * Exports a variable to the environment of programs the shell runs
+ * @param front Pointer to the list head pointer
+ * @param title Name of the variable; if it is not set, it takes its
+ *        inherited environment value, or is created empty if it has none
+ * @return 0 on success, -1 on allocation failure
+ * Note: Later changes to the variable update its environment entry
+ */
+int export_var(Variable **front, const char *title);
+
+/**
+ * Return: NULL terminated environment for programs the shell runs: the
+ *         inherited one with exported variables added or replaced
+ * Note: The array is maintained as exported variables change, so it can
+ *       be passed to execve as-is; it is valid until the next change.
+ */
+char **var_environ(void);
+
+/**
+ * Frees the environment built by export_var
+ */
+void free_environ(void);
+
 /**
  * Retrieves a variable's value
  * @param front Variable list head pointer
@@ -47,19 +99,37 @@ char *getVar(Variable *front, const char *title);
 void freeVars(Variable *front);
 
 /**
- * Expands variables in a string (in-place version)
+ * Runs the command text of a $(cmd) substitution
+ * @param cmd Command text (not NULL terminated)
+ * @param len Number of bytes of cmd
+ * @param out Buffer the command's output is appended to
+ * @return 0 on success (even if the command failed), -1 on allocation failure
+ */
+typedef int (*CommandSubstFn)(const char *cmd, size_t len, StrBuf *out);
+
+/**
+ * Installs the function expand_variables uses for $(cmd)
+ * @param fn Substitution function, or NULL to keep $(cmd) text as-is
+ */
+void set_command_substitution(CommandSubstFn fn);
+
+/**
+ * Expands $name, ${name}, $((expr)) and $(cmd) references, appending the result to a buffer
  * @param input String containing variables to expand
- * @param output Buffer to store expanded result (must be at least MAX_STR_LEN)
- * @param var_list Variable list to use for expansion
+ * @param len Number of bytes of input to expand
+ * @param out Buffer the expanded result is appended to (no length limit)
+ * @param var_list Pointer to the variable list head pointer (arithmetic may assign)
+ * @return 0 on success, -1 on allocation failure, -2 if an arithmetic
+ *         expansion failed (already reported)
  */
-void expand_variables(const char *input, char *output, Variable *var_list);
+int expand_variables(const char *input, size_t len, StrBuf *out, Variable **var_list);
 
 /**
  * Expands variables in a string (allocating version)
- * @param front Variable list head pointer
+ * @param front Pointer to the variable list head pointer
  * @param input String containing variables to expand
  * @return Newly allocated string with variables expanded (must be freed by caller)
  */
-char *expandVars(Variable *front, const const char *input);
+char *expandVars(Variable **front, const char *input);
 
 #endif
@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wc_count.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WC_HAVE_X86 1
+#endif
+
+// Read size used when counting a stream
+#define WC_READ_SIZE (1 << 20)
+// Files smaller than this are counted on the calling thread
+#define WC_PARALLEL_MIN (16 << 20)
+// Smallest slice of a file handed to one thread
+#define WC_CHUNK_MIN (8 << 20)
+// Upper bound on counting threads per file
+#define WC_MAX_THREADS 64
+
+// Whitespace as defined by isspace() in the C locale
+static const unsigned char space_tab[256] = {
+    ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1, [' '] = 1
+};
+
+// Portable kernel; also finishes the tail the vector kernels leave
+static void count_scalar(const unsigned char *buf, size_t len, WcCounts *counts, int *in_word) {
+    uint64_t lines = 0;
+    uint64_t words = 0;
+    int word = *in_word;
+
+    for (size_t i = 0; i < len; i++) {
+        int space = space_tab[buf[i]];
+        lines += buf[i] == '\n';
+        words += !space && !word;
+        word = !space;
+    }
+
+    counts->lines += lines;
+    counts->words += words;
+    *in_word = word;
+}
+
+#ifdef WC_HAVE_X86
+/* Vector kernels: build a bitmask of whitespace bytes per block, then a
+ * word starts at every non-space byte whose predecessor is a space.
+ * The predecessor of a block's first byte is carried in prev_space.
+ * Return: number of bytes consumed (a multiple of the block size)
+ */
+__attribute__((target("sse2")))
+static size_t count_sse2(const unsigned char *buf, size_t len, WcCounts *counts, int *in_word) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i span = _mm_set1_epi8('\r' - '\t');
+    uint64_t lines = 0;
+    uint64_t words = 0;
+    unsigned prev_space = !*in_word;
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        // '\t'..'\r' is a contiguous range: (v - '\t') <= span, unsigned
+        __m128i off = _mm_sub_epi8(v, tab);
+        __m128i ctrl = _mm_cmpeq_epi8(_mm_min_epu8(off, span), off);
+        __m128i space = _mm_or_si128(ctrl, _mm_cmpeq_epi8(v, sp));
+
+        unsigned smask = (unsigned)_mm_movemask_epi8(space);
+        unsigned nmask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        unsigned starts = ~smask & 0xFFFFu & ((smask << 1) | prev_space);
+
+        lines += __builtin_popcount(nmask);
+        words += __builtin_popcount(starts);
+        prev_space = smask >> 15;
+    }
+
+    counts->lines += lines;
+    counts->words += words;
+    *in_word = !prev_space;
+    return i;
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t count_avx2(const unsigned char *buf, size_t len, WcCounts *counts, int *in_word) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i span = _mm256_set1_epi8('\r' - '\t');
+    uint64_t lines = 0;
+    uint64_t words = 0;
+    uint32_t prev_space = !*in_word;
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i off = _mm256_sub_epi8(v, tab);
+        __m256i ctrl = _mm256_cmpeq_epi8(_mm256_min_epu8(off, span), off);
+        __m256i space = _mm256_or_si256(ctrl, _mm256_cmpeq_epi8(v, sp));
+
+        uint32_t smask = (uint32_t)_mm256_movemask_epi8(space);
+        uint32_t nmask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        uint32_t starts = ~smask & ((smask << 1) | prev_space);
+
+        lines += __builtin_popcount(nmask);
+        words += __builtin_popcount(starts);
+        prev_space = smask >> 31;
+    }
+
+    counts->lines += lines;
+    counts->words += words;
+    *in_word = !prev_space;
+    return i;
+}
+#endif
+
+/**
+ * Adds the counts for buf to counts
+ * Note: Picks the widest kernel the CPU supports, then finishes the
+ *       remaining partial block with the scalar kernel
+ */
+void wc_count_buf(const unsigned char *buf, size_t len, WcCounts *counts, int *in_word) {
+    size_t done = 0;
+#ifdef WC_HAVE_X86
+    if (__builtin_cpu_supports("avx2")) {
+        done = count_avx2(buf, len, counts, in_word);
+    } else if (__builtin_cpu_supports("sse2")) {
+        done = count_sse2(buf, len, counts, in_word);
+    }
+#endif
+    count_scalar(buf + done, len - done, counts, in_word);
+    counts->bytes += len;
+}
+
+// One slice of a mapped file and its partial result
+typedef struct WcChunk {
+    const unsigned char *buf;  // Start of the slice
+    size_t len;                // Length of the slice
+    WcCounts counts;           // Counts assuming a space precedes the slice
+    int last_in_word;          // Whether the slice ends inside a word
+    pthread_t thread;          // Thread counting this slice
+} WcChunk;
+
+// Thread entry point: count one slice independently
+static void *count_chunk(void *arg) {
+    WcChunk *chunk = arg;
+    chunk->last_in_word = 0;
+    wc_count_buf(chunk->buf, chunk->len, &chunk->counts, &chunk->last_in_word);
+    return NULL;
+}
+
+/* Count a mapped file, splitting it across threads when it is large
+ * A word straddling two slices is counted by both, so one word is
+ * subtracted wherever a slice ending in a word meets one starting with one.
+ */
+static void count_mapped(const unsigned char *buf, size_t len, WcCounts *counts) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = len / WC_CHUNK_MIN;
+    if (cpus > 0 && nthreads > (size_t)cpus) nthreads = cpus;
+    if (nthreads > WC_MAX_THREADS) nthreads = WC_MAX_THREADS;
+
+    if (len < WC_PARALLEL_MIN || nthreads < 2) {
+        int in_word = 0;
+        wc_count_buf(buf, len, counts, &in_word);
+        return;
+    }
+
+    WcChunk chunks[WC_MAX_THREADS] = {0};
+    size_t slice = len / nthreads;
+    for (size_t i = 0; i < nthreads; i++) {
+        chunks[i].buf = buf + i * slice;
+        chunks[i].len = (i == nthreads - 1) ? len - i * slice : slice;
+    }
+
+    // Slice 0 runs on this thread; the others get their own
+    size_t started = 1;
+    while (started < nthreads &&
+           pthread_create(&chunks[started].thread, NULL, count_chunk, &chunks[started]) == 0) {
+        started++;
+    }
+    count_chunk(&chunks[0]);
+
+    // Count any slices whose thread could not be created here
+    for (size_t i = started; i < nthreads; i++) {
+        count_chunk(&chunks[i]);
+    }
+
+    for (size_t i = 0; i < nthreads; i++) {
+        if (i > 0 && i < started) {
+            pthread_join(chunks[i].thread, NULL);
+        }
+        counts->lines += chunks[i].counts.lines;
+        counts->words += chunks[i].counts.words;
+        counts->bytes += chunks[i].counts.bytes;
+        if (i > 0 && chunks[i - 1].last_in_word && !space_tab[chunks[i].buf[0]]) {
+            counts->words--;
+        }
+    }
+}
+
+// Count a descriptor that cannot be mapped, one large read at a time
+static int count_stream(int fd, WcCounts *counts) {
+    unsigned char *buf = malloc(WC_READ_SIZE);
+    if (buf == NULL) return -1;
+
+    int in_word = 0;
+    int ret = 0;
+    ssize_t n;
+    while ((n = read(fd, buf, WC_READ_SIZE)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            ret = -1;
+            break;
+        }
+        wc_count_buf(buf, n, counts, &in_word);
+    }
+    free(buf);
+    return ret;
+}
+
+/**
+ * Counts everything readable from fd
+ * Note: Non-empty regular files are memory mapped; everything else
+ *       (pipes, terminals, files mmap refuses) is streamed
+ */
+int wc_count_fd(int fd, WcCounts *counts) {
+    counts->lines = counts->words = counts->bytes = 0;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        off_t pos = lseek(fd, 0, SEEK_CUR);
+        if (pos >= 0 && pos < st.st_size) {
+            size_t len = st.st_size;
+            void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, len, MADV_SEQUENTIAL);
+                madvise(map, len, MADV_WILLNEED);
+                count_mapped((const unsigned char *)map + pos, len - pos, counts);
+                munmap(map, len);
+                lseek(fd, 0, SEEK_END);
+                return 0;
+            }
+        }
+    }
+    return count_stream(fd, counts);
+}
@@ -0,0 +1,37 @@
+#ifndef WC_COUNT_H
+#define WC_COUNT_H
+
+#include <stddef.h>   // For size_t
+#include <stdint.h>   // For uint64_t
+
+/**
+ * Line, word and byte totals for one input
+ */
+typedef struct WcCounts {
+    uint64_t lines;   // Number of '\n' bytes
+    uint64_t words;   // Number of maximal runs of non-whitespace bytes
+    uint64_t bytes;   // Number of bytes
+} WcCounts;
+
+/**
+ * Adds the counts for buf to counts
+ * @param buf Bytes to count
+ * @param len Number of bytes in buf
+ * @param counts Totals to add to
+ * @param in_word In: whether the byte before buf ended a word
+ *                Out: whether the last byte of buf is part of a word
+ * Note: Uses AVX2 or SSE2 when the CPU has them, scalar code otherwise.
+ *       Whitespace matches isspace() in the C locale.
+ */
+void wc_count_buf(const unsigned char *buf, size_t len, WcCounts *counts, int *in_word);
+
+/**
+ * Counts everything readable from fd
+ * @param fd Descriptor to count; regular files are memory mapped and
+ *           large ones are split across threads
+ * @param counts Set to the totals for fd
+ * @return 0 on success, -1 on error
+ */
+int wc_count_fd(int fd, WcCounts *counts);
+
+#endif
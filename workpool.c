@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "workpool.h"
+#include "io_helpers.h"
+
+// Initial slots per deque
+#define DEQUE_INIT_CAP 64
+
+// Pool and worker index of the calling thread, if it is a worker
+static __thread WorkPool *cur_pool = NULL;
+static __thread size_t cur_worker = 0;
+
+/* Push onto the owner's end of a deque, growing it if needed
+ * Exits the shell on allocation failure
+ */
+static void deque_push(WorkDeque *dq, WorkItem item) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail - dq->head == dq->cap) {
+        size_t new_cap = dq->cap ? dq->cap * 2 : DEQUE_INIT_CAP;
+        WorkItem *items = malloc(new_cap * sizeof(WorkItem));
+        if (items == NULL) {
+            perror("workpool malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = dq->head; i != dq->tail; i++) {
+            items[i & (new_cap - 1)] = dq->items[i & (dq->cap - 1)];
+        }
+        free(dq->items);
+        dq->items = items;
+        dq->cap = new_cap;
+    }
+    dq->items[dq->tail++ & (dq->cap - 1)] = item;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+/* Take from a deque: the owner pops its newest item, thieves the oldest
+ * Return: 1 if an item was taken, 0 if the deque was empty
+ */
+static int deque_take(WorkDeque *dq, WorkItem *item, int steal) {
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head != dq->tail) {
+        if (steal) {
+            *item = dq->items[dq->head++ & (dq->cap - 1)];
+        } else {
+            *item = dq->items[--dq->tail & (dq->cap - 1)];
+        }
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+// Find work for worker id: its own deque first, then steal round-robin
+static int find_work(WorkPool *pool, size_t id, WorkItem *item) {
+    if (deque_take(&pool->deques[id], item, 0)) return 1;
+    for (size_t i = 1; i < pool->nworkers; i++) {
+        if (deque_take(&pool->deques[(id + i) % pool->nworkers], item, 1)) return 1;
+    }
+    return 0;
+}
+
+// Run one item and wake waiters if it was the last one outstanding
+static void run_item(WorkPool *pool, WorkItem *item) {
+    item->fn(item->arg);
+    if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* Block until work may be available
+ * Return: 1 if an item was found, 0 if the caller should stop looking
+ * (the pool is shutting down, or for_wait is set and nothing is pending)
+ * Note: idle is raised before the final scan, so a submitter that pushes
+ *       after the scan is guaranteed to see it and signal
+ */
+static int wait_for_work(WorkPool *pool, size_t id, WorkItem *item, int for_wait) {
+    pthread_mutex_lock(&pool->lock);
+    __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    int found = 0;
+    while (1) {
+        if (pool->shutdown) break;
+        if (for_wait && __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0) break;
+        if (find_work(pool, id, item)) {
+            found = 1;
+            break;
+        }
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool->lock);
+    return found;
+}
+
+// Worker thread loop for workers 1..nworkers-1
+static void *worker_main(void *arg) {
+    WorkPool *pool = arg;
+
+    // Claim a worker index
+    pthread_mutex_lock(&pool->lock);
+    size_t id = 1;
+    while (id < pool->nworkers && pool->threads[id - 1] != pthread_self()) {
+        id++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    cur_pool = pool;
+    cur_worker = id;
+    set_thread_output(pool->out);
+
+    WorkItem item;
+    while (1) {
+        if (find_work(pool, id, &item) || wait_for_work(pool, id, &item, 0)) {
+            run_item(pool, &item);
+        } else {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Starts a pool
+ * Note: Falls back to fewer workers if threads cannot be created
+ */
+WorkPool *workpool_create(size_t nworkers) {
+    if (nworkers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = cpus > 0 ? (size_t)cpus : 1;
+    }
+
+    WorkPool *pool = calloc(1, sizeof(WorkPool));
+    if (pool == NULL) return NULL;
+    pool->deques = calloc(nworkers, sizeof(WorkDeque));
+    pool->threads = calloc(nworkers, sizeof(pthread_t));
+    if (pool->deques == NULL || pool->threads == NULL) {
+        free(pool->deques);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    for (size_t i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->out = get_thread_output();
+
+    // Hold the lock so workers see a complete thread table when claiming ids
+    pool->nworkers = nworkers;
+    pthread_mutex_lock(&pool->lock);
+    size_t started = 1;
+    while (started < nworkers &&
+           pthread_create(&pool->threads[started - 1], NULL, worker_main, pool) == 0) {
+        started++;
+    }
+    pool->nworkers = started;
+    pthread_mutex_unlock(&pool->lock);
+    return pool;
+}
+
+/**
+ * Queues fn(arg)
+ * Note: Items submitted from outside the pool go to worker 0, the
+ *       thread that will call workpool_wait()
+ */
+void workpool_submit(WorkPool *pool, work_fn fn, void *arg) {
+    size_t id = (cur_pool == pool) ? cur_worker : 0;
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    deque_push(&pool->deques[id], (WorkItem){fn, arg});
+
+    if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/**
+ * Runs queued work on the calling thread until every item has finished
+ */
+void workpool_wait(WorkPool *pool) {
+    WorkPool *saved_pool = cur_pool;
+    size_t saved_worker = cur_worker;
+    cur_pool = pool;
+    cur_worker = 0;
+
+    WorkItem item;
+    while (find_work(pool, 0, &item) || wait_for_work(pool, 0, &item, 1)) {
+        run_item(pool, &item);
+    }
+
+    cur_pool = saved_pool;
+    cur_worker = saved_worker;
+}
+
+/**
+ * Stops the worker threads and frees the pool
+ */
+void workpool_destroy(WorkPool *pool) {
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 1; i < pool->nworkers; i++) {
+        pthread_join(pool->threads[i - 1], NULL);
+    }
+    for (size_t i = 0; i < pool->nworkers; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].items);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,70 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <pthread.h>  // For pthread types
+#include <stddef.h>   // For size_t
+
+/* Type for work item functions
+ * Input: the argument given to workpool_submit
+ * Work items may submit further items to the same pool.
+ */
+typedef void (*work_fn)(void *arg);
+
+// A unit of work queued on a worker's deque
+typedef struct WorkItem {
+    work_fn fn;   // Function to run
+    void *arg;    // Argument passed to fn
+} WorkItem;
+
+// Double-ended queue owned by one worker
+typedef struct WorkDeque {
+    pthread_mutex_t lock;  // Protects everything below
+    WorkItem *items;       // Ring buffer of queued work
+    size_t cap;            // Allocated slots (power of two)
+    size_t head;           // Index thieves take from
+    size_t tail;           // Index the owner pushes and pops at
+} WorkDeque;
+
+/**
+ * Work-stealing thread pool
+ * Each worker pushes and pops its own deque LIFO, keeping related work
+ * together, and steals FIFO from the others when it runs dry. The thread
+ * calling workpool_wait() takes part as worker 0, so a pool with one
+ * worker runs everything on the caller.
+ */
+typedef struct WorkPool {
+    size_t nworkers;          // Worker count, including the waiting caller
+    WorkDeque *deques;        // One deque per worker
+    pthread_t *threads;       // Threads for workers 1..nworkers-1
+    pthread_mutex_t lock;     // Protects pending, shutdown and idle waits
+    pthread_cond_t cond;      // Signalled when work arrives or finishes
+    size_t pending;           // Items submitted but not yet finished
+    size_t idle;              // Workers sleeping on cond
+    int shutdown;             // Set to stop the worker threads
+    struct OutBuf *out;       // Creator's output buffer, used by the workers
+} WorkPool;
+
+/**
+ * Starts a pool
+ * @param nworkers Workers to use; 0 means one per online CPU
+ * @return Newly allocated pool, or NULL on failure
+ */
+WorkPool *workpool_create(size_t nworkers);
+
+/**
+ * Queues fn(arg); called from a worker it goes on that worker's deque
+ */
+void workpool_submit(WorkPool *pool, work_fn fn, void *arg);
+
+/**
+ * Runs queued work on the calling thread until every item has finished
+ */
+void workpool_wait(WorkPool *pool);
+
+/**
+ * Stops the worker threads and frees the pool
+ * Prereq: workpool_wait() has returned
+ */
+void workpool_destroy(WorkPool *pool);
+
+#endif